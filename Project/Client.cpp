@@ -3,13 +3,13 @@
  * Creado para Windows y CLion.
  *
  * Cliente de línea de comandos (CLI) para el servidor Loqui.
- * Utiliza dos hilos:
+ * La conexión la lleva la biblioteca loqui_client (loqui_client.h):
  * 1. Hilo Principal: Para enviar comandos (Login, Msg, List, etc.)
- * 2. Hilo Receptor: Para escuchar permanentemente al servidor (RF-4.0)
+ * 2. Hilos de la biblioteca: escuchan permanentemente al servidor (RF-4.0),
+ *    envían lo encolado y reconectan si se corta la conexión
+ * Las subidas de adjuntos usan además un hilo propio por archivo.
  */
 
-#include <winsock2.h>
-#include <ws2tcpip.h>
 #include <iostream>
 #include <string>
 #include <thread>
@@ -17,6 +17,14 @@
 #include <sstream> // <-- AÑADIR ESTA LÍNEA
 #include <algorithm>
 #include <ctime>
+#include <map>
+#include <set>
+#include <mutex>
+#include <fstream> // Caché local de historial
+#include <filesystem>
+#include <atomic>
+#include "picosha2.h" // SHA-256 de los adjuntos
+#include "loqui_client.h" // Conexión con el servidor (TLS opcional: cmake -DLOQUI_ENABLE_TLS=ON)
 
 #ifdef _WIN32
 #include <windows.h>
@@ -24,13 +32,90 @@
 
 using namespace std;
 
+// --- Caché local de historial (una por conversación) ---
+// Archivo loqui_cache/<host>_<puerto>/<usuario>/<otro>.cache con líneas
+// "M|timestamp|sender|mensaje" y "I|ultimoId" (id del último mensaje guardado).
+struct CachedMessage {
+    string timestamp;
+    string sender;
+    string text;
+};
+struct ConversationCache {
+    long long lastId = -1; // -1 = nada en caché
+    vector<CachedMessage> messages;
+};
+map<string, ConversationCache> g_historyCache; // otherUser -> caché en memoria
+mutex g_cacheMutex;
+string g_cacheRoot;        // loqui_cache/<host>_<puerto>
+string g_loggedUser;       // Usuario con sesión iniciada (vacío = sin caché)
+string g_pendingLoginUser; // Usuario del último "login" enviado
+
+// --- Conexión ---
+LoquiClient* g_client = nullptr;
+
+// --- Adjuntos ---
+// Las subidas se anuncian con UPLOAD_BEGIN y se envían por trozos desde un hilo
+// propio; las descargas se escriben en descargas/<nombre>.part y se renombran
+// al verificar el SHA-256, así una descarga cortada se reanuda donde quedó.
+const size_t UPLOAD_CHUNK_SIZE = 64 * 1024;
+const size_t UPLOAD_QUEUE_MAX = 4 * UPLOAD_CHUNK_SIZE; // Trozos encolados como mucho por delante del socket
+struct Upload {
+    string path;
+    string toUser;
+    string name;
+    long long size = 0;
+    long long resumeAt = -1;     // Posición pedida por el servidor (UPLOAD_OFFSET)
+    bool active = false;         // Hay un hilo enviando trozos
+    bool awaitingOffset = false; // UPLOAD_BEGIN enviado, sin UPLOAD_OFFSET todavía
+};
+struct Download {
+    string path; // Destino final; mientras tanto path + ".part"
+    long long size = -1;
+    long long written = 0; // Tamaño actual del .part
+    ofstream file;
+};
+map<string, Upload> g_uploads;     // sha -> subida en curso
+map<string, Download> g_downloads; // sha -> descarga en curso
+map<string, string> g_attachmentNames; // sha -> nombre visto en un mensaje
+mutex g_attachmentsMutex;
+const string DOWNLOADS_DIR = "descargas";
+
 // Prototipos
-void receiveMessages(SOCKET serverSocket);
+void sendToServer(const string& request);
+void handleIncomingLine(const string& message);
+void handleServerLine(const string& message);
 vector<string> split(const string& s, char delimiter);
-
-// Variable global para controlar el hilo receptor
-bool g_running = true;
+void printHistory(const string& otherUser, const vector<CachedMessage>& messages, const string& title);
+void requestHistory(const string& otherUser);
+ConversationCache& loadCache(const string& otherUser);
+void updateCache(const string& otherUser, long long lastId, bool reset, const vector<CachedMessage>& newMessages);
+string hashFile(const string& path);
+string displayText(const string& text);
+string safeFileName(const string& name);
+void startUpload(const string& toUser, const string& path);
+void beginUpload(const string& sha);
+void failUpload(const string& sha, const string& reason);
+void uploadChunks(string sha);
+void startDownload(const string& sha, const string& path);
+void handleFileData(const string& header, const string& data);
+void handleAttachmentLine(const vector<string>& parts);
+
+// Variable global para controlar el bucle principal y las subidas
+atomic<bool> g_running{true};
+// Chat abierto: lo cambia el hilo principal y lo leen los callbacks de la
+// biblioteca (otro hilo), así que siempre con g_chatUserMutex
 string g_currentChatUser = "";
+mutex g_chatUserMutex;
+
+string currentChatUser() {
+    lock_guard<mutex> lock(g_chatUserMutex);
+    return g_currentChatUser;
+}
+
+void setCurrentChatUser(const string& user) {
+    lock_guard<mutex> lock(g_chatUserMutex);
+    g_currentChatUser = user;
+}
 
 void setupConsole() {
 #ifdef _WIN32
@@ -47,7 +132,7 @@ void setupConsole() {
     SetCurrentConsoleFontEx(hConsole, FALSE, &fontInfo);
 #endif
 }
-void chatSession(SOCKET serverSocket, const std::string& targetUser) {
+void chatSession(const std::string& targetUser) {
     cout << "\n";
     cout << "┌──────────────────────────────────────────┐" << std::endl;
     cout << "│              💬 CHAT CON " << targetUser;
@@ -55,13 +140,13 @@ void chatSession(SOCKET serverSocket, const std::string& targetUser) {
     for (int i = targetUser.length(); i < 12; i++) std::cout << " ";
     cout << "│" << std::endl;
     cout << "└──────────────────────────────────────────┘" << std::endl;
-    cout << "💡 Comandos: /salir, /historial" << std::endl;
+    cout << "💡 Comandos: /salir, /historial, /enviar <ruta>" << std::endl;
     cout << "────────────────────────────────────────────" << std::endl;
 
-    g_currentChatUser = targetUser;
+    setCurrentChatUser(targetUser);
     string message;
 
-    while (g_running && g_currentChatUser == targetUser) {
+    while (g_running && currentChatUser() == targetUser) {
         cout << "\n┌─[" << targetUser << "]\n";
         cout << "└─➤ ";
         getline(std::cin, message);
@@ -73,21 +158,25 @@ void chatSession(SOCKET serverSocket, const std::string& targetUser) {
             break;
         }
 
-        // Comando para ver historial
+        // Comando para ver historial (caché local + solo lo nuevo del servidor)
         if (message == "/historial") {
-            string request = "HISTORY|" + targetUser;
-            send(serverSocket, request.c_str(), request.length(), 0);
+            requestHistory(targetUser);
             continue;
         }
 
+        // Adjuntar un archivo a esta conversación
+        if (message.rfind("/enviar ", 0) == 0) {
+            startUpload(targetUser, message.substr(8));
+            continue;
+        }
 
 
         // Enviar mensaje normal
         string request = "MSG|" + targetUser + "|" + message;
-        send(serverSocket, request.c_str(), request.length(), 0);
+        sendToServer(request);
     }
 
-    g_currentChatUser = "";
+    setCurrentChatUser("");
     cout << "\n";
     cout << "┌──────────────────────────────────────────┐" << std::endl;
     cout << "│             🚪 CHAT FINALIZADO.           │" << std::endl;
@@ -95,64 +184,91 @@ void chatSession(SOCKET serverSocket, const std::string& targetUser) {
     cout << "> " << std::flush;
 }
 
-int main() {
+int main(int argc, char* argv[]) {
+    // Uso: LoquiClient [host] [puerto] [--tls [ca.pem]]  (por defecto 127.0.0.1 12345, sin TLS)
+    //      LoquiClient unix:<ruta>                     (socket local del servidor, unix.path)
+    string serverHost = argc > 1 ? argv[1] : "127.0.0.1";
+    bool local = serverHost.rfind("unix:", 0) == 0;
+    int serverPort = argc > 2 && !local ? atoi(argv[2]) : 12345;
+    bool useTls = argc > 3 && string(argv[3]) == "--tls";
+    string caFile = argc > 4 ? argv[4] : "";
+    if (local) {
+        // La ruta no sirve como nombre de directorio
+        string name = serverHost;
+        for (char& c : name) {
+            if (!isalnum((unsigned char)c)) c = '_';
+        }
+        g_cacheRoot = "loqui_cache/" + name;
+    } else {
+        g_cacheRoot = "loqui_cache/" + serverHost + "_" + to_string(serverPort);
+    }
+
     // Configurar consola para Unicode
     setupConsole();
 
-    WSADATA wsaData;
-    int iResult;
-
-    // 1. Inicializar Winsock
-    iResult = WSAStartup(MAKEWORD(2, 2), &wsaData);
-    if (iResult != 0) {
-        cerr << "WSAStartup failed: " << iResult << std::endl;
-        return 1;
-    }
-
-    // 2. Crear Socket
-    SOCKET serverSocket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-    if (serverSocket == INVALID_SOCKET) {
-        cerr << "socket() failed: " << WSAGetLastError() << std::endl;
-        WSACleanup();
-        return 1;
+    LoquiClient::Options options;
+    if (local) {
+        // Socket local: mismo protocolo, sin TLS
+        options.unixPath = serverHost.substr(5);
+    } else {
+        options.host = serverHost;
+        options.port = serverPort;
+        options.tls = useTls;
+        options.caFile = caFile;
+        options.tlsSessionFile = g_cacheRoot + "/tls.session"; // Ticket para reanudar al reconectar
+        if (useTls) {
+            error_code ec;
+            filesystem::create_directories(g_cacheRoot, ec);
+            if (caFile.empty()) {
+                cout << "⚠️ TLS sin verificar el certificado del servidor (indica una CA para verificarlo)." << std::endl;
+            }
+        }
     }
 
-    // 3. Configurar Dirección del Servidor (localhost:12345)
-    sockaddr_in serverAddr;
-    serverAddr.sin_family = AF_INET;
-    serverAddr.sin_port = htons(12345);
-    // Usaremos "127.0.0.1" (localhost)
-    iResult = inet_pton(AF_INET, "127.0.0.1", &serverAddr.sin_addr);
-    if (iResult <= 0) {
-        cerr << "inet_pton failed" << std::endl;
-        closesocket(serverSocket);
-        WSACleanup();
-        return 1;
-    }
+    LoquiClient client(options);
+    client.onLine = handleIncomingLine;
+    client.onFileData = handleFileData;
+    client.onState = [](LoquiClient::State state, const string& detail) {
+        if (state == LoquiClient::DISCONNECTED) {
+            cout << "\r[" << detail << ", reconectando...]" << std::endl;
+        } else if (state == LoquiClient::CONNECTED) {
+            cout << "\r[" << detail << "]" << std::endl << "> " << std::flush;
+            // La sesión nueva no sabe nada de las subidas a medias: se vuelven a
+            // empezar y el servidor dice desde dónde seguir
+            vector<string> pending;
+            {
+                lock_guard<mutex> lock(g_attachmentsMutex);
+                for (const auto& [sha, upload] : g_uploads) pending.push_back(sha);
+            }
+            for (const string& sha : pending) beginUpload(sha);
+        }
+    };
+    g_client = &client;
 
-    // 4. Conectar al Servidor
-    iResult = connect(serverSocket, (SOCKADDR*)&serverAddr, sizeof(serverAddr));
-    if (iResult == SOCKET_ERROR) {
-        std::cerr << "connect() failed: " << WSAGetLastError() << std::endl;
-        closesocket(serverSocket);
-        WSACleanup();
+    // Conectar (TCP o socket local), TLS opcional y HELLO con soporte de adjuntos
+    string error;
+    if (!client.start(error)) {
+        cerr << error << std::endl;
         return 1;
     }
+    if (!client.tlsInfo().empty()) cout << "🔒 TLS " << client.tlsInfo() << std::endl;
 
     cout << "--- Comandos Disponibles ---" << std::endl;
     cout << "register <usuario> <pass>" << std::endl;
     cout << "login <usuario> <pass>" << std::endl;
+    cout << "login-local <usuario>      <- Sin contraseña (solo por el socket local)" << std::endl;
     cout << "msg <usuario_destino> <mensaje>" << std::endl;
+    cout << "multi <u1,u2,...> <mensaje> <- Mismo mensaje a varios usuarios" << std::endl;
     cout << "chat <usuario_destino>     <- NUEVO: Sesión de chat continua" << std::endl;
     cout << "historial <usuario>        <- Ver historial de mensajes" << std::endl;
+    cout << "enviar <usuario> <ruta>    <- Enviar un archivo adjunto" << std::endl;
+    cout << "descargar <sha> [ruta]     <- Descargar un adjunto recibido" << std::endl;
     cout << "list" << std::endl;
+    cout << "snapshot                   <- (admin) Copia consistente de los datos del servidor" << std::endl;
     cout << "exit" << std::endl;
     cout << "----------------------------" << std::endl;
 
-    // 5. Iniciar hilo receptor (RF-4.0)
-    thread receiverThread(receiveMessages, serverSocket);
-
-    // 6. Bucle de envío (Hilo Principal)
+    // Bucle de envío (Hilo Principal); lo recibido llega a handleIncomingLine
     string line;
     while (g_running) {
         cout << "> ";
@@ -171,25 +287,51 @@ int main() {
             request = "REGISTER|" + parts[1] + "|" + parts[2];
         } else if (cmd == "login" && parts.size() == 3) {
             request = "LOGIN|" + parts[1] + "|" + parts[2];
+            {
+                lock_guard<mutex> lock(g_cacheMutex);
+                g_pendingLoginUser = parts[1];
+            }
+        } else if (cmd == "login-local" && parts.size() == 2) {
+            request = "LOGIN_LOCAL|" + parts[1];
+            {
+                lock_guard<mutex> lock(g_cacheMutex);
+                g_pendingLoginUser = parts[1];
+            }
         } else if (cmd == "msg" && parts.size() >= 3) {
             request = "MSG|" + parts[1] + "|";
             // Reconstruir el mensaje
             for (size_t i = 2; i < parts.size(); ++i) {
                 request += parts[i] + (i == parts.size() - 1 ? "" : " ");
             }
+        } else if (cmd == "multi" && parts.size() >= 3) {
+            request = "MSGMULTI|" + parts[1] + "|";
+            for (size_t i = 2; i < parts.size(); ++i) {
+                request += parts[i] + (i == parts.size() - 1 ? "" : " ");
+            }
         } else if (cmd == "chat" && parts.size() == 2) {
             // NUEVO COMANDO: Iniciar sesión de chat
             string targetUser = parts[1];
-            chatSession(serverSocket, targetUser);
+            chatSession(targetUser);
             continue; // Importante: continuar sin enviar request
         } else if (cmd == "list") {
             request = "LIST";
+        } else if (cmd == "snapshot") {
+            request = "SNAPSHOT";
         } else if (cmd == "historial" && parts.size() == 2) {
             // Comando para ver historial sin entrar en chat
-            request = "HISTORY|" + parts[1];
+            requestHistory(parts[1]);
+            continue;
+        } else if (cmd == "enviar" && parts.size() >= 3) {
+            // La ruta puede contener espacios
+            startUpload(parts[1], line.substr(line.find(parts[1]) + parts[1].size() + 1));
+            continue;
+        } else if (cmd == "descargar" && (parts.size() == 2 || parts.size() == 3)) {
+            startDownload(parts[1], parts.size() == 3 ? parts[2] : "");
+            continue;
         } else if (cmd == "exit") {
-            request = "DC"; // Disconnect
+            client.send("DC"); // Disconnect
             g_running = false;
+            break;
         } else {
             cout << "Comando no reconocido." << std::endl;
             continue;
@@ -197,158 +339,146 @@ int main() {
 
 
         // Enviar comando al servidor
-        send(serverSocket, request.c_str(), request.length(), 0);
-
-        if (cmd == "exit") {
-            break;
-        }
+        sendToServer(request);
     }
 
-    // 7. Limpieza
-    receiverThread.join(); // Esperar a que el hilo receptor termine
-    closesocket(serverSocket);
-    WSACleanup();
+    // Limpieza: stop() envía lo pendiente (DC) antes de cerrar
+    client.stop();
+    g_client = nullptr;
     return 0;
 }
 
-// Hilo para recibir mensajes del servidor
-// Hilo para recibir mensajes del servidor
-void receiveMessages(SOCKET serverSocket) {
-    char recvbuf[512];
-    int iResult;
-
-    while (g_running) {
-        iResult = recv(serverSocket, recvbuf, sizeof(recvbuf), 0);
-
-        if (iResult > 0) {
-            string message(recvbuf, iResult);
-
-            // Borrar la línea actual ("> ") para imprimir limpiamente
-            cout << "\r" << std::flush;
-
-            // --- Procesamiento de Respuestas del Servidor ---
-            vector<std::string> parts = split(message, '|');
-            if (parts.empty()) continue;
-
-            string type = parts[0];
+// Líneas del servidor que no son respuesta a una petición con callback
+// (se llama desde el hilo lector de loqui_client)
+void handleIncomingLine(const string& message) {
+    vector<string> parts = split(message, '|');
+    if (!parts.empty() && (parts[0].rfind("UPLOAD_", 0) == 0 || parts[0].rfind("FILE_", 0) == 0)) {
+        handleAttachmentLine(parts);
+    } else if (!message.empty() && parts[0] != "HELLO") {
+        handleServerLine(message);
+    }
+}
 
-            if (type == "RESP") {
-                // RESP|OK|Mensaje... o RESP|ERROR|Mensaje...
-                if (parts.size() >= 3) {
-                    cout << "[Servidor " << parts[1] << "]: " << parts[2] << std::endl;
-                }
-            } else if (type == "MSG") {
-                // NUEVO FORMATO: MSG|timestamp|deUsuario|Mensaje...
-                if (parts.size() >= 4) {
-                    string timestamp = parts[1];
-                    string fromUser = parts[2];
-                    string chatMsg = parts[3];
-
-                    // Reconstruir el mensaje si tenía '|' en el contenido
-                    for (size_t i = 4; i < parts.size(); ++i) {
-                        chatMsg += "|" + parts[i];
-                    }
-
-                    // Formato mejorado para mensajes entrantes
-                    if (!g_currentChatUser.empty() && fromUser == g_currentChatUser) {
-                        // Mensaje del usuario con el que estamos chateando ACTUALMENTE
-                        cout << "┌─[" << timestamp << "] " << fromUser << "\n";
-                        cout << "│ " << chatMsg << "\n";
-                        cout << "└──────────────────────────────────────────\n";
-                        cout << "┌─[" << g_currentChatUser << "]\n";  // <-- AÑADE ESTA LÍNEA
-                        cout << "└─➤ " << std::flush;  // <-- Y ESTA
-                    } else if (!g_currentChatUser.empty()) {
-                        // Mensaje de OTRO usuario mientras estamos en chat con alguien
-                        cout << "┌─🚨 MENSAJE DE " << fromUser << "\n";
-                        cout << "│ [" << timestamp << "]\n";
-                        cout << "│ " << chatMsg << "\n";
-                        cout << "└──────────────────────────────────────────\n";
-                        cout << "┌─[" << g_currentChatUser << "]\n";  // <-- AÑADE ESTA LÍNEA
-                        cout << "└─➤ " << std::flush;  // <-- Y ESTA
-                    } else {
-                        // Mensaje recibido cuando NO estamos en un chat activo
-                        cout << "┌─[" << timestamp << "] " << fromUser << "\n";
-                        cout << "│ " << chatMsg << "\n";
-                        cout << "└──────────────────────────────────────────\n";
-                        cout << "> " << std::flush;  // Prompt normal
-                    }
-                }
-            } else if (type == "HISTORY_RESP") {
-
-    // HISTORY_RESP|otherUser|timestamp1|sender1|message1|timestamp2|sender2|message2...
-    if (parts.size() >= 2) {
-        string otherUser = parts[1];
-        cout << "\n";
-        cout << "┌──────────────────────────────────────────┐" << std::endl;
-        cout << "│           📜 HISTORIAL CON " << otherUser;
-        // Añadir espacios para alinear
-        for (int i = otherUser.length(); i < 10; i++) std::cout << " ";
-        cout << "│" << std::endl;
-        cout << "└──────────────────────────────────────────┘" << std::endl;
-
-        if (parts.size() >= 5) {
-            int messageCount = 0;
-            for (size_t i = 2; i + 2 < parts.size(); i += 3) {
-                string timestamp = parts[i];
-                string sender = parts[i+1];
-                string msg = parts[i+2];
-
-                // Determinar si el mensaje es propio o del otro usuario
-                if (sender == otherUser) {
-                    // Mensaje del otro usuario
-                    cout << "┌─[" << timestamp << "] " << otherUser << "\n";
-                    cout << "│ " << msg << "\n";
-                } else {
-                    // Mensaje propio
-                    cout << "┌─[" << timestamp << "] 🟢 Tú\n";
-                    cout << "│ " << msg << "\n";
-                }
-                cout << "└──────────────────────────────────────────" << std::endl;
-                messageCount++;
+// Procesa un mensaje completo del servidor
+void handleServerLine(const string& message) {
+    // Borrar la línea actual ("> ") para imprimir limpiamente
+    cout << "\r" << std::flush;
+
+    // --- Procesamiento de Respuestas del Servidor ---
+    vector<std::string> parts = split(message, '|');
+    if (parts.empty()) return;
+
+    string type = parts[0];
+
+    if (type == "RESP") {
+        // RESP|OK|Mensaje... o RESP|ERROR|Mensaje...
+        if (parts.size() >= 3) {
+            cout << "[Servidor " << parts[1] << "]: " << parts[2] << std::endl;
+            if (parts[1] == "OK" && parts[2].rfind("Login exitoso", 0) == 0) {
+                // A partir de ahora la caché de historial es la de este usuario
+                lock_guard<mutex> lock(g_cacheMutex);
+                g_loggedUser = g_pendingLoginUser;
+                g_historyCache.clear();
             }
-            cout << "📊 Total: " << messageCount << " mensajes" << std::endl;
-        } else {
-            cout << "📭 No hay mensajes en el historial." << std::endl;
-        }
-
-        cout << "──────────────────────────────────────────" << std::endl;
-
-        // Reimprimir el prompt apropiado
-        if (!g_currentChatUser.empty()) {
-            cout << "┌─[" << g_currentChatUser << "]\n";
-            cout << "└─➤ " << std::flush;
-        } else {
-            cout << "> " << std::flush;
         }
-
-
-                }
-            } else if (type == "LIST_RESP") {
-                // LIST_RESP|userA|userB...
-                cout << "[Usuarios Conectados]: ";
-                for (size_t i = 1; i < parts.size(); ++i) {
-                    cout << parts[i] << (i == parts.size() - 1 ? "" : ", ");
-                }
-                cout << std::endl;
+    } else if (type == "MSG") {
+        // NUEVO FORMATO: MSG|timestamp|deUsuario|Mensaje...
+        if (parts.size() >= 4) {
+            string timestamp = parts[1];
+            string fromUser = parts[2];
+            string chatMsg = parts[3];
+
+            // Reconstruir el mensaje si tenía '|' en el contenido
+            for (size_t i = 4; i < parts.size(); ++i) {
+                chatMsg += "|" + parts[i];
+            }
+            chatMsg = displayText(chatMsg);
+            string chatUser = currentChatUser();
+
+            // Formato mejorado para mensajes entrantes
+            if (!chatUser.empty() && fromUser == chatUser) {
+                // Mensaje del usuario con el que estamos chateando ACTUALMENTE
+                cout << "┌─[" << timestamp << "] " << fromUser << "\n";
+                cout << "│ " << chatMsg << "\n";
+                cout << "└──────────────────────────────────────────\n";
+                cout << "┌─[" << chatUser << "]\n";  // <-- AÑADE ESTA LÍNEA
+                cout << "└─➤ " << std::flush;  // <-- Y ESTA
+            } else if (!chatUser.empty()) {
+                // Mensaje de OTRO usuario mientras estamos en chat con alguien
+                cout << "┌─🚨 MENSAJE DE " << fromUser << "\n";
+                cout << "│ [" << timestamp << "]\n";
+                cout << "│ " << chatMsg << "\n";
+                cout << "└──────────────────────────────────────────\n";
+                cout << "┌─[" << chatUser << "]\n";  // <-- AÑADE ESTA LÍNEA
+                cout << "└─➤ " << std::flush;  // <-- Y ESTA
             } else {
-                cout << "[Servidor]: " << message << std::endl;
+                // Mensaje recibido cuando NO estamos en un chat activo
+                cout << "┌─[" << timestamp << "] " << fromUser << "\n";
+                cout << "│ " << chatMsg << "\n";
+                cout << "└──────────────────────────────────────────\n";
+                cout << "> " << std::flush;  // Prompt normal
             }
+        }
+    } else if (type == "HISTORY_RESP") {
+        // HISTORY_RESP|otherUser|timestamp1|sender1|message1|timestamp2|sender2|message2...
+        if (parts.size() >= 2) {
+            vector<CachedMessage> messages;
+            for (size_t i = 2; i + 2 < parts.size(); i += 3) {
+                messages.push_back({parts[i], parts[i+1], parts[i+2]});
+            }
+            printHistory(parts[1], messages, "📜 HISTORIAL CON ");
+        }
+    } else if (type == "HISTORY_DELTA") {
+        // HISTORY_DELTA|otherUser|ultimoId|reset|timestamp|sender|message...
+        if (parts.size() >= 4) {
+            string otherUser = parts[1];
+            bool reset = parts[3] == "1";
+            vector<CachedMessage> newMessages;
+            for (size_t i = 4; i + 2 < parts.size(); i += 3) {
+                newMessages.push_back({parts[i], parts[i+1], parts[i+2]});
+            }
+            updateCache(otherUser, atoll(parts[2].c_str()), reset, newMessages);
 
-            cout << "> " << std::flush; // Reimprimir el prompt
-
-        } else if (iResult == 0) {
-            cout << "\r[Conexion cerrada por el servidor]" << std::endl;
-            g_running = false;
-            break;
-        } else {
-            // Error si g_running es false (salida intencional)
-            if (g_running) {
-                cerr << "\rrecv() failed: " << WSAGetLastError() << std::endl;
+            if (reset) {
+                // La caché no servía: se muestra la conversación completa
+                printHistory(otherUser, newMessages, "📜 HISTORIAL CON ");
+            } else if (!newMessages.empty()) {
+                printHistory(otherUser, newMessages, "🆕 NUEVOS DE ");
+            } else {
+                cout << "✅ Historial con " << otherUser << " al dia." << std::endl;
+                string chatUser = currentChatUser();
+                if (!chatUser.empty()) {
+                    cout << "┌─[" << chatUser << "]\n";
+                    cout << "└─➤ " << std::flush;
+                }
             }
-            g_running = false;
-            break;
         }
+    } else if (type == "MSGMULTI_RESP" || type == "MSGBATCH_RESP") {
+        // MSGMULTI_RESP|dest|estado... / MSGBATCH_RESP|linea|dest|estado...
+        size_t step = type == "MSGMULTI_RESP" ? 2 : 3;
+        cout << "[Envio multiple]:";
+        for (size_t i = 1; i + step - 1 < parts.size(); i += step) {
+            const string& status = parts[i + step - 1];
+            string icon = status == "ENTREGADO" ? "✅" : status == "NOEXISTE" ? "❌" : "💾";
+            cout << " " << parts[i + step - 2] << " " << icon << " " << status;
+        }
+        cout << std::endl;
+    } else if (type == "SNAPSHOT_RESP" && parts.size() >= 3) {
+        // SNAPSHOT_RESP|OK|directorio|offsetUsuarios|offsetHistorial o SNAPSHOT_RESP|ERROR|texto
+        if (parts[1] == "OK") cout << "📦 Snapshot listo en " << parts[2] << std::endl;
+        else cout << "❌ Snapshot fallido: " << parts[2] << std::endl;
+    } else if (type == "LIST_RESP") {
+        // LIST_RESP|userA|userB...
+        cout << "[Usuarios Conectados]: ";
+        for (size_t i = 1; i < parts.size(); ++i) {
+            cout << parts[i] << (i == parts.size() - 1 ? "" : ", ");
+        }
+        cout << std::endl;
+    } else {
+        cout << "[Servidor]: " << message << std::endl;
     }
+
+    cout << "> " << std::flush; // Reimprimir el prompt
 }
 
 // Función auxiliar para dividir strings (simple)
@@ -362,4 +492,414 @@ vector<std::string> split(const std::string& s, char delimiter) {
         tokens.push_back(token);
     }
     return tokens;
-}
\ No newline at end of file
+}
+// Muestra una lista de mensajes con el formato de historial
+void printHistory(const string& otherUser, const vector<CachedMessage>& messages, const string& title) {
+    cout << "\n";
+    cout << "┌──────────────────────────────────────────┐" << std::endl;
+    cout << "│           " << title << otherUser;
+    // Añadir espacios para alinear
+    for (int i = otherUser.length(); i < 10; i++) std::cout << " ";
+    cout << "│" << std::endl;
+    cout << "└──────────────────────────────────────────┘" << std::endl;
+
+    if (!messages.empty()) {
+        for (const CachedMessage& m : messages) {
+            // Determinar si el mensaje es propio o del otro usuario
+            if (m.sender == otherUser) {
+                // Mensaje del otro usuario
+                cout << "┌─[" << m.timestamp << "] " << otherUser << "\n";
+                cout << "│ " << displayText(m.text) << "\n";
+            } else {
+                // Mensaje propio
+                cout << "┌─[" << m.timestamp << "] 🟢 Tú\n";
+                cout << "│ " << displayText(m.text) << "\n";
+            }
+            cout << "└──────────────────────────────────────────" << std::endl;
+        }
+        cout << "📊 Total: " << messages.size() << " mensajes" << std::endl;
+    } else {
+        cout << "📭 No hay mensajes en el historial." << std::endl;
+    }
+
+    cout << "──────────────────────────────────────────" << std::endl;
+
+    // Reimprimir el prompt apropiado
+    string chatUser = currentChatUser();
+    if (!chatUser.empty()) {
+        cout << "┌─[" << chatUser << "]\n";
+        cout << "└─➤ " << std::flush;
+    } else {
+        cout << "> " << std::flush;
+    }
+}
+
+// Muestra al instante lo que hay en caché y pide al servidor solo lo posterior
+void requestHistory(const string& otherUser) {
+    string request;
+    {
+        lock_guard<mutex> lock(g_cacheMutex);
+        if (g_loggedUser.empty()) {
+            // Sin sesión no hay caché: petición completa de siempre
+            request = "HISTORY|" + otherUser;
+        } else {
+            ConversationCache& cache = loadCache(otherUser);
+            if (!cache.messages.empty()) {
+                printHistory(otherUser, cache.messages, "💾 HISTORIAL CON ");
+            }
+            request = "HISTORY|" + otherUser + "|" + to_string(cache.lastId);
+        }
+    }
+    sendToServer(request);
+}
+
+static string cachePath(const string& otherUser) {
+    return g_cacheRoot + "/" + g_loggedUser + "/" + otherUser + ".cache";
+}
+
+// Devuelve la caché de la conversación, leyéndola de disco la primera vez.
+// Se llama con g_cacheMutex tomado.
+ConversationCache& loadCache(const string& otherUser) {
+    auto it = g_historyCache.find(otherUser);
+    if (it != g_historyCache.end()) return it->second;
+
+    ConversationCache& cache = g_historyCache[otherUser];
+    ifstream file(cachePath(otherUser));
+    string line;
+    while (getline(file, line)) {
+        if (line.rfind("I|", 0) == 0) {
+            cache.lastId = atoll(line.c_str() + 2);
+        } else if (line.rfind("M|", 0) == 0) {
+            // M|timestamp|sender|mensaje (el mensaje puede contener '|')
+            size_t p1 = line.find('|', 2);
+            size_t p2 = p1 == string::npos ? p1 : line.find('|', p1 + 1);
+            if (p2 == string::npos) continue;
+            cache.messages.push_back({line.substr(2, p1 - 2), line.substr(p1 + 1, p2 - p1 - 1), line.substr(p2 + 1)});
+        }
+    }
+    return cache;
+}
+
+// Añade a la caché (memoria y disco) lo recibido en un HISTORY_DELTA
+void updateCache(const string& otherUser, long long lastId, bool reset, const vector<CachedMessage>& newMessages) {
+    lock_guard<mutex> lock(g_cacheMutex);
+    if (g_loggedUser.empty()) return;
+
+    ConversationCache& cache = loadCache(otherUser);
+    if (reset) cache.messages.clear();
+    cache.messages.insert(cache.messages.end(), newMessages.begin(), newMessages.end());
+    if (!reset && newMessages.empty() && cache.lastId == lastId) return; // Nada que guardar
+    cache.lastId = lastId;
+
+    error_code ec;
+    filesystem::create_directories(g_cacheRoot + "/" + g_loggedUser, ec);
+    // Solo se añade al final; con reset se reescribe el archivo
+    ofstream file(cachePath(otherUser), reset ? std::ios::trunc : std::ios::app);
+    for (const CachedMessage& m : newMessages) {
+        file << "M|" << m.timestamp << "|" << m.sender << "|" << m.text << "\n";
+    }
+    file << "I|" << lastId << "\n";
+}
+
+// Encola una petición; la respuesta llega a handleIncomingLine como cualquier
+// otra línea (los RESP|OK sin contenido de los MSG los descarta la biblioteca)
+void sendToServer(const string& request) {
+    g_client->request(request);
+}
+
+// SHA-256 en hexadecimal de un archivo, leído por bloques
+string hashFile(const string& path) {
+    ifstream file(path, std::ios::binary);
+    if (!file.is_open()) return "";
+    picosha2::sha256 hasher;
+    vector<char> buf(1024 * 1024);
+    while (file.read(buf.data(), buf.size()) || file.gcount() > 0) {
+        hasher.process(buf.begin(), buf.begin() + file.gcount());
+    }
+    hasher.finish();
+    vector<unsigned char> hash(32);
+    hasher.get_hash_bytes(hash.begin());
+    static const char* HEX = "0123456789abcdef";
+    string hex;
+    for (unsigned char b : hash) {
+        hex += HEX[b >> 4];
+        hex += HEX[b & 0xF];
+    }
+    return hex;
+}
+
+// Muestra "@adjunto:<sha>:<tamaño>:<nombre>" de forma legible
+string displayText(const string& text) {
+    if (text.rfind("@adjunto:", 0) != 0) return text;
+    vector<string> fields = split(text.substr(9), ':');
+    if (fields.size() < 3) return text;
+    string name = fields[2];
+    for (size_t i = 3; i < fields.size(); ++i) name += ":" + fields[i];
+    // El nombre lo pone quien envía: nunca una ruta ni un dispositivo
+    name = safeFileName(name);
+    if (name.empty()) name = fields[0];
+    {
+        lock_guard<mutex> lock(g_attachmentsMutex);
+        g_attachmentNames[fields[0]] = name;
+    }
+    long long kb = (atoll(fields[1].c_str()) + 1023) / 1024;
+    return "📎 " + name + " (" + to_string(kb) + " KB) -> descargar " + fields[0];
+}
+
+// Nombre de adjunto seguro para guardarlo con ese nombre: solo el último
+// componente de la ruta, sin caracteres que Windows no admite ni nombres de
+// dispositivo (CON, NUL, COM1...). Vacío si no queda un nombre válido.
+string safeFileName(const string& name) {
+    string clean = name;
+    replace(clean.begin(), clean.end(), '\\', '/');
+    clean = filesystem::path(clean).filename().string();
+    for (char& c : clean) {
+        if ((unsigned char)c < 32 || string("<>:\"|?*").find(c) != string::npos) c = '_';
+    }
+    // Windows descarta los puntos y espacios finales: "CON." es CON y ".." queda vacío
+    while (!clean.empty() && (clean.back() == '.' || clean.back() == ' ')) clean.pop_back();
+    string device = clean.substr(0, clean.find('.'));
+    while (!device.empty() && device.back() == ' ') device.pop_back();
+    transform(device.begin(), device.end(), device.begin(), [](unsigned char c) { return (char)toupper(c); });
+    static const set<string> RESERVED = {"CON", "PRN", "AUX", "NUL", "COM1", "COM2", "COM3", "COM4", "COM5",
+                                         "COM6", "COM7", "COM8", "COM9", "LPT1", "LPT2", "LPT3", "LPT4",
+                                         "LPT5", "LPT6", "LPT7", "LPT8", "LPT9"};
+    return RESERVED.count(device) ? "" : clean;
+}
+
+// Calcula el SHA-256 y pregunta al servidor si ya lo tiene (deduplicación)
+void startUpload(const string& toUser, const string& path) {
+    error_code ec;
+    long long size = (long long)filesystem::file_size(path, ec);
+    if (ec || size <= 0) {
+        cout << "❌ No se puede leer " << path << std::endl;
+        return;
+    }
+    string sha = hashFile(path);
+    {
+        lock_guard<mutex> lock(g_attachmentsMutex);
+        if (g_uploads.count(sha)) { // Se borra al terminar o fallar
+            cout << "⏳ Ese archivo ya se esta enviando." << std::endl;
+            return;
+        }
+        Upload& upload = g_uploads[sha];
+        upload.path = path;
+        upload.toUser = toUser;
+        upload.name = filesystem::path(path).filename().string();
+        upload.size = size;
+    }
+    cout << "📤 Enviando " << path << " (" << (size + 1023) / 1024 << " KB)..." << std::endl;
+    beginUpload(sha);
+}
+
+// UPLOAD_BEGIN de una subida de g_uploads. Hasta su UPLOAD_OFFSET el hilo de
+// subida no manda trozos (los que ya estaban en cola se contestan con un
+// UPLOAD_ERROR que se ignora).
+void beginUpload(const string& sha) {
+    long long size;
+    {
+        lock_guard<mutex> lock(g_attachmentsMutex);
+        auto it = g_uploads.find(sha);
+        if (it == g_uploads.end()) return;
+        it->second.awaitingOffset = true;
+        size = it->second.size;
+    }
+    g_client->request("UPLOAD_BEGIN|" + sha + "|" + to_string(size), [sha](const LoquiResponse& response) {
+        // Sin respuesta (conexión perdida) la reconexión vuelve a empezarla
+        if (!response.delivered || response.parts.empty()) return;
+        if (response.parts[0] != "RESP") {
+            {
+                // La respuesta a este UPLOAD_BEGIN: un UPLOAD_ERROR ya no es de trozos viejos
+                lock_guard<mutex> lock(g_attachmentsMutex);
+                auto it = g_uploads.find(sha);
+                if (it != g_uploads.end()) it->second.awaitingOffset = false;
+            }
+            handleIncomingLine(response.line); // UPLOAD_OFFSET, UPLOAD_OK o UPLOAD_ERROR
+        } else if (response.parts.size() >= 4 && response.parts[1] == "RETRY") {
+            // La sesión anterior aún la tiene en el servidor: reintentar
+            int delayMs = atoi(response.parts[3].c_str());
+            thread([sha, delayMs]() {
+                this_thread::sleep_for(chrono::milliseconds(delayMs));
+                if (g_running) beginUpload(sha);
+            }).detach();
+        } else {
+            failUpload(sha, response.parts.size() >= 3 ? response.parts[2] : response.line);
+        }
+    });
+}
+
+// Descarta la subida; su hilo termina en la siguiente vuelta
+void failUpload(const string& sha, const string& reason) {
+    string name;
+    {
+        lock_guard<mutex> lock(g_attachmentsMutex);
+        auto it = g_uploads.find(sha);
+        if (it == g_uploads.end()) return;
+        name = it->second.name;
+        g_uploads.erase(it);
+    }
+    cout << "\r❌ No se pudo enviar " << name << ": " << reason << std::endl;
+}
+
+// Hilo de subida: un trozo por envío, así los mensajes de chat se intercalan
+void uploadChunks(string sha) {
+    ifstream file;
+    vector<char> buf(UPLOAD_CHUNK_SIZE);
+    long long offset = 0, size = 0;
+
+    while (g_running) {
+        {
+            lock_guard<mutex> lock(g_attachmentsMutex);
+            auto it = g_uploads.find(sha);
+            if (it == g_uploads.end()) return; // Terminada o cancelada
+            Upload& upload = it->second;
+            if (upload.awaitingOffset) {
+                upload.active = false; // Reconexión: sigue cuando llegue UPLOAD_OFFSET
+                return;
+            }
+            if (upload.resumeAt >= 0) {
+                // El servidor indica desde dónde seguir
+                if (!file.is_open()) file.open(upload.path, std::ios::binary);
+                offset = upload.resumeAt;
+                upload.resumeAt = -1;
+                file.clear();
+                file.seekg(offset);
+            }
+            size = upload.size;
+            if (offset >= size) {
+                upload.active = false; // Esperando UPLOAD_OK
+                return;
+            }
+        }
+
+        size_t len = (size_t)min<long long>(UPLOAD_CHUNK_SIZE, size - offset);
+        if (!file.read(buf.data(), len)) {
+            cout << "\r❌ Error leyendo el archivo a enviar." << std::endl;
+            lock_guard<mutex> lock(g_attachmentsMutex);
+            g_uploads.erase(sha);
+            return;
+        }
+        string header = "UPLOAD_CHUNK|" + sha + "|" + to_string(offset) + "|" + to_string(len) + "\n";
+        // Bloquea si el socket no da abasto: el archivo no se lee entero a memoria
+        if (!g_client->sendBulk(header + string(buf.data(), len), UPLOAD_QUEUE_MAX)) {
+            lock_guard<mutex> lock(g_attachmentsMutex);
+            g_uploads.erase(sha); // Cliente parando
+            return;
+        }
+        offset += len;
+    }
+}
+
+// Pide el adjunto; si hay un .part de antes se reanuda desde su tamaño
+void startDownload(const string& sha, const string& path) {
+    if (sha.size() != 64 || sha.find_first_not_of("0123456789abcdef") != string::npos) {
+        cout << "❌ SHA-256 invalido: " << sha << std::endl;
+        return;
+    }
+    string target = path;
+    long long offset;
+    {
+        lock_guard<mutex> lock(g_attachmentsMutex);
+        if (target.empty()) {
+            // Sin ruta explícita siempre dentro de descargas/
+            auto it = g_attachmentNames.find(sha);
+            string name = it != g_attachmentNames.end() ? safeFileName(it->second) : "";
+            target = DOWNLOADS_DIR + "/" + (name.empty() ? sha : name);
+        }
+        error_code ec;
+        filesystem::path parent = filesystem::path(target).parent_path();
+        if (!parent.empty()) filesystem::create_directories(parent, ec);
+        offset = (long long)filesystem::file_size(target + ".part", ec);
+        if (ec) offset = 0;
+
+        // Repetir "descargar" reanuda: lo que siga llegando de la petición
+        // anterior se descarta por no coincidir con 'written'
+        Download& download = g_downloads[sha];
+        if (download.file.is_open()) download.file.close();
+        download.path = target;
+        download.written = offset;
+        download.file.open(target + ".part", std::ios::binary | std::ios::app);
+    }
+    cout << "📥 Descargando en " << target << (offset > 0 ? " (reanudando)" : "") << "..." << std::endl;
+    sendToServer("DOWNLOAD|" + sha + "|" + to_string(offset));
+}
+
+// Escribe un FILE_DATA en el .part de su descarga
+void handleFileData(const string& header, const string& data) {
+    vector<string> parts = split(header, '|');
+    lock_guard<mutex> lock(g_attachmentsMutex);
+    auto it = g_downloads.find(parts[1]);
+    if (it == g_downloads.end() || atoll(parts[2].c_str()) != it->second.written) return;
+    it->second.file.write(data.data(), data.size());
+    it->second.written += data.size();
+}
+
+// UPLOAD_OFFSET, UPLOAD_OK, UPLOAD_ERROR, FILE_INFO y FILE_END
+void handleAttachmentLine(const vector<string>& parts) {
+    const string& type = parts[0];
+    if (parts.size() < 2) return;
+    const string& sha = parts[1];
+
+    if (type == "UPLOAD_OFFSET" && parts.size() == 3) {
+        lock_guard<mutex> lock(g_attachmentsMutex);
+        auto it = g_uploads.find(sha);
+        if (it == g_uploads.end()) return;
+        it->second.resumeAt = atoll(parts[2].c_str());
+        it->second.awaitingOffset = false;
+        if (!it->second.active) {
+            it->second.active = true;
+            thread(uploadChunks, sha).detach();
+        }
+    } else if (type == "UPLOAD_ERROR" && parts.size() >= 3) {
+        {
+            // Trozos de antes de reconectar: el UPLOAD_BEGIN nuevo ya está en camino
+            lock_guard<mutex> lock(g_attachmentsMutex);
+            auto it = g_uploads.find(sha);
+            if (it == g_uploads.end() || it->second.awaitingOffset) return;
+        }
+        failUpload(sha, parts[2]);
+    } else if (type == "UPLOAD_OK") {
+        Upload upload;
+        {
+            lock_guard<mutex> lock(g_attachmentsMutex);
+            auto it = g_uploads.find(sha);
+            if (it == g_uploads.end()) return;
+            upload = it->second;
+            g_uploads.erase(it);
+            g_attachmentNames[sha] = upload.name;
+        }
+        // El mensaje solo lleva la referencia al adjunto
+        sendToServer("FILE|" + upload.toUser + "|" + sha + "|" + upload.name);
+        cout << "\r✅ Adjunto " << upload.name << " enviado a " << upload.toUser << "." << std::endl;
+    } else if (type == "FILE_INFO" && parts.size() == 3) {
+        lock_guard<mutex> lock(g_attachmentsMutex);
+        auto it = g_downloads.find(sha);
+        if (it != g_downloads.end()) it->second.size = atoll(parts[2].c_str());
+    } else if (type == "FILE_END") {
+        string path;
+        {
+            lock_guard<mutex> lock(g_attachmentsMutex);
+            auto it = g_downloads.find(sha);
+            if (it == g_downloads.end() || it->second.written != it->second.size) return;
+            it->second.file.close();
+            path = it->second.path;
+            g_downloads.erase(it);
+        }
+        error_code ec;
+        if (hashFile(path + ".part") == sha) {
+            filesystem::rename(path + ".part", path, ec);
+            cout << "\r✅ Descargado " << path << std::endl;
+        } else {
+            filesystem::remove(path + ".part", ec);
+            cout << "\r❌ El adjunto descargado no coincide con su SHA-256." << std::endl;
+        }
+    }
+
+    string chatUser = currentChatUser();
+    if (!chatUser.empty()) {
+        cout << "┌─[" << chatUser << "]\n";
+        cout << "└─➤ " << std::flush;
+    } else {
+        cout << "> " << std::flush;
+    }
+}
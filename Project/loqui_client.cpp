@@ -0,0 +1,663 @@
+/*
+ * LOQUI CLIENT LIBRARY (loqui_client)
+ * Ver loqui_client.h.
+ *
+ * Dos hilos por conexión: el lector (recv, reparto de líneas y reconexión) y
+ * el escritor, que vacía la cola de salida en un solo envío por lote.
+ * Protocolo de ids: tras HELLO|...,ids el cliente puede anteponer "#<id>|" a
+ * un comando y el servidor antepone la misma etiqueta a su primera línea de
+ * respuesta (o contesta "#<id>|RESP|OK" si el comando no tiene respuesta).
+ * Con deflate (LOQUI_ZLIB) las líneas grandes llegan como "Z|<bytes>|<original>"
+ * seguido del deflate raw; un solo descompresor por conexión, porque el
+ * servidor no reinicia su ventana entre tramas.
+ */
+
+#include "loqui_client.h"
+#include <ws2tcpip.h>
+#include <sstream>
+#include <chrono>
+#include <cstring>
+#include <algorithm>
+#ifdef LOQUI_TLS
+#include <openssl/pem.h>
+#include <openssl/err.h>
+#endif
+
+#include <afunix.h> // sockaddr_un (socket local del servidor)
+
+using namespace std;
+
+static const int READ_BUFFER_SIZE = 64 * 1024;
+static const size_t WRITE_BATCH_MAX = 256 * 1024; // Bytes por envío del escritor
+static const int RECONNECT_MIN_DELAY_MS = 250;
+static const size_t FRAME_MAX = 64 * 1024 * 1024; // Tamaño máximo que se acepta en una trama Z
+
+static vector<string> splitLine(const string& s, char delimiter) {
+    vector<string> tokens;
+    string token;
+    istringstream tokenStream(s);
+    while (getline(tokenStream, token, delimiter)) {
+        tokens.push_back(token);
+    }
+    return tokens;
+}
+
+bool LoquiResponse::ok() const {
+    return delivered && !(parts.size() >= 2 && parts[0] == "RESP" && parts[1] != "OK");
+}
+
+LoquiClient::LoquiClient(const Options& options) : opts(options) {
+}
+
+LoquiClient::~LoquiClient() {
+    stop();
+#ifdef LOQUI_ZLIB
+    if (inflater) {
+        inflateEnd(inflater);
+        delete inflater;
+    }
+#endif
+}
+
+bool LoquiClient::start(std::string& error) {
+    WSADATA wsaData;
+    int iResult = WSAStartup(MAKEWORD(2, 2), &wsaData);
+    if (iResult != 0) {
+        error = "WSAStartup failed: " + to_string(iResult);
+        return false;
+    }
+    started = true;
+    if (!openConnection(error)) return false;
+    reader = thread(&LoquiClient::readLoop, this);
+    writer = thread(&LoquiClient::writeLoop, this);
+    return true;
+}
+
+void LoquiClient::stop() {
+    {
+        unique_lock<mutex> lock(mtx);
+        if (!started || stopping) return;
+        // Lo último encolado (p. ej. DC) tiene que salir antes de cerrar
+        cv.wait_for(lock, chrono::seconds(1), [&] { return !ready || (outbox.empty() && !writing); });
+        stopping = true;
+        if (sock != INVALID_SOCKET) shutdown(sock, SD_BOTH); // Despierta al lector
+    }
+    cv.notify_all();
+    if (reader.joinable()) reader.join();
+    if (writer.joinable()) writer.join();
+    closeConnection(true);
+
+    // Lo que no llegó a enviarse tampoco tendrá respuesta
+    map<uint64_t, Pending> unanswered;
+    {
+        lock_guard<mutex> lock(mtx);
+        unanswered.swap(pendings);
+        outbox.clear();
+        queuedBytes = 0;
+    }
+    for (auto& [id, pending] : unanswered) {
+        LoquiResponse response;
+        response.id = id;
+        pending.callback(response);
+    }
+    WSACleanup();
+    started = false;
+}
+
+uint64_t LoquiClient::request(const std::string& command, ResponseCallback callback) {
+    if (command.rfind("LOGIN|", 0) == 0 || command.rfind("LOGIN_LOCAL|", 0) == 0) {
+        // Un login correcto se recuerda para repetirlo al reconectar. Solo con
+        // su RESP|OK: sin ids (unknown) no se sabe si el servidor lo aceptó
+        callback = [this, command, callback](const LoquiResponse& response) {
+            if (response.ok()) {
+                lock_guard<mutex> lock(mtx);
+                loginCommand = command;
+            }
+            if (callback) callback(response);
+            else if (response.delivered && onLine && !response.line.empty()) onLine(response.line);
+        };
+    }
+    uint64_t id;
+    {
+        lock_guard<mutex> lock(mtx);
+        id = nextId++;
+        if (callback) pendings[id].callback = move(callback);
+        outbox.push_back({id, command, false});
+        queuedBytes += command.size();
+    }
+    cv.notify_all();
+    return id;
+}
+
+void LoquiClient::send(const std::string& command) {
+    {
+        lock_guard<mutex> lock(mtx);
+        outbox.push_back({0, command, false});
+        queuedBytes += command.size();
+    }
+    cv.notify_all();
+}
+
+bool LoquiClient::sendBulk(const std::string& data, size_t maxQueued) {
+    {
+        unique_lock<mutex> lock(mtx);
+        cv.wait(lock, [&] { return stopping || queuedBytes < maxQueued; });
+        if (stopping) return false;
+        outbox.push_back({0, data, true});
+        queuedBytes += data.size();
+    }
+    cv.notify_all();
+    return true;
+}
+
+bool LoquiClient::connected() const {
+    lock_guard<mutex> lock(mtx);
+    return ready;
+}
+
+bool LoquiClient::supportsIds() const {
+    lock_guard<mutex> lock(mtx);
+    return idsSupported;
+}
+
+std::string LoquiClient::tlsInfo() const {
+    lock_guard<mutex> lock(mtx);
+    return tlsDescription;
+}
+
+// Conecta (TCP o socket local), hace TLS si se pidió y negocia HELLO.
+// Solo la llaman start() y el hilo lector.
+bool LoquiClient::openConnection(std::string& error) {
+    SOCKET s = INVALID_SOCKET;
+    if (!opts.unixPath.empty()) {
+        sockaddr_un addr = {};
+        addr.sun_family = AF_UNIX;
+        if (opts.unixPath.size() >= sizeof(addr.sun_path)) {
+            error = "Ruta demasiado larga: " + opts.unixPath;
+            return false;
+        }
+        memcpy(addr.sun_path, opts.unixPath.c_str(), opts.unixPath.size());
+        s = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (s != INVALID_SOCKET && connect(s, (SOCKADDR*)&addr, sizeof(addr)) != 0) {
+            closesocket(s);
+            s = INVALID_SOCKET;
+        }
+        if (s == INVALID_SOCKET) {
+            error = "connect() failed: " + opts.unixPath;
+            return false;
+        }
+    } else {
+        addrinfo hints = {}, *result = nullptr;
+        hints.ai_family = AF_INET;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_protocol = IPPROTO_TCP;
+        if (getaddrinfo(opts.host.c_str(), to_string(opts.port).c_str(), &hints, &result) != 0) {
+            error = "No se pudo resolver " + opts.host;
+            return false;
+        }
+        s = socket(result->ai_family, result->ai_socktype, result->ai_protocol);
+        if (s != INVALID_SOCKET && connect(s, result->ai_addr, (int)result->ai_addrlen) == SOCKET_ERROR) {
+            error = "connect() failed: " + to_string(WSAGetLastError());
+            closesocket(s);
+            s = INVALID_SOCKET;
+        } else if (s == INVALID_SOCKET) {
+            error = "socket() failed: " + to_string(WSAGetLastError());
+        }
+        freeaddrinfo(result);
+        if (s == INVALID_SOCKET) return false;
+    }
+
+    // El socket local no sale del equipo: sin TLS
+    if (opts.tls && opts.unixPath.empty() && !startTls(s, error)) {
+        closesocket(s);
+        return false;
+    }
+    if (!handshake(s, error)) {
+#ifdef LOQUI_TLS
+        if (ssl) {
+            SSL_free(ssl);
+            ssl = nullptr;
+        }
+#endif
+        closesocket(s);
+        return false;
+    }
+
+    {
+        lock_guard<mutex> lock(mtx);
+        sock = s;
+        ready = true;
+        // La sesión anterior se repite antes que lo que quedó en cola
+        if (!loginCommand.empty()) {
+            uint64_t id = nextId++;
+            pendings[id].callback = [this](const LoquiResponse& response) {
+                if (!response.ok() && !response.unknown) {
+                    lock_guard<mutex> lock(mtx);
+                    loginCommand.clear(); // Ya no vale: que el usuario vuelva a entrar
+                }
+                if (response.delivered && onLine && !response.line.empty()) onLine(response.line);
+            };
+            outbox.push_front({id, loginCommand, false});
+            queuedBytes += loginCommand.size();
+        }
+    }
+    cv.notify_all();
+    return true;
+}
+
+// HELLO con las capacidades pedidas más ids; espera la respuesta del servidor.
+// Lo que llegue detrás se queda en 'input' para el lector.
+bool LoquiClient::handshake(SOCKET s, std::string& error) {
+    input.clear();
+    string caps = opts.capabilities.empty() ? "ids" : opts.capabilities + ",ids";
+#ifdef LOQUI_ZLIB
+    if (opts.compression) {
+        // Cada conexión empieza un flujo deflate nuevo
+        if (!inflater) {
+            inflater = new z_stream();
+            if (inflateInit2(inflater, -MAX_WBITS) != Z_OK) {
+                delete inflater;
+                inflater = nullptr;
+            }
+        } else {
+            inflateReset(inflater);
+        }
+        if (inflater) caps += ",deflate";
+    }
+#endif
+    if (!writeAll(s, "HELLO|" + caps + "\n")) {
+        error = "No se pudo enviar HELLO";
+        return false;
+    }
+    vector<char> buf(READ_BUFFER_SIZE);
+    size_t pos;
+    while ((pos = input.find('\n')) == string::npos) {
+        int n = readSome(s, buf.data(), (int)buf.size());
+        if (n <= 0) {
+            error = "Conexion cerrada durante HELLO";
+            return false;
+        }
+        input.append(buf.data(), n);
+    }
+    string line = input.substr(0, pos);
+    if (line.rfind("HELLO|", 0) != 0) {
+        lock_guard<mutex> lock(mtx); // El escritor lo lee con mtx
+        idsSupported = false;        // Servidor sin HELLO: la línea la procesa el lector
+        return true;
+    }
+    input.erase(0, pos + 1);
+    vector<string> parts = splitLine(line, '|');
+    vector<string> serverCaps = parts.size() >= 3 ? splitLine(parts[2], ',') : vector<string>();
+    lock_guard<mutex> lock(mtx);
+    idsSupported = find(serverCaps.begin(), serverCaps.end(), "ids") != serverCaps.end();
+    return true;
+}
+
+// Hilo lector: reparte lo recibido y reconecta cuando se corta
+void LoquiClient::readLoop() {
+    vector<char> buf(READ_BUFFER_SIZE);
+    int delayMs = RECONNECT_MIN_DELAY_MS;
+    while (true) {
+        SOCKET s;
+        {
+            lock_guard<mutex> lock(mtx);
+            s = sock;
+        }
+        if (s != INVALID_SOCKET) {
+            processInput(); // Lo que llegó pegado al HELLO
+            int n;
+            while ((n = readSome(s, buf.data(), (int)buf.size())) > 0) {
+                input.append(buf.data(), n);
+                processInput();
+            }
+            closeConnection(true);
+        }
+
+        {
+            unique_lock<mutex> lock(mtx);
+            if (stopping) return;
+            if (!opts.reconnect) break;
+        }
+        notifyState(RECONNECTING, "Reintentando en " + to_string(delayMs) + " ms");
+        {
+            unique_lock<mutex> lock(mtx);
+            if (cv.wait_for(lock, chrono::milliseconds(delayMs), [&] { return stopping; })) return;
+        }
+        string error;
+        if (openConnection(error)) {
+            delayMs = RECONNECT_MIN_DELAY_MS;
+            notifyState(CONNECTED, "Reconectado");
+        } else {
+            delayMs = min(delayMs * 2, max(opts.reconnectMaxDelayMs, RECONNECT_MIN_DELAY_MS));
+        }
+    }
+}
+
+// Hilo escritor: agrupa todo lo encolado en un envío (pipelining)
+void LoquiClient::writeLoop() {
+    unique_lock<mutex> lock(mtx);
+    while (true) {
+        cv.wait(lock, [&] { return stopping || (ready && !outbox.empty()); });
+        if (stopping) return;
+
+        string batch;
+        vector<pair<uint64_t, ResponseCallback>> untagged;
+        while (!outbox.empty() && batch.size() < WRITE_BATCH_MAX) {
+            Item& item = outbox.front();
+            if (item.raw) {
+                batch += item.data;
+            } else if (item.id != 0 && idsSupported) {
+                batch += "#" + to_string(item.id) + "|" + item.data + "\n";
+            } else {
+                batch += item.data + "\n";
+            }
+            auto it = item.id != 0 ? pendings.find(item.id) : pendings.end();
+            if (it != pendings.end()) {
+                if (idsSupported) {
+                    it->second.sent = true;
+                } else {
+                    // Sin ids la respuesta no se puede asociar: llegará a onLine y
+                    // el callback solo sabe que se envió (unknown)
+                    untagged.push_back({it->first, move(it->second.callback)});
+                    pendings.erase(it);
+                }
+            }
+            queuedBytes -= item.data.size();
+            outbox.pop_front();
+        }
+        SOCKET s = sock;
+        writing = true;
+        lock.unlock();
+        cv.notify_all(); // sendBulk espera a que baje la cola
+
+        for (auto& [id, callback] : untagged) {
+            LoquiResponse response;
+            response.id = id;
+            response.unknown = true;
+            callback(response);
+        }
+        if (!writeAll(s, batch)) shutdown(s, SD_BOTH); // El lector lo nota y reconecta
+
+        lock.lock();
+        writing = false;
+        cv.notify_all();
+    }
+}
+
+// Reparte las líneas completas de 'input'
+void LoquiClient::processInput() {
+    size_t pos;
+    while ((pos = input.find('\n')) != string::npos) {
+        string line = input.substr(0, pos);
+        if (line.rfind("FILE_DATA|", 0) == 0) {
+            // FILE_DATA|sha|offset|longitud va seguido de 'longitud' bytes binarios
+            vector<string> header = splitLine(line, '|');
+            size_t len = header.size() == 4 ? (size_t)atoll(header[3].c_str()) : 0;
+            if (input.size() < pos + 1 + len) break; // Esperar al resto
+            if (onFileData) onFileData(line, input.substr(pos + 1, len));
+            input.erase(0, pos + 1 + len);
+            continue;
+        }
+        if (line.rfind("Z|", 0) == 0) {
+            // Z|comprimido|original va seguido del deflate de una o más líneas completas
+            vector<string> header = splitLine(line, '|');
+            size_t len = header.size() == 3 ? (size_t)atoll(header[1].c_str()) : 0;
+            size_t original = header.size() == 3 ? (size_t)atoll(header[2].c_str()) : 0;
+            if (input.size() < pos + 1 + len) break; // Esperar al resto
+            string text;
+            bool ok = inflateFrame(input.substr(pos + 1, len), original, text);
+            input.erase(0, pos + 1 + len);
+            if (!ok) {
+                // Con el flujo roto no se puede seguir: reconectar empieza uno nuevo
+                lock_guard<mutex> lock(mtx);
+                if (sock != INVALID_SOCKET) shutdown(sock, SD_BOTH);
+                return;
+            }
+            size_t start = 0, end;
+            while ((end = text.find('\n', start)) != string::npos) {
+                string inner = text.substr(start, end - start);
+                if (!inner.empty() && inner.back() == '\r') inner.pop_back();
+                handleLine(inner);
+                start = end + 1;
+            }
+            continue;
+        }
+        input.erase(0, pos + 1);
+        if (!line.empty() && line.back() == '\r') line.pop_back();
+        handleLine(line);
+    }
+}
+
+// Descomprime una trama Z; false si no cuadra con lo que anunció el servidor
+bool LoquiClient::inflateFrame(const std::string& data, size_t originalSize, std::string& text) {
+#ifdef LOQUI_ZLIB
+    if (!inflater || originalSize > FRAME_MAX) return false;
+    text.resize(originalSize + 1); // El byte de más deja consumir la marca del Z_SYNC_FLUSH
+    inflater->next_in = (Bytef*)data.data();
+    inflater->avail_in = (uInt)data.size();
+    inflater->next_out = (Bytef*)&text[0];
+    inflater->avail_out = (uInt)text.size();
+    int result = inflate(inflater, Z_SYNC_FLUSH);
+    if ((result != Z_OK && result != Z_BUF_ERROR) || inflater->avail_in != 0 || inflater->avail_out != 1) return false;
+    text.resize(originalSize);
+    return true;
+#else
+    (void)data;
+    (void)originalSize;
+    (void)text;
+    return false; // Sin zlib nunca se pide deflate
+#endif
+}
+
+void LoquiClient::handleLine(const std::string& line) {
+    if (line == "PING") {
+        send("PONG"); // Heartbeat del servidor: sin PONG nos daría por muertos
+        return;
+    }
+    if (line.size() > 1 && line[0] == '#') {
+        // #<id>|respuesta
+        size_t bar = line.find('|');
+        uint64_t id = strtoull(line.c_str() + 1, nullptr, 10);
+        string rest = bar == string::npos ? "" : line.substr(bar + 1);
+        ResponseCallback callback;
+        {
+            lock_guard<mutex> lock(mtx);
+            auto it = pendings.find(id);
+            if (it != pendings.end()) {
+                callback = move(it->second.callback);
+                pendings.erase(it);
+            }
+        }
+        if (callback) {
+            LoquiResponse response;
+            response.id = id;
+            response.delivered = true;
+            response.line = rest;
+            response.parts = splitLine(rest, '|');
+            callback(response);
+        } else if (onLine && rest != "RESP|OK") {
+            onLine(rest); // Petición sin callback (el RESP|OK vacío no aporta nada)
+        }
+        return;
+    }
+    if (!line.empty() && onLine) onLine(line);
+}
+
+// Cierra el socket actual. Con failSent, las peticiones ya enviadas reciben delivered = false.
+void LoquiClient::closeConnection(bool failSent) {
+    vector<pair<uint64_t, ResponseCallback>> lost;
+    bool wasReady;
+    {
+        unique_lock<mutex> lock(mtx);
+        wasReady = ready;
+        ready = false;
+        cv.wait(lock, [&] { return !writing; }); // El escritor puede estar usando el socket
+        if (sock == INVALID_SOCKET) return;
+#ifdef LOQUI_TLS
+        if (ssl) {
+            lock_guard<mutex> ioLock(ioMutex);
+            SSL_free(ssl);
+            ssl = nullptr;
+        }
+#endif
+        closesocket(sock);
+        sock = INVALID_SOCKET;
+        input.clear();
+        for (auto it = pendings.begin(); failSent && it != pendings.end();) {
+            if (it->second.sent) {
+                lost.push_back({it->first, move(it->second.callback)});
+                it = pendings.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+    for (auto& [id, callback] : lost) {
+        LoquiResponse response;
+        response.id = id;
+        callback(response);
+    }
+    bool quiet;
+    {
+        lock_guard<mutex> lock(mtx);
+        quiet = stopping;
+    }
+    if (wasReady && !quiet) notifyState(DISCONNECTED, "Conexion cerrada por el servidor");
+}
+
+void LoquiClient::notifyState(State state, const std::string& detail) {
+    if (onState) onState(state, detail);
+}
+
+// Envía 'data' completo (en claro o por TLS)
+bool LoquiClient::writeAll(SOCKET s, const std::string& data) {
+    size_t sent = 0;
+#ifdef LOQUI_TLS
+    if (ssl) {
+        while (sent < data.size()) {
+            int err;
+            {
+                lock_guard<mutex> lock(ioMutex);
+                int n = SSL_write(ssl, data.data() + sent, (int)(data.size() - sent));
+                if (n > 0) {
+                    sent += n;
+                    continue;
+                }
+                err = SSL_get_error(ssl, n);
+                if (err != SSL_ERROR_WANT_WRITE && err != SSL_ERROR_WANT_READ) return false;
+            }
+            WSAPOLLFD pfd = {s, (short)(err == SSL_ERROR_WANT_WRITE ? POLLWRNORM : POLLRDNORM), 0};
+            if (WSAPoll(&pfd, 1, 5000) <= 0) return false;
+        }
+        return true;
+    }
+#endif
+    while (sent < data.size()) {
+        int n = ::send(s, data.data() + sent, (int)(data.size() - sent), 0);
+        if (n == SOCKET_ERROR || n == 0) return false;
+        sent += n;
+    }
+    return true;
+}
+
+// Lee lo disponible (como recv)
+int LoquiClient::readSome(SOCKET s, char* buf, int len) {
+#ifdef LOQUI_TLS
+    if (ssl) {
+        while (true) {
+            int err;
+            {
+                // El socket es no bloqueante: no retenemos el mutex mientras esperamos
+                lock_guard<mutex> lock(ioMutex);
+                int n = SSL_read(ssl, buf, len);
+                if (n > 0) return n;
+                err = SSL_get_error(ssl, n);
+                if (err == SSL_ERROR_ZERO_RETURN) return 0;
+                if (err != SSL_ERROR_WANT_READ && err != SSL_ERROR_WANT_WRITE) return -1;
+            }
+            {
+                lock_guard<mutex> lock(mtx);
+                if (stopping) return -1;
+            }
+            WSAPOLLFD pfd = {s, (short)(err == SSL_ERROR_WANT_WRITE ? POLLWRNORM : POLLRDNORM), 0};
+            WSAPoll(&pfd, 1, 500); // Con timeout para notar stop()
+        }
+    }
+#endif
+    return recv(s, buf, len, 0);
+}
+
+#ifdef LOQUI_TLS
+// Guarda cada ticket nuevo para reanudar la sesión en la próxima conexión
+int LoquiClient::saveTlsSession(SSL* ssl, SSL_SESSION* session) {
+    LoquiClient* client = (LoquiClient*)SSL_CTX_get_app_data(SSL_get_SSL_CTX(ssl));
+    FILE* file = client ? fopen(client->opts.tlsSessionFile.c_str(), "w") : nullptr;
+    if (file) {
+        PEM_write_SSL_SESSION(file, session);
+        fclose(file);
+    }
+    return 0; // No nos quedamos con la referencia
+}
+#endif
+
+// Handshake TLS; reutiliza el ticket guardado si existe
+bool LoquiClient::startTls(SOCKET s, std::string& error) {
+#ifdef LOQUI_TLS
+    SSL_CTX* ctx = SSL_CTX_new(TLS_client_method());
+    SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+    if (!opts.caFile.empty()) {
+        if (SSL_CTX_load_verify_locations(ctx, opts.caFile.c_str(), nullptr) != 1) {
+            SSL_CTX_free(ctx);
+            error = "No se pudo cargar la CA " + opts.caFile;
+            return false;
+        }
+        SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, nullptr);
+    }
+#ifdef SSL_OP_ENABLE_KTLS
+    SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+#endif
+    if (!opts.tlsSessionFile.empty()) {
+        SSL_CTX_set_app_data(ctx, this);
+        SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+        SSL_CTX_sess_set_new_cb(ctx, saveTlsSession);
+    }
+
+    ssl = SSL_new(ctx);
+    SSL_CTX_free(ctx); // El SSL mantiene su propia referencia
+    SSL_set_fd(ssl, (int)s);
+    SSL_set_tlsext_host_name(ssl, opts.host.c_str());
+    if (!opts.caFile.empty()) SSL_set1_host(ssl, opts.host.c_str());
+
+    FILE* file = opts.tlsSessionFile.empty() ? nullptr : fopen(opts.tlsSessionFile.c_str(), "r");
+    if (file) {
+        SSL_SESSION* session = PEM_read_SSL_SESSION(file, nullptr, nullptr, nullptr);
+        fclose(file);
+        if (session) {
+            SSL_set_session(ssl, session);
+            SSL_SESSION_free(session);
+        }
+    }
+
+    if (SSL_connect(ssl) != 1) {
+        error = "Handshake TLS fallido";
+        ERR_print_errors_fp(stderr);
+        SSL_free(ssl);
+        ssl = nullptr;
+        return false;
+    }
+
+    {
+        lock_guard<mutex> lock(mtx);
+        tlsDescription = string(SSL_get_version(ssl)) + (SSL_session_reused(ssl) ? " (sesion reanudada)" : "");
+    }
+
+    // A partir de aquí lecturas y escrituras no bloqueantes (ver readSome)
+    u_long nonBlocking = 1;
+    ioctlsocket(s, FIONBIO, &nonBlocking);
+    return true;
+#else
+    (void)s;
+    error = "Este cliente se compilo sin TLS (LOQUI_ENABLE_TLS)";
+    return false;
+#endif
+}
@@ -0,0 +1,149 @@
+/*
+ * LOQUI CLIENT LIBRARY (loqui_client)
+ *
+ * Conexión con el servidor Loqui reutilizable por el CLI, bots e integraciones.
+ * - request() no espera: encola el comando con un id y la respuesta llega a
+ *   su callback. Se pueden encadenar muchas peticiones sin esperar a ninguna
+ *   (pipelining); el hilo escritor las agrupa en un solo envío.
+ * - Lo que no es respuesta a una petición (MSG entrantes, avisos de adjuntos)
+ *   llega a onLine; los FILE_DATA con sus bytes, a onFileData. Los PING del
+ *   servidor se contestan solos.
+ * - Si la conexión se cae se reconecta sola, repite el último LOGIN correcto
+ *   y envía lo que quedara en cola. Las peticiones ya enviadas y sin respuesta
+ *   se dan por perdidas (delivered = false): pueden haberse ejecutado o no.
+ * - Con un servidor sin la capacidad ids las respuestas no se pueden asociar:
+ *   el callback se llama al enviar con unknown = true (y delivered = false),
+ *   la respuesta real llega a onLine y el login no se repite al reconectar.
+ *
+ * Los callbacks se llaman desde el hilo lector de la conexión: no deben
+ * bloquear mucho, pero pueden llamar a request()/send().
+ */
+
+#pragma once
+
+#include <winsock2.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <functional>
+#include <cstdint>
+#ifdef LOQUI_TLS
+#include <openssl/ssl.h>
+#endif
+#ifdef LOQUI_ZLIB
+#include <zlib.h>
+#endif
+
+// Respuesta a una petición
+struct LoquiResponse {
+    uint64_t id = 0;
+    bool delivered = false;        // false: la conexión se cortó antes de la respuesta
+    bool unknown = false;          // Enviada a un servidor sin ids: la respuesta va a onLine
+    std::string line;              // Línea del servidor, sin la etiqueta de la petición
+    std::vector<std::string> parts; // 'line' separada por '|'
+    // Entregada y no es RESP|ERROR ni RESP|RETRY (nunca con unknown)
+    bool ok() const;
+};
+
+class LoquiClient {
+public:
+    struct Options {
+        std::string host = "127.0.0.1";
+        int port = 12345;
+        std::string unixPath;       // No vacío: socket local del servidor (unix.path) en vez de TCP
+        bool tls = false;
+        std::string caFile;         // Vacío = no se verifica el certificado
+        std::string tlsSessionFile; // Ticket para reanudar TLS al reconectar (vacío = sin reanudación)
+        std::string capabilities = "adjuntos"; // Se anuncian en HELLO (ids se añade siempre)
+        bool compression = true; // Pide deflate en HELLO (solo compilado con LOQUI_ZLIB)
+        bool reconnect = true;
+        int reconnectMaxDelayMs = 10000; // Espera máxima entre intentos (crece desde 250 ms)
+    };
+    enum State { CONNECTED, DISCONNECTED, RECONNECTING };
+    using ResponseCallback = std::function<void(const LoquiResponse&)>;
+
+    // Se asignan antes de start()
+    std::function<void(const std::string& line)> onLine; // Líneas que no responden a una petición con callback
+    std::function<void(const std::string& header, const std::string& data)> onFileData; // FILE_DATA|sha|offset|len + bytes
+    std::function<void(State state, const std::string& detail)> onState;
+
+    explicit LoquiClient(const Options& options);
+    ~LoquiClient();
+    LoquiClient(const LoquiClient&) = delete;
+    LoquiClient& operator=(const LoquiClient&) = delete;
+
+    // Primera conexión y HELLO (bloquea); false si falla. Después todo va en hilos propios.
+    bool start(std::string& error);
+    // Envía lo que quede en cola (como mucho 1 s) y cierra
+    void stop();
+
+    // Encola un comando; el callback recibe la primera línea de respuesta.
+    // Sin callback, la respuesta llega a onLine. Devuelve el id de la petición.
+    uint64_t request(const std::string& command, ResponseCallback callback = nullptr);
+    // Comando sin id ni respuesta esperada (PONG, DC)
+    void send(const std::string& command);
+    // Bytes tal cual (UPLOAD_CHUNK con sus datos). Bloquea mientras la cola
+    // supere maxQueued, para que una subida no se lea entera a memoria.
+    bool sendBulk(const std::string& data, size_t maxQueued);
+
+    bool connected() const;
+    bool supportsIds() const; // El servidor etiqueta las respuestas (capacidad ids)
+    std::string tlsInfo() const; // Versión TLS y si se reanudó la sesión; vacío sin TLS
+
+private:
+    struct Item {
+        uint64_t id;      // 0 = sin etiqueta
+        std::string data; // Comando sin '\n' o bytes tal cual (raw)
+        bool raw;
+    };
+    struct Pending {
+        ResponseCallback callback;
+        bool sent = false;
+    };
+
+    bool openConnection(std::string& error);
+    bool handshake(SOCKET sock, std::string& error);
+    void readLoop();
+    void writeLoop();
+    void processInput();
+    void handleLine(const std::string& line);
+    bool inflateFrame(const std::string& data, size_t originalSize, std::string& text);
+    void closeConnection(bool failSent);
+    bool writeAll(SOCKET sock, const std::string& data);
+    int readSome(SOCKET sock, char* buf, int len);
+    bool startTls(SOCKET sock, std::string& error);
+    void notifyState(State state, const std::string& detail);
+#ifdef LOQUI_TLS
+    static int saveTlsSession(SSL* ssl, SSL_SESSION* session);
+#endif
+
+    Options opts;
+    mutable std::mutex mtx;
+    std::condition_variable cv;
+    SOCKET sock = INVALID_SOCKET;
+    bool ready = false;  // Conectado y con HELLO contestado: el escritor puede enviar
+    bool writing = false; // El escritor está usando el socket fuera del mutex
+    bool stopping = false;
+    bool started = false;
+    bool idsSupported = false;
+    std::string tlsDescription;
+    std::deque<Item> outbox;
+    size_t queuedBytes = 0;
+    std::map<uint64_t, Pending> pendings; // Peticiones con callback aún sin respuesta
+    uint64_t nextId = 1;
+    std::string loginCommand; // Último LOGIN/LOGIN_LOCAL con RESP|OK etiquetado; se repite al reconectar
+    std::string input;        // Bytes recibidos que aún no forman una línea (solo el lector)
+    std::thread reader;
+    std::thread writer;
+#ifdef LOQUI_TLS
+    SSL* ssl = nullptr;
+    std::mutex ioMutex; // SSL_read y SSL_write no pueden ejecutarse a la vez
+#endif
+#ifdef LOQUI_ZLIB
+    z_stream* inflater = nullptr; // Tramas Z de la conexión actual (solo el lector)
+#endif
+};
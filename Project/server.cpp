@@ -5,21 +5,50 @@
  * Implementación del Hito H-3 (Multithreading) y añadido
  * de persistencia de mensajes (Historial).
  * - USA HASHING: SHA-256 + Salting (vía picosha2.h).
- * - USA PERSISTENCIA: Usuarios en "users.csv", Mensajes en "history.csv".
+ * - USA PERSISTENCIA: Usuarios en "users.log", Mensajes en "history.log"
+ *   (registro binario con longitud + CRC32C y checkpoints periódicos).
+ * - ADJUNTOS: almacén por SHA-256 en "attachments/", subidas reanudables.
  */
 
 #include <winsock2.h>
 #include <ws2tcpip.h>
+#include <mswsock.h> // TransmitFile para servir adjuntos
+#include <mstcpip.h> // SIO_KEEPALIVE_VALS
 #include <iostream>
 #include <string>
 #include <vector>
 #include <map>
+#include <set>
+#include <unordered_map>
+#include <shared_mutex> // Lecturas concurrentes de la tabla de símbolos
 #include <thread>
 #include <mutex>
 #include <sstream>
 #include <fstream> // Para persistencia
 #include <random> // Para generar 'salt'
 #include <chrono> // Para timestamps
+#include <atomic> // Para contadores de admisión
+#include <cmath> // Para ceil en retry-after
+#include <deque> // Colas de salida entre nodos
+#include <list> // Orden LRU de la caché de conversaciones
+#include <memory>
+#include <condition_variable>
+#include <functional> // Callbacks de la rueda de temporizadores
+#include <cstdio> // FILE* para los logs (fflush + sync)
+#include <cstdlib> // _Exit al terminar un relevo
+#include <cstdint>
+#include <filesystem> // Para truncar colas rotas y renombrar checkpoints
+#ifdef _WIN32
+#include <io.h> // _commit
+#endif
+#include <afunix.h> // sockaddr_un (AF_UNIX desde Windows 10 1803)
+#ifdef LOQUI_TLS
+#include <openssl/ssl.h> // TLS opcional (cmake -DLOQUI_ENABLE_TLS=ON)
+#include <openssl/err.h>
+#endif
+#ifdef LOQUI_ZLIB
+#include <zlib.h> // Compresión opcional (cmake -DLOQUI_ENABLE_ZLIB=ON)
+#endif
 #include "picosha2.h" // Para Hashing SHA-256
 
 // --- Estructuras de Datos (Completas) ---
@@ -31,29 +60,538 @@ struct UserData {
     string salt;
     string hash; // hash(password + salt)
 };
-map<string, UserData> g_userStore;
-mutex g_userStoreMutex; // Mutex para proteger g_userStore
 
-// Clientes conectados (username, socket)
-map<string, SOCKET> g_connectedClients;
+// Tabla de símbolos: cada usuario registrado recibe un id denso de 32 bits que
+// se guarda en users.log. El registro de sesiones, el historial y los filtros
+// de conversación trabajan con ids; los nombres solo se resuelven en los
+// bordes del protocolo (comandos de clientes y de otros nodos, respuestas).
+typedef uint32_t UserId;
+const UserId NO_USER = 0;
+vector<string> g_userNames(1);           // id -> nombre (el 0 no se usa)
+unordered_map<string, UserId> g_userIds; // nombre -> id
+shared_mutex g_symbolsMutex; // Los que añaden usuarios tienen además g_userStoreMutex
+
+vector<UserData> g_userStore(1); // Indexado por UserId
+mutex g_userStoreMutex; // Mutex para proteger g_userStore (y las altas en la tabla de símbolos)
+
+// Conexión de un cliente: el socket y, con TLS, su sesión. ioMutex serializa
+// las escrituras de varios hilos (y SSL_read/SSL_write, que no pueden ejecutarse
+// a la vez sobre el mismo SSL). Se comparte con shared_ptr para que quien
+// entrega un MSG no escriba en un socket ya cerrado.
+// lifeMutex protege solo el cierre del socket, para que el reaper pueda
+// hacer shutdown aunque otro hilo esté bloqueado escribiendo con ioMutex.
+struct Connection {
+    SOCKET sock = INVALID_SOCKET;
+#ifdef LOQUI_TLS
+    SSL* ssl = nullptr;
+#endif
+    bool closed = false;
+    bool broken = false; // Una escritura quedó a medias: el flujo ya no es válido (lo protege ioMutex)
+    mutex ioMutex;
+    mutex lifeMutex;
+    atomic<long long> lastActivityMs{0}; // Última vez que llegaron bytes (monotonicMs)
+    atomic<bool> heartbeats{false};      // El cliente envió HELLO y contesta a PING
+    atomic<bool> authenticated{false};
+    bool local = false;  // Llegó por el socket AF_UNIX
+    string peerAccount;  // Cuenta del sistema del proceso cliente (solo local)
+#ifdef LOQUI_ZLIB
+    z_stream* deflater = nullptr; // Capacidad deflate negociada en HELLO (lo protege ioMutex)
+#endif
+};
+
+// Clientes conectados (id de usuario, conexión)
+map<UserId, shared_ptr<Connection>> g_connectedClients;
 mutex g_clientsMutex; // Mutex para proteger g_connectedClients
 
-const string USER_FILE = "users.csv"; // Archivo de persistencia de usuarios
-const string HISTORY_FILE = "history.csv"; // Archivo de persistencia de mensajes
+string g_userFile = "users.log"; // Log de usuarios (clave users_file)
+string g_historyFile = "history.log"; // Log de mensajes (clave history_file)
+string g_checkpointFile = "checkpoint.dat"; // Instantánea de usuarios + posiciones (clave checkpoint_file)
+const string LEGACY_USER_FILE = "users.csv"; // Formato anterior, se migra una sola vez
+const string LEGACY_HISTORY_FILE = "history.csv";
+int g_serverPort = 12345; // Puerto de clientes (clave port)
+
+// --- Socket local (AF_UNIX) ---
+// Mismo protocolo que el puerto TCP para bots e integraciones del mismo equipo.
+// El sistema dice qué cuenta abrió la conexión, así que LOGIN_LOCAL no necesita
+// contraseña.
+// Las cuentas de Windows son DOMINIO\cuenta y no distinguen mayúsculas: se
+// comparan normalizadas con normalizeAccount.
+string g_unixPath;               // unix.path (vacío = desactivado)
+string g_unixDomain;             // unix.domain: dominio (o equipo) cuyas cuentas entran como su usuario; por defecto el del servidor
+set<string> g_unixTrusted;       // unix.trusted: cuentas que pueden entrar como cualquier usuario
+#ifdef LOQUI_TLS
+SSL_CTX* g_tlsCtx = nullptr; // Solo si tls.cert y tls.key están configurados
+#endif
+
+// --- Compresión (capacidad deflate) ---
+// Las líneas de texto grandes (HISTORY_RESP, LIST_RESP...) viajan como
+// "Z|<bytes comprimidos>|<bytes originales>\n" + deflate raw con Z_SYNC_FLUSH.
+// El compresor de cada conexión no se reinicia entre tramas: su ventana hace
+// de diccionario compartido con el cliente, así que fechas, nombres y
+// separadores ya enviados cuestan unos pocos bits. Las líneas cortas (MSG)
+// van en claro para no añadir latencia.
+int g_compressThreshold = 512; // compress.threshold: bytes mínimos para comprimir (0 = desactivado)
+const int COMPRESS_WINDOW_BITS = 13; // Ventana de 8 KiB: unos 64 KiB de memoria por conexión
+const int COMPRESS_MEM_LEVEL = 6;
+atomic<long long> g_compressBytesIn{0};  // Texto que ha pasado por el compresor
+atomic<long long> g_compressBytesOut{0}; // Tramas Z enviadas (cabecera incluida)
+
+// --- Write-ahead log ---
+// Cada registro: [u32 longitud][u32 CRC32C del contenido][contenido].
+// Un corte a mitad de escritura deja una cola que no valida y se trunca al arrancar.
+const uint32_t WAL_MAX_RECORD = 16 * 1024 * 1024;
+const char WAL_USER = 'U';
+const char WAL_MESSAGE = 'M';     // Formato anterior: remitente y destinatario por nombre
+const char WAL_MESSAGE_IDS = 'N'; // Remitente y destinatario como UserId (u32)
+const char WAL_CHECKPOINT = 'C';
+const char WAL_CHECKPOINT_INDEX = 'H';  // Checkpoint: offsets de una conversación
+const char WAL_CHECKPOINT_ACCESS = 'A'; // Checkpoint: quién ve un adjunto
+const size_t CHECKPOINT_INDEX_SLICE = 1024 * 1024; // Offsets por registro 'H' (8 MB)
+struct WalFile {
+    string path;
+    FILE* file = nullptr;
+    long long size = 0; // Offset donde irá el siguiente registro
+    mutex mtx;          // Serializa los appends
+};
+WalFile g_userLog;
+WalFile g_historyLog;
+bool g_walSync = false; // wal.sync=1 fuerza el volcado a disco en cada registro
+int g_checkpointIntervalSec = 60;
+long long g_checkpointUsers = 0;   // Posiciones cubiertas por el último checkpoint
+long long g_checkpointHistory = 0;
+
+struct StoredMessage {
+    string timestamp;
+    UserId sender = NO_USER;
+    UserId receiver = NO_USER;
+    string text;
+};
+
+// Clave de una conversación: el par de ids ordenado, da igual quién escribe
+inline uint64_t conversationKey(UserId a, UserId b) {
+    return a < b ? ((uint64_t)a << 32) | b : ((uint64_t)b << 32) | a;
+}
+
+// Un destinatario de MSGMULTI / MSGBATCH
+struct OutgoingMessage {
+    string toUser;
+    string text;
+    UserId to = NO_USER; // Lo resuelve sendMessageBatch
+};
+int g_maxRecipients = 64; // Entregas por trama MSGMULTI/MSGBATCH (msg.max_recipients)
+
+// --- Caché de conversaciones recientes ---
+// Últimos mensajes de las conversaciones activas, alimentada en el mismo
+// append que los persiste (bajo el mutex del log, así sigue su orden) y
+// desalojada por LRU con un presupuesto global de bytes. HISTORY y la
+// sincronización incremental se sirven de RAM cuando la caché cubre lo pedido.
+struct CachedMessage {
+    long long id; // Offset en el log
+    string timestamp;
+    UserId sender;
+    string text;
+};
+struct HotConversation {
+    deque<CachedMessage> messages; // Ordenados por id
+    long long validFrom = 0; // Están todos los mensajes de la conversación con id >= validFrom
+    bool complete = false;   // ...y no hay ninguno anterior
+    size_t bytes = 0;
+    list<uint64_t>::iterator lru;
+};
+unordered_map<uint64_t, HotConversation> g_hotCache; // conversationKey -> mensajes
+list<uint64_t> g_hotLru; // Más reciente al principio
+mutex g_hotCacheMutex; // Se toma después de g_historyLog.mtx si hacen falta los dos
+size_t g_hotCacheBytes = 0;
+size_t g_hotCacheBudget = 16 * 1024 * 1024; // history_cache.mb (0 = sin caché)
+size_t g_hotCacheMessages = 64;             // history_cache.messages: por conversación
+atomic<long long> g_hotCacheHits{0};
+atomic<long long> g_hotCacheMisses{0};
+
+// --- Índice de conversaciones ---
+// Offsets en history_file de los mensajes de cada conversación, en orden. Se
+// reconstruye al arrancar (en paralelo, por trozos del log) y se mantiene en
+// cada append, así HISTORY lee solo los registros de la conversación.
+unordered_map<uint64_t, vector<long long>> g_historyIndex;
+mutex g_historyIndexMutex;
+const long long LOAD_CHUNK_MIN = 4 * 1024 * 1024; // Por debajo no compensa repartir el log entre hilos
+struct LoadChunk {
+    long long begin = 0, end = 0; // [begin, end); begin es el inicio de un registro
+    long long stop = 0;           // Fin del último registro válido leído
+    vector<string> users;         // Registros de usuarios, en orden
+    unordered_map<uint64_t, vector<long long>> index;
+    vector<StoredMessage> attachments; // Mensajes con adjunto: permisos a aplicar al fusionar
+};
+
+// --- Configuración (loqui.conf, formato clave=valor) ---
+string g_configFile = "loqui.conf"; // Puede sobrescribirse con argv[1]
+map<string, string> g_config;
+
+// --- Limitación de tasa y control de admisión ---
+// Clases de comando: cada una tiene su propio cubo de tokens por conexión y por usuario
+// (BULK son los trozos de adjuntos: no se rechazan, se frena la lectura del socket)
+enum CommandClass { CLASS_AUTH, CLASS_LIGHT, CLASS_MSG, CLASS_HEAVY, CLASS_BULK, CLASS_COUNT };
+const char* const CLASS_NAMES[CLASS_COUNT] = {"auth", "light", "msg", "heavy", "bulk"};
+
+struct RateLimit {
+    double ratePerSec; // Tokens repuestos por segundo (0 = sin límite)
+    double burst;      // Capacidad máxima del cubo
+};
+RateLimit g_connLimits[CLASS_COUNT] = {{1, 5}, {5, 10}, {20, 40}, {1, 3}, {160, 320}};
+RateLimit g_userLimits[CLASS_COUNT] = {{0, 0}, {5, 10}, {20, 40}, {1, 3}, {160, 320}}; // AUTH no tiene usuario aún
+
+struct TokenBucket {
+    double tokens = -1; // -1 = lleno en el primer uso
+    chrono::steady_clock::time_point last;
+    long long tryConsume(const RateLimit& limit, double cost = 1); // 0 si hay tokens, si no ms a esperar
+};
+struct UserBuckets {
+    TokenBucket buckets[CLASS_COUNT];
+};
+map<UserId, UserBuckets> g_userBuckets; // Sobrevive a reconexiones del mismo usuario
+mutex g_userBucketsMutex;
+
+// Subida en curso de un adjunto: se escribe en attachments/tmp/<usuario>-<sha>.part
+struct PendingUpload {
+    long long size = 0;   // Tamaño anunciado en UPLOAD_BEGIN
+    long long offset = 0; // Bytes ya escritos
+    FILE* file = nullptr;
+};
+
+// Petición con id que está ejecutando este hilo (ver processPending):
+// sendResponse etiqueta con "#<id>|" la primera línea que envía a esa conexión
+thread_local const Connection* t_requestConn = nullptr;
+thread_local string t_requestTag;
+
+// Estado de una conexión de cliente mientras dura handleClient
+struct ClientSession {
+    shared_ptr<Connection> conn;
+    string username; // Nombre del usuario logueado en este hilo
+    UserId userId = NO_USER;
+    TokenBucket buckets[CLASS_COUNT]; // Cubos de esta conexión
+    string pending;      // Bytes recibidos que aún no forman un comando completo
+    bool framed = false; // Tras HELLO los comandos van terminados en '\n'
+    map<string, PendingUpload> uploads; // sha -> subida
+    long long recvUs = 0; // Cuándo llegaron los últimos bytes (para las trazas)
+};
+
+// Umbrales de saturación: HEAVY se descarta primero, MSG solo en saturación severa
+int g_maxHeavyInFlight = 4;
+int g_persistSoftLimit = 8;  // Escrituras en cola a partir de las cuales se descarta HEAVY
+int g_persistHardLimit = 64; // Escrituras en cola a partir de las cuales se descarta MSG
+int g_cpuHighPercent = 90;
+atomic<int> g_persistQueueDepth{0}; // Hilos esperando/escribiendo en g_historyFile
+atomic<int> g_heavyInFlight{0};     // HISTORY en curso
+atomic<int> g_cpuLoadPercent{0};    // Muestreado por cpuMonitor
+atomic<long long> g_throttledTotal{0}; // Rechazos por cubo de tokens
+atomic<long long> g_shedTotal{0};      // Rechazos por control de admisión
+
+// --- Rueda de temporizadores ---
+// Un solo hilo lleva los temporizadores de todas las conexiones (heartbeats,
+// inactividad, plazo de login). Rueda jerárquica de 4 niveles x 64 ranuras con
+// tick de 100 ms: programar es O(1) y cada temporizador baja de nivel como
+// mucho 3 veces antes de vencer. Cubre hasta ~19 días.
+class TimerWheel {
+public:
+    void schedule(long long delayMs, std::function<void()> callback);
+    void run();
+
+private:
+    struct Timer {
+        uint64_t expiry; // En ticks
+        std::function<void()> callback;
+    };
+    static const int LEVELS = 4;
+    static const int SLOT_BITS = 6;
+    static const int SLOTS = 1 << SLOT_BITS;
+    static const long long TICK_MS = 100;
+    void place(Timer&& timer); // Con mtx tomado
+    vector<Timer> slots[LEVELS][SLOTS];
+    uint64_t current = 0; // Tick actual
+    mutex mtx;
+};
+TimerWheel g_timers;
+int g_heartbeatIntervalSec = 15; // PING tras este tiempo sin recibir nada (heartbeat.interval)
+int g_idleTimeoutSec = 45;       // Sin nada recibido durante este tiempo => se cierra (heartbeat.idle_timeout)
+int g_loginTimeoutSec = 30;      // Conexiones sin LOGIN se cierran tras este plazo (login_timeout)
+atomic<long long> g_reapedTotal{0};
+
+// --- Trazas de latencia por mensaje ---
+// Se muestrea 1 de cada trace.sample_every mensajes. Cada etapa deja su marca de
+// tiempo en la traza del hilo (t_trace) y, al terminar el comando, la traza se
+// copia a un anillo sin locks: cada escritor reserva una posición con fetch_add
+// y protege la copia con un contador de secuencia (impar mientras escribe), así
+// el lector descarta las entradas a medio escribir. GET /trace en metrics.port
+// las devuelve en formato Chrome trace-event (chrome://tracing, Perfetto).
+enum TraceStage { TRACE_RECV, TRACE_PARSE, TRACE_ADMISSION, TRACE_PERSIST, TRACE_CLUSTER, TRACE_REGISTRY, TRACE_SEND, TRACE_STAGE_COUNT };
+const char* const TRACE_STAGE_NAMES[TRACE_STAGE_COUNT] = {"recv", "parse", "admision", "persistencia", "cluster", "registro", "envio"};
+struct MessageTrace {
+    uint64_t id = 0;
+    char command[16] = {};
+    char from[32] = {};
+    char to[64] = {};
+    long long stampUs[TRACE_STAGE_COUNT] = {}; // Fin de cada etapa; 0 = no recorrida
+};
+struct TraceSlot {
+    atomic<uint64_t> seq{0};
+    MessageTrace trace;
+};
+const size_t TRACE_RING_SIZE = 4096;
+TraceSlot g_traceRing[TRACE_RING_SIZE];
+atomic<uint64_t> g_traceNext{0};
+atomic<uint64_t> g_traceSampleCounter{0};
+int g_traceSampleEvery = 100; // 0 = sin trazas
+thread_local MessageTrace* t_trace = nullptr;
+
+// --- Clúster: enlaces persistentes entre nodos ---
+// Cada nodo abre una conexión saliente hacia cada par (solo para enviar) y
+// acepta las conexiones entrantes de los pares (solo para recibir). Los dos
+// extremos se autentican con cluster.secret (HMAC-SHA256 sobre nonces) antes
+// de la primera línea de datos.
+struct PeerLink {
+    string nodeId;
+    string host;
+    int port = 0;
+    mutex mtx;
+    condition_variable cv;
+    deque<string> outbox; // Líneas pendientes hacia este nodo, se envían por lotes
+};
+string g_nodeId; // Vacío = servidor de un solo nodo
+int g_clusterPort = 0;
+string g_clusterSecret; // cluster.secret: clave compartida por todos los nodos
+const int PEER_AUTH_TIMEOUT_MS = 10000; // Plazo para completar el saludo autenticado
+vector<unique_ptr<PeerLink>> g_peers;
+map<string, string> g_remoteUsers; // usuario -> nodo en el que tiene la sesión abierta
+mutex g_remoteUsersMutex;
+const size_t PEER_OUTBOX_LIMIT = 100000; // Si un par cae mucho tiempo se descartan las líneas más antiguas
+
+// --- Replicación a un servidor en espera (hot-standby) ---
+// El primario envía los bytes que se añaden a los archivos de usuarios e
+// historial; el seguidor los escribe tal cual, así su copia es siempre un
+// prefijo de la del primario y puede reanudar desde el tamaño de sus archivos.
+enum ReplFile { REPL_USERS, REPL_HISTORY, REPL_FILE_COUNT };
+const char* const REPL_FILE_NAMES[REPL_FILE_COUNT] = {"users", "history"};
+const size_t REPL_CHUNK = 64 * 1024;
+int g_replPort = 0;          // Puerto donde el primario acepta seguidores (replication.port)
+string g_replBind = "127.0.0.1"; // Dirección en la que escucha ese puerto (replication.bind)
+string g_replSecret;         // replication.secret: clave compartida por primario y seguidores
+string g_replPrimary;        // host:puerto del primario; si existe arrancamos como seguidor
+int g_failoverTimeoutSec = 10; // Sin primario durante este tiempo => promoción
+mutex g_replMutex;
+condition_variable g_replCv; // Se notifica tras cada append a los archivos
+atomic<int> g_replFollowers{0};
+atomic<bool> g_isFollower{false};
+atomic<long long> g_replPrimarySize[REPL_FILE_COUNT]; // Tamaño anunciado por el primario
+atomic<long long> g_replApplied[REPL_FILE_COUNT];     // Bytes aplicados localmente
+atomic<long long> g_replCaughtUpMs{0}; // Última vez (ms) que el seguidor estaba al día
+int g_metricsPort = 0; // Endpoint HTTP de métricas (metrics.port)
+
+// --- Adjuntos: almacén direccionado por contenido ---
+// Cada archivo vive en <dir>/<2 primeros hex>/<sha256>, así un mismo archivo
+// subido varias veces se guarda una sola vez. Los mensajes solo llevan la
+// referencia "@adjunto:<sha>:<tamaño>:<nombre>".
+string g_attachmentsDir = "attachments";            // Clave attachments_dir
+long long g_attachmentMaxSize = 100LL * 1024 * 1024; // Clave attachments.max_mb
+int g_maxDownloads = 8;                             // Clave attachments.max_downloads
+const size_t ATTACH_CHUNK_MAX = 256 * 1024;         // Máximo de un UPLOAD_CHUNK
+const long long ATTACH_SLICE = 256 * 1024;          // Bytes por FILE_DATA: entre porciones pasan los MSG
+const size_t MAX_PENDING_INPUT = ATTACH_CHUNK_MAX + 4096;
+// (usuario, sha) -> sesión que lo está subiendo. Cada usuario sube a su propio
+// .part: nadie ve ni continúa la subida de otro.
+map<pair<UserId, string>, const ClientSession*> g_activeUploads;
+// Quién puede descargar (o reenviar) cada adjunto: las dos partes de cada
+// mensaje que lo referencia (se rehace al releer el historial) y quien acaba
+// de subirlo. Un sha desconocido y uno sin permiso dan la misma respuesta.
+map<string, set<UserId>> g_attachmentAccess;
+mutex g_attachmentsMutex;
+atomic<int> g_downloadsInFlight{0};
+atomic<long long> g_attachmentBytesIn{0};
+atomic<long long> g_attachmentBytesOut{0};
+
+// --- Snapshots en caliente ---
+// SNAPSHOT (solo admin_users) copia los logs hasta la posición que tenían al
+// pedirlo: son append-only, así que ese prefijo ya no cambia y se copia sin
+// parar el tráfico, a ritmo limitado. Los adjuntos terminados son inmutables y
+// se enlazan (hardlink) en vez de copiarse. Cada snapshot lleva su checkpoint
+// y un snapshot.conf con el que arrancar un LoquiServer sobre la copia.
+string g_snapshotDir = "snapshots"; // Clave snapshot_dir
+int g_snapshotMbPerSec = 50;        // Clave snapshot.mb_per_sec (0 = sin límite)
+set<string> g_adminUsers;           // Clave admin_users (lista separada por comas)
+atomic<bool> g_snapshotRunning{false};
+atomic<long long> g_snapshotsTotal{0};
+
+// --- Reinicio sin cortes (handoff de sockets) ---
+// Un LoquiServer nuevo arrancado con --takeover se conecta a upgrade.path del
+// actual y pide el relevo. El actual deja de aceptar y de leer (cada sesión se
+// detiene entre dos lecturas y serializa su estado), cierra los logs y pasa al
+// nuevo los sockets de escucha y los de todos los clientes (WSADuplicateSocket)
+// junto con ese estado. Cuando el nuevo confirma,
+// el viejo termina y el nuevo sigue con las mismas conexiones: sin
+// desconexiones ni LOGIN otra vez.
+struct ParkedSession {
+    SOCKET sock;
+    string state; // encodeSessionState
+};
+string g_upgradePath;              // upgrade.path (vacío = desactivado)
+int g_upgradeDrainTimeoutSec = 10; // upgrade.drain_timeout: espera a que paren sesiones y descargas
+const int HANDOFF_POLL_MS = 250;   // Cada cuánto miran la bandera las lecturas y los accept
+atomic<bool> g_handoffRequested{false};
+atomic<int> g_activeSessions{0}; // Hilos de cliente y de enlaces de pares vivos (y accept en curso)
+atomic<int> g_peerSends{0};      // Lotes de peerSender a medio enviar
+vector<ParkedSession> g_parkedSessions;
+vector<ParkedSession> g_parkedPeers; // Enlaces entrantes de pares (encodePeerState)
+mutex g_handoffMutex;
+map<string, SOCKET> g_listeners;          // Sockets de escucha de este proceso, por nombre
+map<string, SOCKET> g_inheritedListeners; // Recibidos del proceso anterior
+vector<ParkedSession> g_inheritedSessions;
+vector<ParkedSession> g_inheritedPeers;
 
 // --- Prototipos de Funciones ---
-void handleClient(SOCKET clientSocket);
+void handleClient(SOCKET clientSocket, bool local);
+void runSession(ClientSession& session);
+void resumeClient(SOCKET clientSocket, std::string state);
+SOCKET acceptClient(SOCKET listenSocket);
+bool waitForInput(Connection& conn);
+bool waitForInput(SOCKET sock);
+void parkSession(ClientSession& session);
+void parkPeer(SOCKET peerSocket, const std::string& peerId, const std::string& pending);
+void resumePeer(SOCKET peerSocket, std::string state);
+string encodeSessionState(const ClientSession& session);
+bool decodeSessionState(const std::string& state, ClientSession& session);
+SOCKET takeListener(const std::string& name);
+void keepListener(const std::string& name, SOCKET sock);
+void upgradeListener();
+bool handOff(SOCKET channel, unsigned long pid);
+bool trustedUpgradePeer(SOCKET channel, unsigned long pid, std::string& reason);
+bool processIdentity(HANDLE process, std::string& sid, std::wstring& image);
+void abortHandoff(bool reopenLogs);
+bool receiveHandoff();
+bool sendHandoffRecord(SOCKET channel, const std::string& payload, SOCKET sock, unsigned long pid);
+bool recvHandoffRecord(SOCKET channel, std::string& payload, SOCKET& sock);
+void unixListener();
+string unixPeerAccount(SOCKET sock);
+string processAccount(HANDLE process);
+string normalizeAccount(const std::string& account);
+bool localAccountMatches(const std::string& account, const std::string& user);
+string completeLogin(ClientSession& session, const std::string& user, UserId userId);
+bool processPending(ClientSession& session);
+bool processCommand(ClientSession& session, const std::string& message, const std::string& payload);
+size_t framePayloadLength(const std::string& line);
 vector<string> split(const string& s, char delimiter);
-void sendResponse(SOCKET clientSocket, const std::string& response); // NUEVO: Añade \n y envía
-void sendMessageToClient(const std::string& fromUser, const std::string& toUser, const std::string& chatMessage);
-void loadUsers();
-void saveUser(const std::string& username, const UserData& data);
+void sendResponse(Connection& conn, const std::string& response); // NUEVO: Añade \n y envía
+void sendEvent(Connection& conn, const std::string& line);
+void sendMessageToClient(UserId fromUser, UserId toUser, const std::string& chatMessage);
+vector<std::string> sendMessageBatch(UserId fromUser, vector<OutgoingMessage>& batch);
+void saveMessages(const vector<StoredMessage>& messages);
+void saveUser(const std::string& username, const UserData& data, UserId id);
+UserId storeUser(const std::string& username, const UserData& data, UserId id = NO_USER);
+void clearUsers();
+UserId findUserId(const std::string& username);
+string userName(UserId id);
 string generateSalt(int length = 16);
 string getCurrentTimestamp();
-void saveMessage(const std::string& sender, const std::string& receiver, const std::string& timestamp, const std::string& message);
-void sendHistoryToClient(SOCKET clientSocket, const std::string& currentUser, const std::string& otherUser);
+void saveMessage(UserId sender, UserId receiver, const std::string& timestamp, const std::string& message);
+void sendHistoryToClient(Connection& conn, UserId currentUser, UserId otherUser);
+void sendHistoryDelta(Connection& conn, UserId currentUser, UserId otherUser, long long sinceId);
+bool connWrite(Connection& conn, const std::string& data, bool compressible = false);
+bool connWriteLocked(Connection& conn, const std::string& data, bool compressible);
+void markBroken(Connection& conn);
+#ifdef LOQUI_ZLIB
+bool startCompression(Connection& conn);
+bool compressFrame(Connection& conn, const std::string& data, std::string& frame);
+#endif
+long long monotonicMs();
+void watchConnection(const shared_ptr<Connection>& conn);
+void heartbeatCheck(weak_ptr<Connection> weak);
+void sendPing(Connection& conn);
+void reapConnection(Connection& conn, const char* reason);
+void enableKeepalive(SOCKET sock);
+long long traceNowUs();
+void traceMark(TraceStage stage);
+void traceCommit(const MessageTrace& trace);
+string renderTrace(long long minUs);
+int connRead(Connection& conn, char* buf, int len);
+void closeConnection(Connection& conn);
+void initTls();
+bool startTls(Connection& conn);
+void loadConfig();
+string configString(const std::string& key, const std::string& def);
+int configInt(const std::string& key, int def);
+void loadRateLimits();
+CommandClass classifyCommand(const std::string& cmd);
+long long checkRateLimit(CommandClass cls, TokenBucket connBuckets[], UserId user, double cost = 1);
+double commandCost(const std::string& cmd, const vector<std::string>& parts, const std::string& payload);
+vector<string> recipientList(const std::string& field);
+long long admitRequest(CommandClass cls);
+void cpuMonitor();
+bool sendAll(SOCKET sock, const std::string& data);
+bool recvLine(SOCKET sock, std::string& pending, std::string& line);
+bool deliverLocal(UserId fromUser, UserId toUser, const std::string& timestamp, const std::string& chatMessage);
+void loadClusterConfig();
+void startCluster();
+void broadcastToPeers(const std::string& line);
+void broadcastToPeers(const vector<std::string>& lines);
+void peerSender(PeerLink* peer);
+void clusterListener();
+void handlePeer(SOCKET peerSocket, std::string peerId, std::string pending);
+bool authenticatePeerLink(SOCKET sock, const PeerLink& peer);
+string hmacSha256(const std::string& key, const std::string& message);
+bool sameDigest(const std::string& a, const std::string& b);
+uint32_t crc32c(const char* data, size_t len);
+string frameRecord(const std::string& payload);
+bool readRecord(std::istream& in, std::string& payload);
+string encodeUser(const std::string& username, const UserData& data, UserId id);
+bool decodeUser(const std::string& payload, std::string& username, UserData& data, UserId& id);
+string encodeMessage(const StoredMessage& msg);
+string encodeLegacyMessage(const std::string& timestamp, const std::string& sender, const std::string& receiver, const std::string& text);
+bool decodeMessage(const std::string& payload, StoredMessage& msg);
+bool openLog(WalFile& log, const std::string& path, long long validSize);
+void closeLog(WalFile& log);
+long long appendLog(WalFile& log, const std::string& payload);
+long long appendLog(WalFile& log, const vector<std::string>& payloads, const function<void(long long)>& onAppended = nullptr);
+void scanConversation(uint64_t conversation, long long from, long long end, vector<CachedMessage>& out);
+void hotCacheAppend(const StoredMessage& msg, long long id);
+bool hotCacheRead(uint64_t conversation, long long sinceId, vector<CachedMessage>& out, bool& reset);
+void hotCacheFill(uint64_t conversation, const vector<CachedMessage>& messages, long long end);
+void recoverStores();
+long long replayLog(const std::string& path, long long from, bool applyUsers);
+long long findRecordBoundary(std::ifstream& file, long long from, long long limit);
+void parseChunk(const std::string& path, LoadChunk& chunk, bool users);
+void migrateLegacyFiles();
+bool loadCheckpoint();
+void writeCheckpoint();
+bool checkpointContent(std::string& content, long long& usersOffset, long long& historyOffset, bool onlyIfChanged);
+void runSnapshot(shared_ptr<Connection> conn, std::string requestedBy);
+bool copyLogPrefix(const std::string& from, const std::string& to, long long length);
+void checkpointLoop();
+bool recvExact(SOCKET sock, std::string& pending, size_t count, std::string& out);
+long long fileSize(const std::string& path);
+long long nowMs();
+void notifyReplication();
+void replicationListener();
+void handleFollower(SOCKET followerSocket);
+void runFollower();
+bool followPrimary(const std::string& host, const std::string& port, std::string partials[]);
+void applyReplicated(int fileIndex, const std::string& data, std::string& partial);
+void metricsServer();
+string renderMetrics();
+bool isValidSha(const std::string& sha);
+string safeFileName(const std::string& name);
+string attachmentSha(const std::string& text);
+void noteAttachmentMessage(const StoredMessage& msg);
+void grantAttachment(const std::string& sha, UserId user);
+bool canAccessAttachment(const std::string& sha, UserId user);
+string attachmentPath(const std::string& sha);
+string attachmentPartPath(const std::string& sha, UserId user);
+string hashFile(const std::string& path);
+void handleUploadBegin(ClientSession& session, const std::string& sha, long long size);
+void handleUploadChunk(ClientSession& session, const std::string& sha, long long offset, const std::string& data);
+void finishUpload(ClientSession& session, const std::string& sha);
+void releaseUploads(ClientSession& session);
+void handleDownload(ClientSession& session, const std::string& sha, long long offset);
+void streamAttachment(shared_ptr<Connection> conn, std::string sha, long long offset);
+bool transmitSlice(Connection& conn, HANDLE file, const std::string& header, long long offset, long long len);
 
-int main() {
+int main(int argc, char* argv[]) {
     WSADATA wsaData;
     int iResult;
 
@@ -64,48 +602,154 @@ int main() {
         return 1;
     }
 
+    // Configuración opcional (límites de tasa, umbrales de admisión)
+    // Uso: LoquiServer [ruta_config] [--takeover]
+    if (argc > 1) g_configFile = argv[1];
+    bool takeover = argc > 2 && string(argv[2]) == "--takeover";
+    loadConfig();
+    loadRateLimits();
+    g_userFile = configString("users_file", g_userFile);
+    g_historyFile = configString("history_file", g_historyFile);
+    g_checkpointFile = configString("checkpoint_file", g_checkpointFile);
+    g_walSync = configInt("wal.sync", 0) != 0;
+    g_checkpointIntervalSec = configInt("wal.checkpoint_interval", g_checkpointIntervalSec);
+    g_serverPort = configInt("port", g_serverPort);
+    g_unixPath = configString("unix.path", "");
+    g_unixDomain = configString("unix.domain", "");
+    if (g_unixDomain.empty()) {
+        // Por defecto, el dominio (o el equipo) de la cuenta del propio servidor
+        string own = processAccount(GetCurrentProcess());
+        g_unixDomain = own.substr(0, own.find('\\') == string::npos ? 0 : own.find('\\'));
+    }
+    for (const string& account : split(configString("unix.trusted", ""), ',')) {
+        // Sin dominio se entiende una cuenta de unix.domain
+        if (!account.empty()) g_unixTrusted.insert(normalizeAccount(account.find('\\') == string::npos ? g_unixDomain + "\\" + account : account));
+    }
+    initTls();
+    loadClusterConfig();
+    g_replPort = configInt("replication.port", 0);
+    g_replPrimary = configString("replication.primary", "");
+    g_failoverTimeoutSec = configInt("replication.failover_timeout", g_failoverTimeoutSec);
+    g_replBind = configString("replication.bind", g_replBind);
+    g_replSecret = configString("replication.secret", "");
+    if (g_replSecret.empty() && !g_replPrimary.empty()) {
+        // Sin clave no hay replicación; arrancar como primario partiría el servicio en dos
+        cerr << "[LoquiServer] replication.primary necesita replication.secret." << std::endl;
+        WSACleanup();
+        return 1;
+    }
+    if (g_replSecret.empty() && g_replPort > 0) {
+        // Los seguidores reciben users_file entero (sales y hashes): nunca sin clave
+        cerr << "[LoquiServer] replication.port necesita replication.secret; replicacion desactivada." << std::endl;
+        g_replPort = 0;
+    }
+    g_metricsPort = configInt("metrics.port", 0);
+    g_attachmentsDir = configString("attachments_dir", g_attachmentsDir);
+    g_attachmentMaxSize = configInt("attachments.max_mb", (int)(g_attachmentMaxSize >> 20)) * 1024LL * 1024;
+    g_maxDownloads = configInt("attachments.max_downloads", g_maxDownloads);
+    g_snapshotDir = configString("snapshot_dir", g_snapshotDir);
+    g_snapshotMbPerSec = configInt("snapshot.mb_per_sec", g_snapshotMbPerSec);
+    for (const string& admin : split(configString("admin_users", ""), ',')) {
+        if (!admin.empty()) g_adminUsers.insert(admin);
+    }
+    g_heartbeatIntervalSec = configInt("heartbeat.interval", g_heartbeatIntervalSec);
+    g_idleTimeoutSec = configInt("heartbeat.idle_timeout", g_idleTimeoutSec);
+    g_loginTimeoutSec = configInt("login_timeout", g_loginTimeoutSec);
+    g_maxRecipients = configInt("msg.max_recipients", g_maxRecipients);
+    g_traceSampleEvery = configInt("trace.sample_every", g_traceSampleEvery);
+    g_hotCacheBudget = (size_t)configInt("history_cache.mb", (int)(g_hotCacheBudget >> 20)) << 20;
+    g_hotCacheMessages = max(1, configInt("history_cache.messages", (int)g_hotCacheMessages));
+    g_upgradePath = configString("upgrade.path", "");
+    g_upgradeDrainTimeoutSec = configInt("upgrade.drain_timeout", g_upgradeDrainTimeoutSec);
+    g_compressThreshold = configInt("compress.threshold", g_compressThreshold);
+#ifdef LOQUI_TLS
+    if (g_tlsCtx && !g_upgradePath.empty()) {
+        // El estado de cada sesión TLS vive en este proceso y no se puede pasar
+        cerr << "[LoquiServer] upgrade.path no es compatible con TLS; se desactiva." << std::endl;
+        g_upgradePath.clear();
+    }
+#endif
+    // Relevo: recibir sockets y sesiones antes de abrir los logs o los puertos
+    if (takeover && !receiveHandoff()) {
+        WSACleanup();
+        return 1;
+    }
+    thread(cpuMonitor).detach();
+    thread(&TimerWheel::run, &g_timers).detach();
+    if (g_metricsPort > 0) thread(metricsServer).detach();
+
     // *** INICIO HITO H-2: Cargar usuarios desde el archivo ***
-    loadUsers();
+    // Checkpoint + registros posteriores; trunca colas rotas
+    recoverStores();
     // *** FIN HITO H-2 ***
 
-    // 2. Crear Socket del Servidor
-    SOCKET listenSocket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-    if (listenSocket == INVALID_SOCKET) {
-        cerr << "Error at socket(): " << WSAGetLastError() << std::endl;
-        WSACleanup();
-        return 1;
+    // Modo seguidor: replicar del primario hasta que deje de responder
+    // (con --takeover el proceso anterior ya era primario)
+    if (!g_replPrimary.empty() && !takeover) {
+        runFollower();
+        cout << "[LoquiServer] Promocionado a primario." << std::endl;
     }
+    thread(checkpointLoop).detach();
+    if (g_replPort > 0) thread(replicationListener).detach();
 
-    // 3. Configurar dirección y puerto (usaremos 12345)
-    sockaddr_in serverAddr;
-    serverAddr.sin_family = AF_INET;
-    serverAddr.sin_addr.s_addr = INADDR_ANY; // Escuchar en todas las interfaces
-    serverAddr.sin_port = htons(12345);
+    // 2. Crear Socket del Servidor (o usar el heredado en un relevo)
+    SOCKET listenSocket = takeListener("client");
+    if (listenSocket == INVALID_SOCKET) {
+        listenSocket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+        if (listenSocket == INVALID_SOCKET) {
+            cerr << "Error at socket(): " << WSAGetLastError() << std::endl;
+            WSACleanup();
+            return 1;
+        }
 
-    // 4. Bind
-    iResult = bind(listenSocket, (SOCKADDR*)&serverAddr, sizeof(serverAddr));
-    if (iResult == SOCKET_ERROR) {
-        cerr << "bind failed: " << WSAGetLastError() << endl;
-        closesocket(listenSocket);
-        WSACleanup();
-        return 1;
+        // 3. Configurar dirección y puerto (por defecto 12345)
+        sockaddr_in serverAddr;
+        serverAddr.sin_family = AF_INET;
+        serverAddr.sin_addr.s_addr = INADDR_ANY; // Escuchar en todas las interfaces
+        serverAddr.sin_port = htons(g_serverPort);
+
+        // 4. Bind
+        iResult = bind(listenSocket, (SOCKADDR*)&serverAddr, sizeof(serverAddr));
+        if (iResult == SOCKET_ERROR) {
+            cerr << "bind failed: " << WSAGetLastError() << endl;
+            closesocket(listenSocket);
+            WSACleanup();
+            return 1;
+        }
+
+        // 5. Listen
+        if (listen(listenSocket, SOMAXCONN) == SOCKET_ERROR) {
+            cerr << "listen failed: " << WSAGetLastError() << endl;
+            closesocket(listenSocket);
+            WSACleanup();
+            return 1;
+        }
     }
+    keepListener("client", listenSocket);
 
-    // 5. Listen
-    if (listen(listenSocket, SOMAXCONN) == SOCKET_ERROR) {
-        cerr << "listen failed: " << WSAGetLastError() << endl;
-        closesocket(listenSocket);
-        WSACleanup();
-        return 1;
+    cout << "[LoquiServer] Servidor iniciado en el puerto " << g_serverPort << "." << std::endl;
+
+    // Enlaces con el resto del clúster (si hay cluster.node_id)
+    startCluster();
+    if (!g_unixPath.empty()) thread(unixListener).detach();
+
+    // Sesiones heredadas del proceso anterior: siguen donde estaban
+    for (ParkedSession& parked : g_inheritedSessions) {
+        g_activeSessions++;
+        thread(resumeClient, parked.sock, move(parked.state)).detach();
     }
+    if (!g_inheritedSessions.empty()) {
+        cout << "[LoquiServer] Reanudadas " << g_inheritedSessions.size() << " sesiones del proceso anterior." << std::endl;
+        g_inheritedSessions.clear();
+    }
+    if (!g_upgradePath.empty()) thread(upgradeListener).detach();
 
-    cout << "[LoquiServer] Servidor iniciado en el puerto 12345." << std::endl;
     cout << "[LoquiServer] Esperando conexiones..." << std::endl;
 
     // 6. Bucle de Aceptación de Clientes
     SOCKET clientSocket;
     while (true) {
-        clientSocket = accept(listenSocket, NULL, NULL);
+        clientSocket = acceptClient(listenSocket);
         if (clientSocket == INVALID_SOCKET) {
             cerr << "accept failed: " << WSAGetLastError() << endl;
             continue; // Continuar escuchando
@@ -114,7 +758,7 @@ int main() {
         cout << "[LoquiServer] Nuevo cliente conectado." << endl;
 
         // Crear un hilo para manejar a este cliente (Hito H-3)
-        thread clientThread(handleClient, clientSocket);
+        thread clientThread(handleClient, clientSocket, false);
         clientThread.detach(); // El hilo se ejecutará de forma independiente
     }
 
@@ -124,166 +768,696 @@ int main() {
     return 0;
 }
 
-// Función que se ejecuta en un hilo para cada cliente
-void handleClient(SOCKET clientSocket) {
-    char recvbuf[512];
+// Función que se ejecuta en un hilo para cada cliente (local = socket AF_UNIX)
+void handleClient(SOCKET clientSocket, bool local) {
+    ClientSession session;
+
+    session.conn = make_shared<Connection>();
+    session.conn->sock = clientSocket;
+    session.conn->lastActivityMs = monotonicMs();
+    if (local) {
+        session.conn->local = true;
+        session.conn->peerAccount = unixPeerAccount(clientSocket);
+    }
+    // Un send a un cliente muerto con el buffer lleno no puede bloquear para siempre
+    DWORD sendTimeoutMs = 30000;
+    setsockopt(clientSocket, SOL_SOCKET, SO_SNDTIMEO, (const char*)&sendTimeoutMs, sizeof(sendTimeoutMs));
+    if (!local) enableKeepalive(clientSocket);
+    watchConnection(session.conn); // Antes del handshake: también cuenta para el plazo de login
+    // El socket local no sale del equipo: sin TLS
+    if (!local && !startTls(*session.conn)) {
+        closeConnection(*session.conn);
+        g_activeSessions--;
+        return;
+    }
+    runSession(session);
+}
+
+// Sesión recibida de otro proceso en un relevo: se reconstruye y sigue leyendo
+void resumeClient(SOCKET clientSocket, std::string state) {
+    ClientSession session;
+    session.conn = make_shared<Connection>();
+    session.conn->sock = clientSocket;
+    session.conn->lastActivityMs = monotonicMs();
+    if (!decodeSessionState(state, session)) {
+        cerr << "[LoquiServer] Estado de sesion heredado invalido. Cerrando conexion." << std::endl;
+        releaseUploads(session);
+        closeConnection(*session.conn);
+        g_activeSessions--;
+        return;
+    }
+    if (session.userId != NO_USER) {
+        lock_guard<mutex> lock(g_clientsMutex);
+        g_connectedClients[session.userId] = session.conn;
+        broadcastToPeers("DIR|ON|" + session.username);
+    }
+    watchConnection(session.conn);
+    runSession(session);
+}
+
+// Bucle de recepción y desconexión, comunes a conexiones nuevas y heredadas
+void runSession(ClientSession& session) {
     int iResult;
-    string currentUsername; // Nombre del usuario logueado en este hilo
+    vector<char> recvbuf(16384);
 
     // Bucle de recepción de mensajes del cliente
-    while ((iResult = recv(clientSocket, recvbuf, sizeof(recvbuf), 0)) > 0) {
-        string message(recvbuf, iResult);
-        cout << "[LoquiServer] Recibido: " << message << std::endl;
+    while (true) {
+        if (!waitForInput(*session.conn)) {
+            parkSession(session); // Relevo en curso: el socket sigue abierto para el proceso nuevo
+            return;
+        }
+        if ((iResult = connRead(*session.conn, recvbuf.data(), (int)recvbuf.size())) <= 0) break;
+        session.conn->lastActivityMs = monotonicMs();
+        session.recvUs = traceNowUs();
+        session.pending.append(recvbuf.data(), iResult);
+        if (!processPending(session)) break;
+    }
 
-        vector<std::string> parts = split(message, '|');
-        if (parts.empty()) continue;
+    // --- Desconexión del Cliente ---
+    cout << "[LoquiServer] Cliente desconectado." << endl;
+    releaseUploads(session);
+    if (!session.username.empty()) {
+        std::lock_guard<std::mutex> lock(g_clientsMutex);
+        g_connectedClients.erase(session.userId);
+        broadcastToPeers("DIR|OFF|" + session.username);
+        cout << "[LoquiServer] Usuario " << session.username << " ha cerrado sesion." << endl;
+    }
+    closeConnection(*session.conn);
+    g_activeSessions--;
+}
+
+// Acepta clientes en unix.path con el mismo protocolo que el puerto TCP
+void unixListener() {
+    sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    if (g_unixPath.size() >= sizeof(addr.sun_path)) {
+        cerr << "[LoquiServer] unix.path demasiado larga: " << g_unixPath << std::endl;
+        return;
+    }
+    memcpy(addr.sun_path, g_unixPath.c_str(), g_unixPath.size());
 
-        string cmd = parts[0];
-        string response;
+    // En un relevo el socket (y su archivo) vienen del proceso anterior
+    SOCKET listenSocket = takeListener("unix");
+    if (listenSocket == INVALID_SOCKET) {
+        listenSocket = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (listenSocket == INVALID_SOCKET) {
+            cerr << "[LoquiServer] No se pudo crear el socket local: " << WSAGetLastError() << std::endl;
+            return;
+        }
+        // El archivo de una ejecución anterior impediría el bind
+        error_code ec;
+        filesystem::remove(g_unixPath, ec);
+        if (bind(listenSocket, (SOCKADDR*)&addr, sizeof(addr)) == SOCKET_ERROR || listen(listenSocket, SOMAXCONN) == SOCKET_ERROR) {
+            cerr << "[LoquiServer] No se pudo escuchar en " << g_unixPath << ": " << WSAGetLastError() << std::endl;
+            closesocket(listenSocket);
+            return;
+        }
+    }
+    keepListener("unix", listenSocket);
+    cout << "[LoquiServer] Escuchando en " << g_unixPath << " (AF_UNIX)." << std::endl;
 
-        // --- Procesamiento del Protocolo (RF-1.0 a RF-6.0) ---
+    while (true) {
+        SOCKET clientSocket = acceptClient(listenSocket);
+        if (clientSocket == INVALID_SOCKET) {
+            cerr << "accept failed: " << WSAGetLastError() << endl;
+            continue;
+        }
+        cout << "[LoquiServer] Nuevo cliente local conectado." << endl;
+        thread(handleClient, clientSocket, true).detach();
+    }
+}
 
-        if (cmd == "REGISTER" && parts.size() == 3) {
-            // RF-1.0: REGISTRO (CON HASHING Y PERSISTENCIA)
-            string user = parts[1];
-            string pass_plain = parts[2];
+// Cuenta del sistema del proceso al otro lado del socket local ("" si no se sabe).
+// Es EQUIPO\cuenta (o DOMINIO\cuenta).
+string unixPeerAccount(SOCKET sock) {
+    ULONG pid = 0;
+    DWORD bytes = 0;
+    if (WSAIoctl(sock, SIO_AF_UNIX_GETPEERPID, NULL, 0, &pid, sizeof(pid), &bytes, NULL, NULL) == SOCKET_ERROR) return "";
+    HANDLE process = OpenProcess(PROCESS_QUERY_LIMITED_INFORMATION, FALSE, pid);
+    if (process == NULL) return "";
+    string account = processAccount(process);
+    CloseHandle(process);
+    return account;
+}
 
-            lock_guard<mutex> lock(g_userStoreMutex);
-            if (g_userStore.find(user) == g_userStore.end()) {
-                // 1. Generar Salt
-                string salt = generateSalt();
-                // 2. Calcular Hash
-                string hash = picosha2::hash256_hex_string(pass_plain + salt);
+// DOMINIO\cuenta del token de un proceso ("" si no se puede leer)
+string processAccount(HANDLE process) {
+    string account;
+    HANDLE token = NULL;
+    if (OpenProcessToken(process, TOKEN_QUERY, &token)) {
+        char info[256];
+        DWORD infoLen = 0;
+        if (GetTokenInformation(token, TokenUser, info, sizeof(info), &infoLen)) {
+            char name[256], domain[256];
+            DWORD nameLen = sizeof(name), domainLen = sizeof(domain);
+            SID_NAME_USE use;
+            if (LookupAccountSidA(NULL, ((TOKEN_USER*)info)->User.Sid, name, &nameLen, domain, &domainLen, &use)) {
+                account = string(domain) + "\\" + name;
+            }
+        }
+        CloseHandle(token);
+    }
+    return account;
+}
 
-                // 3. Guardar en memoria
-                UserData newUser = {salt, hash};
-                g_userStore[user] = newUser;
+// Windows no distingue mayúsculas en dominios ni cuentas
+string normalizeAccount(const std::string& account) {
+    string out = account;
+    for (char& c : out) c = (char)tolower((unsigned char)c);
+    return out;
+}
 
-                // 4. Guardar en archivo (Persistencia)
-                saveUser(user, newUser);
+// DOMINIO\cuenta entra como el usuario 'user' si DOMINIO es unix.domain y
+// cuenta coincide con el nombre del usuario
+bool localAccountMatches(const std::string& account, const std::string& user) {
+    size_t slash = account.find('\\');
+    if (slash == string::npos) return false;
+    return normalizeAccount(account.substr(0, slash)) == normalizeAccount(g_unixDomain) &&
+           normalizeAccount(account.substr(slash + 1)) == normalizeAccount(user);
+}
 
-                response = "RESP|OK|Usuario registrado con exito.";
-            } else {
-                response = "RESP|ERROR|El nombre de usuario ya existe.";
-            }
-            sendResponse(clientSocket, response); // USAR NUEVO HELPER
+// Ejecuta los comandos completos que haya en session.pending.
+// Devuelve false si hay que cerrar la conexión (DC o entrada inválida).
+bool processPending(ClientSession& session) {
+    // Clientes antiguos (sin HELLO): cada recv es un comando, sin '\n'
+    if (!session.framed && session.pending.rfind("HELLO", 0) != 0) {
+        string message;
+        message.swap(session.pending);
+        if (!message.empty() && message.back() == '\n') message.pop_back();
+        return processCommand(session, message, "");
+    }
+    session.framed = true;
 
-        } else if (cmd == "LOGIN" && parts.size() == 3) {
-            // RF-2.0: INICIO DE SESIÓN (CON HASHING)
-            string user = parts[1];
-            string pass_plain = parts[2];
+    size_t pos;
+    while ((pos = session.pending.find('\n')) != string::npos) {
+        string line = session.pending.substr(0, pos);
+        if (!line.empty() && line.back() == '\r') line.pop_back();
+        // "#<id>|COMANDO...": la primera línea de la respuesta lleva la misma etiqueta
+        string tag;
+        if (line.size() > 1 && line[0] == '#') {
+            size_t bar = line.find('|');
+            tag = line.substr(1, bar == string::npos ? string::npos : bar - 1);
+            line.erase(0, bar == string::npos ? line.size() : bar + 1);
+        }
+        // Los comandos con datos binarios indican su longitud en la cabecera
+        size_t payloadLen = framePayloadLength(line);
+        if (payloadLen > ATTACH_CHUNK_MAX) {
+            cerr << "[LoquiServer] Trozo de adjunto demasiado grande (" << payloadLen << " bytes). Cerrando conexion." << std::endl;
+            return false;
+        }
+        if (session.pending.size() < pos + 1 + payloadLen) break; // Falta parte de los datos
+        string payload = session.pending.substr(pos + 1, payloadLen);
+        session.pending.erase(0, pos + 1 + payloadLen);
+        if (!tag.empty()) {
+            t_requestConn = session.conn.get();
+            t_requestTag = tag;
+        }
+        bool keep = processCommand(session, line, payload);
+        if (t_requestConn) {
+            // El comando no contestó nada (MSG entregado, PONG...): el cliente cierra la petición igual
+            t_requestConn = nullptr;
+            if (keep) connWrite(*session.conn, "#" + tag + "|RESP|OK\n", true);
+        }
+        if (!keep) return false;
+    }
 
-            bool authSuccess = false;
-            {
-                lock_guard<std::mutex> lock(g_userStoreMutex);
-                auto it = g_userStore.find(user);
-                if (it != g_userStore.end()) {
-                    // Usuario encontrado, verificar contraseña
-                    string storedSalt = it->second.salt;
-                    string storedHash = it->second.hash;
-
-                    // 1. Calcular hash del intento
-                    string attemptHash = picosha2::hash256_hex_string(pass_plain + storedSalt);
-
-                    // 2. Comparar
-                    if (attemptHash == storedHash) {
-                        authSuccess = true;
-                    }
-                }
-                // Si el usuario no existe (it == g_userStore.end()), authSuccess sigue false
+    if (session.pending.size() > MAX_PENDING_INPUT) {
+        cerr << "[LoquiServer] Linea demasiado larga. Cerrando conexion." << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// Longitud de los datos que siguen a la cabecera:
+// UPLOAD_CHUNK|sha|offset|longitud y MSGBATCH|longitud
+size_t framePayloadLength(const std::string& line) {
+    vector<string> parts;
+    long long len = 0;
+    if (line.rfind("UPLOAD_CHUNK|", 0) == 0) {
+        parts = split(line, '|');
+        if (parts.size() == 4) len = atoll(parts[3].c_str());
+    } else if (line.rfind("MSGBATCH|", 0) == 0) {
+        parts = split(line, '|');
+        if (parts.size() == 2) len = atoll(parts[1].c_str());
+    }
+    return len > 0 ? (size_t)len : 0;
+}
+
+// Registra la sesión ya autenticada (LOGIN o LOGIN_LOCAL); devuelve la respuesta
+string completeLogin(ClientSession& session, const std::string& user, UserId userId) {
+    lock_guard<std::mutex> lock(g_clientsMutex);
+    bool remoteSession = false;
+    {
+        lock_guard<mutex> remoteLock(g_remoteUsersMutex);
+        remoteSession = g_remoteUsers.count(user) > 0;
+    }
+    // Verificar si ya está conectado (en este nodo o en otro del clúster)
+    if (g_connectedClients.find(userId) != g_connectedClients.end() || remoteSession) {
+        return "RESP|ERROR|Usuario ya esta conectado.";
+    }
+    g_connectedClients[userId] = session.conn;
+    session.username = user; // Asignar usuario a este hilo
+    session.userId = userId;
+    session.conn->authenticated = true;
+    // Bajo g_clientsMutex para que el orden ON/OFF coincida con el del registro
+    broadcastToPeers("DIR|ON|" + user);
+    std::cout << "[LoquiServer] Usuario " << user << " ha iniciado sesion";
+    if (session.conn->local) std::cout << " (local, cuenta " << session.conn->peerAccount << ")";
+    std::cout << "." << std::endl;
+    return "RESP|OK|Login exitoso.";
+}
+
+// Procesa un comando del cliente; devuelve false si pidió desconectarse (DC)
+bool processCommand(ClientSession& session, const std::string& message, const std::string& payload) {
+    vector<std::string> parts = split(message, '|');
+    if (parts.empty()) return true;
+
+    string cmd = parts[0];
+    string response;
+
+    // Muestreo de trazas: solo comandos que envían mensajes
+    struct TraceScope {
+        MessageTrace trace;
+        bool active = false;
+        ~TraceScope() {
+            if (!active) return;
+            t_trace = nullptr;
+            traceCommit(trace);
+        }
+    } traceScope;
+    if (g_traceSampleEvery > 0 && (cmd == "MSG" || cmd == "MSGMULTI" || cmd == "MSGBATCH" || cmd == "FILE") &&
+        g_traceSampleCounter++ % g_traceSampleEvery == 0) {
+        MessageTrace& trace = traceScope.trace;
+        traceScope.active = true;
+        snprintf(trace.command, sizeof(trace.command), "%s", cmd.c_str());
+        snprintf(trace.from, sizeof(trace.from), "%s", session.username.c_str());
+        snprintf(trace.to, sizeof(trace.to), "%s", parts.size() > 1 && cmd != "MSGBATCH" ? parts[1].c_str() : "");
+        trace.stampUs[TRACE_RECV] = session.recvUs;
+        t_trace = &trace;
+        traceMark(TRACE_PARSE);
+    }
+
+    if (cmd != "UPLOAD_CHUNK" && cmd != "PONG") { // Ni los trozos de adjuntos ni los heartbeats
+        cout << "[LoquiServer] Recibido: " << message << std::endl;
+    }
+
+    // --- Limitación de tasa y admisión (antes de tocar disco o registro) ---
+    if (cmd != "DC" && cmd != "PONG") {
+        CommandClass cls = classifyCommand(cmd);
+        long long retryAfterMs = checkRateLimit(cls, session.buckets, session.userId, commandCost(cmd, parts, payload));
+        if (cls == CLASS_BULK) {
+            // Sin rechazo: se espera al siguiente token y TCP frena al emisor
+            while (retryAfterMs > 0) {
+                g_throttledTotal++;
+                this_thread::sleep_for(chrono::milliseconds(retryAfterMs));
+                retryAfterMs = checkRateLimit(cls, session.buckets, session.userId);
             }
+        } else if (retryAfterMs > 0) {
+            g_throttledTotal++;
+        } else if ((retryAfterMs = admitRequest(cls)) > 0) {
+            g_shedTotal++;
+        }
+        if (retryAfterMs > 0) {
+            // RESP|RETRY|texto|ms
+            sendResponse(*session.conn, "RESP|RETRY|Servidor ocupado, reintenta en " + to_string(retryAfterMs) +
+                         " ms.|" + to_string(retryAfterMs));
+            return true;
+        }
+    }
+    traceMark(TRACE_ADMISSION);
 
-            if (authSuccess) {
-                lock_guard<std::mutex> lock(g_clientsMutex);
-                // Verificar si ya está conectado
-                if (g_connectedClients.find(user) != g_connectedClients.end()) {
-                    response = "RESP|ERROR|Usuario ya esta conectado.";
-                } else {
-                    g_connectedClients[user] = clientSocket;
-                    currentUsername = user; // Asignar usuario a este hilo
-                    response = "RESP|OK|Login exitoso.";
-                    std::cout << "[LoquiServer] Usuario " << user << " ha iniciado sesion." << std::endl;
+    // --- Procesamiento del Protocolo (RF-1.0 a RF-6.0) ---
+
+    if (cmd == "REGISTER" && parts.size() == 3) {
+        // RF-1.0: REGISTRO (CON HASHING Y PERSISTENCIA)
+        string user = parts[1];
+        string pass_plain = parts[2];
+
+        lock_guard<mutex> lock(g_userStoreMutex);
+        if (findUserId(user) == NO_USER) {
+            // 1. Generar Salt
+            string salt = generateSalt();
+            // 2. Calcular Hash
+            string hash = picosha2::hash256_hex_string(pass_plain + salt);
+
+            // 3. Guardar en memoria (asigna el id del usuario)
+            UserData newUser = {salt, hash};
+            UserId id = storeUser(user, newUser);
+
+            // 4. Guardar en archivo (Persistencia)
+            saveUser(user, newUser, id);
+
+            // 5. Replicar el registro al resto del clúster
+            broadcastToPeers("REG|" + user + "|" + salt + "|" + hash);
+
+            response = "RESP|OK|Usuario registrado con exito.";
+        } else {
+            response = "RESP|ERROR|El nombre de usuario ya existe.";
+        }
+        sendResponse(*session.conn, response); // USAR NUEVO HELPER
+
+    } else if (cmd == "LOGIN" && parts.size() == 3) {
+        // RF-2.0: INICIO DE SESIÓN (CON HASHING)
+        string user = parts[1];
+        string pass_plain = parts[2];
+
+        bool authSuccess = false;
+        UserId userId = NO_USER;
+        {
+            lock_guard<std::mutex> lock(g_userStoreMutex);
+            userId = findUserId(user);
+            if (userId != NO_USER) {
+                // Usuario encontrado, verificar contraseña
+                string storedSalt = g_userStore[userId].salt;
+                string storedHash = g_userStore[userId].hash;
+
+                // 1. Calcular hash del intento
+                string attemptHash = picosha2::hash256_hex_string(pass_plain + storedSalt);
+
+                // 2. Comparar
+                if (attemptHash == storedHash) {
+                    authSuccess = true;
                 }
-            } else {
-                response = "RESP|ERROR|Credenciales incorrectas.";
             }
-            sendResponse(clientSocket, response); // USAR NUEVO HELPER
+            // Si el usuario no existe (NO_USER), authSuccess sigue false
+        }
 
-        } else if (cmd == "MSG" && parts.size() >= 3 && !currentUsername.empty()) {
-            // RF-3.0 & RF-4.0: ENVÍO/RECEPCIÓN DE MENSAJES (AHORA CON TIMESTAMP)
-            string toUser = parts[1];
-            string chatMessage = parts[2];
-            // Reconstruir el mensaje si tenía '|'
-            for (size_t i = 3; i < parts.size(); ++i) {
-                chatMessage += "|" + parts[i];
-            }
+        if (authSuccess) {
+            response = completeLogin(session, user, userId);
+        } else {
+            response = "RESP|ERROR|Credenciales incorrectas.";
+        }
+        sendResponse(*session.conn, response); // USAR NUEVO HELPER
+
+    } else if (cmd == "LOGIN_LOCAL" && parts.size() == 2) {
+        // Socket local: la identidad la da el sistema (cuenta del proceso cliente).
+        // Una cuenta de unix.domain entra como el usuario de su mismo nombre; las de
+        // unix.trusted, como cualquiera.
+        string user = parts[1];
+        const string& account = session.conn->peerAccount;
+        UserId userId = findUserId(user);
+        if (!session.conn->local) {
+            response = "RESP|ERROR|LOGIN_LOCAL solo esta disponible en el socket local.";
+        } else if (account.empty() || (!localAccountMatches(account, user) && g_unixTrusted.count(normalizeAccount(account)) == 0)) {
+            response = "RESP|ERROR|No autorizado.";
+        } else if (userId == NO_USER) {
+            response = "RESP|ERROR|El usuario " + user + " no existe.";
+        } else {
+            response = completeLogin(session, user, userId);
+        }
+        sendResponse(*session.conn, response);
+
+    } else if (cmd == "MSG" && parts.size() >= 3 && !session.username.empty()) {
+        // RF-3.0 & RF-4.0: ENVÍO/RECEPCIÓN DE MENSAJES (AHORA CON TIMESTAMP)
+        string toUser = parts[1];
+        string chatMessage = parts[2];
+        // Reconstruir el mensaje si tenía '|'
+        for (size_t i = 3; i < parts.size(); ++i) {
+            chatMessage += "|" + parts[i];
+        }
 
-            sendMessageToClient(currentUsername, toUser, chatMessage);
+        UserId toId = findUserId(toUser);
+        if (chatMessage.rfind("@adjunto:", 0) == 0) {
+            // Solo FILE crea referencias: darían acceso al adjunto a quien no lo tiene
+            sendResponse(*session.conn, "RESP|ERROR|Los adjuntos se envian con FILE.");
+        } else if (toId == NO_USER) {
+            sendResponse(*session.conn, "RESP|ERROR|El usuario " + toUser + " no existe.");
+        } else {
+            sendMessageToClient(session.userId, toId, chatMessage);
+        }
+
+    } else if (cmd == "MSGMULTI" && parts.size() >= 3 && !session.username.empty()) {
+        // MSGMULTI|dest1,dest2,...|mensaje -> MSGMULTI_RESP|dest1|estado|dest2|estado...
+        string chatMessage = parts[2];
+        for (size_t i = 3; i < parts.size(); ++i) chatMessage += "|" + parts[i];
+        vector<OutgoingMessage> batch;
+        for (const string& toUser : recipientList(parts[1])) batch.push_back({toUser, chatMessage});
+        if (chatMessage.rfind("@adjunto:", 0) == 0) {
+            sendResponse(*session.conn, "RESP|ERROR|Los adjuntos se envian con FILE.");
+        } else if (batch.empty() || (int)batch.size() > g_maxRecipients) {
+            sendResponse(*session.conn, "RESP|ERROR|Entre 1 y " + to_string(g_maxRecipients) + " destinatarios.");
+        } else {
+            vector<string> status = sendMessageBatch(session.userId, batch);
+            response = "MSGMULTI_RESP";
+            for (size_t i = 0; i < batch.size(); ++i) response += "|" + batch[i].toUser + "|" + status[i];
+            sendResponse(*session.conn, response);
+        }
 
-        } else if (cmd == "LIST" && !currentUsername.empty()) {
-            // RF-5.0: LISTADO DE USUARIOS
-            response = "LIST_RESP";
-            lock_guard<std::mutex> lock(g_clientsMutex);
-            for (auto const& [user, sock] : g_connectedClients) {
-                response += "|" + user;
+    } else if (cmd == "MSGBATCH" && !session.username.empty()) {
+        // MSGBATCH|longitud + líneas "dest1,dest2|mensaje": mensajes independientes en una trama.
+        // Respuesta: MSGBATCH_RESP|linea|dest|estado|linea|dest|estado...
+        vector<OutgoingMessage> batch;
+        vector<size_t> lineOf;
+        vector<string> lines = split(payload, '\n');
+        for (size_t i = 0; i < lines.size(); ++i) {
+            size_t bar = lines[i].find('|');
+            if (bar == string::npos || lines[i].compare(bar + 1, 9, "@adjunto:") == 0) continue; // Adjuntos: solo con FILE
+            for (const string& toUser : recipientList(lines[i].substr(0, bar))) {
+                batch.push_back({toUser, lines[i].substr(bar + 1)});
+                lineOf.push_back(i);
+            }
+        }
+        if (batch.empty() || (int)batch.size() > g_maxRecipients) {
+            sendResponse(*session.conn, "RESP|ERROR|Entre 1 y " + to_string(g_maxRecipients) + " destinatarios por lote.");
+        } else {
+            vector<string> status = sendMessageBatch(session.userId, batch);
+            response = "MSGBATCH_RESP";
+            for (size_t i = 0; i < batch.size(); ++i) {
+                response += "|" + to_string(lineOf[i]) + "|" + batch[i].toUser + "|" + status[i];
             }
-            sendResponse(clientSocket, response); // USAR NUEVO HELPER
+            sendResponse(*session.conn, response);
+        }
+
+    } else if (cmd == "LIST" && !session.username.empty()) {
+        // RF-5.0: LISTADO DE USUARIOS
+        response = "LIST_RESP";
+        lock_guard<std::mutex> lock(g_clientsMutex);
+        for (auto const& [userId, conn] : g_connectedClients) {
+            response += "|" + userName(userId);
+        }
+        // Usuarios conectados en otros nodos del clúster
+        lock_guard<mutex> remoteLock(g_remoteUsersMutex);
+        for (auto const& [user, node] : g_remoteUsers) {
+            if (g_connectedClients.count(findUserId(user)) == 0) response += "|" + user;
+        }
+        sendResponse(*session.conn, response); // USAR NUEVO HELPER
 
-        } else if (cmd == "HISTORY" && parts.size() == 2 && !currentUsername.empty()) {
-            // NUEVO: RF-7.0 (IMPLÍCITO): SOLICITAR HISTORIAL DE CONVERSACIÓN
-            string otherUser = parts[1];
-            sendHistoryToClient(clientSocket, currentUsername, otherUser);
+    } else if (cmd == "HISTORY" && parts.size() == 2 && !session.username.empty()) {
+        // NUEVO: RF-7.0 (IMPLÍCITO): SOLICITAR HISTORIAL DE CONVERSACIÓN
+        string otherUser = parts[1];
+        UserId otherId = findUserId(otherUser);
+        if (otherId == NO_USER) {
+            sendResponse(*session.conn, "RESP|OK|No hay historial de mensajes con " + otherUser + ".");
+        } else {
+            g_heavyInFlight++;
+            sendHistoryToClient(*session.conn, session.userId, otherId);
+            g_heavyInFlight--;
+        }
 
-        } else if (cmd == "DC") {
-            // RF-6.0: CIERRE DE SESIÓN
-            break; // Salir del bucle
+    } else if (cmd == "HISTORY" && parts.size() == 3 && !session.username.empty()) {
+        // Sincronización incremental: HISTORY|otherUser|ultimoIdEnCache (-1 = sin caché)
+        UserId otherId = findUserId(parts[1]);
+        if (otherId == NO_USER) {
+            sendResponse(*session.conn, "HISTORY_DELTA|" + parts[1] + "|-1|1");
+        } else {
+            g_heavyInFlight++;
+            sendHistoryDelta(*session.conn, session.userId, otherId, atoll(parts[2].c_str()));
+            g_heavyInFlight--;
         }
 
-    } // Fin del bucle while(recv)
+    } else if (cmd == "UPLOAD_BEGIN" && parts.size() == 3 && !session.username.empty()) {
+        // UPLOAD_BEGIN|sha256|tamaño -> UPLOAD_OK (ya existe) o UPLOAD_OFFSET (desde dónde seguir)
+        handleUploadBegin(session, parts[1], atoll(parts[2].c_str()));
 
-    // --- Desconexión del Cliente ---
-    cout << "[LoquiServer] Cliente desconectado." << endl;
-    if (!currentUsername.empty()) {
-        std::lock_guard<std::mutex> lock(g_clientsMutex);
-        g_connectedClients.erase(currentUsername);
-        cout << "[LoquiServer] Usuario " << currentUsername << " ha cerrado sesion." << endl;
+    } else if (cmd == "UPLOAD_CHUNK" && parts.size() == 4 && !session.username.empty()) {
+        // UPLOAD_CHUNK|sha256|offset|longitud seguido de 'longitud' bytes
+        handleUploadChunk(session, parts[1], atoll(parts[2].c_str()), payload);
+
+    } else if (cmd == "FILE" && parts.size() >= 4 && !session.username.empty()) {
+        // FILE|destinatario|sha256|nombre: el mensaje solo lleva la referencia
+        string sha = parts[2];
+        string name = parts[3];
+        for (size_t i = 4; i < parts.size(); ++i) name += "|" + parts[i];
+        name = safeFileName(name); // Sin ':' ni rutas: el receptor guarda el archivo con este nombre
+        UserId toId = findUserId(parts[1]);
+        if (!isValidSha(sha) || !canAccessAttachment(sha, session.userId) || !filesystem::exists(attachmentPath(sha))) {
+            sendResponse(*session.conn, "RESP|ERROR|Adjunto no encontrado en el servidor.");
+        } else if (name.empty()) {
+            sendResponse(*session.conn, "RESP|ERROR|Nombre de adjunto invalido.");
+        } else if (toId == NO_USER) {
+            sendResponse(*session.conn, "RESP|ERROR|El usuario " + parts[1] + " no existe.");
+        } else {
+            long long size = fileSize(attachmentPath(sha));
+            sendMessageToClient(session.userId, toId, "@adjunto:" + sha + ":" + to_string(size) + ":" + name);
+        }
+
+    } else if (cmd == "DOWNLOAD" && parts.size() == 3 && !session.username.empty()) {
+        // DOWNLOAD|sha256|offset -> FILE_INFO, FILE_DATA..., FILE_END
+        handleDownload(session, parts[1], atoll(parts[2].c_str()));
+
+    } else if (cmd == "SNAPSHOT" && !session.username.empty()) {
+        // SNAPSHOT -> RESP|OK al empezar y SNAPSHOT_RESP|OK|directorio|offsetUsuarios|offsetHistorial al terminar
+        if (g_adminUsers.count(session.username) == 0) {
+            sendResponse(*session.conn, "RESP|ERROR|No autorizado.");
+        } else if (g_snapshotRunning.exchange(true)) {
+            sendResponse(*session.conn, "RESP|ERROR|Ya hay un snapshot en curso.");
+        } else {
+            sendResponse(*session.conn, "RESP|OK|Snapshot iniciado.");
+            thread(runSnapshot, session.conn, session.username).detach();
+        }
+
+    } else if (cmd == "HELLO") {
+        // Negociación: el cliente que envía HELLO usa comandos terminados en '\n'
+        // y contesta PONG a los PING del servidor
+        session.conn->heartbeats = true;
+        string capabilities = "adjuntos,ping,ids";
+#ifdef LOQUI_ZLIB
+        // deflate solo si el cliente la pide: HELLO|...,deflate
+        vector<string> requested = parts.size() >= 2 ? split(parts[1], ',') : vector<string>();
+        bool deflate = g_compressThreshold > 0 && !session.conn->deflater &&
+                       find(requested.begin(), requested.end(), "deflate") != requested.end();
+        if (deflate) capabilities += ",deflate";
+        sendResponse(*session.conn, "HELLO|OK|" + capabilities);
+        // Después de la respuesta: el HELLO|OK tiene que llegar en claro
+        if (deflate) startCompression(*session.conn);
+#else
+        sendResponse(*session.conn, "HELLO|OK|" + capabilities);
+#endif
+
+    } else if (cmd == "PONG") {
+        // Respuesta a PING: basta con haber recibido algo (lastActivityMs)
+
+    } else if (cmd == "DC") {
+        // RF-6.0: CIERRE DE SESIÓN
+        return false;
     }
-    closesocket(clientSocket);
+
+    return true;
 }
 
 // NUEVA: Agrega el delimitador de fin de mensaje y lo envía
-void sendResponse(SOCKET clientSocket, const std::string& response) {
+void sendResponse(Connection& conn, const std::string& response) {
+    if (&conn == t_requestConn) {
+        // Primera línea para quien hizo la petición con id: lleva su etiqueta
+        t_requestConn = nullptr;
+        connWrite(conn, "#" + t_requestTag + "|" + response + "\n", true);
+        return;
+    }
     // Añadimos un delimitador de nueva línea para indicar el final del mensaje
-    string delimitedResponse = response + "\n";
-    send(clientSocket, delimitedResponse.c_str(), delimitedResponse.length(), 0);
+    connWrite(conn, response + "\n", true);
+}
+
+// Línea que no responde a ningún comando de esa conexión (MSG entregados):
+// nunca lleva etiqueta, aunque alguien se escriba a sí mismo
+void sendEvent(Connection& conn, const std::string& line) {
+    connWrite(conn, line + "\n", true);
 }
 
 // Función auxiliar para enviar un mensaje a un usuario específico
-void sendMessageToClient(const std::string& fromUser, const std::string& toUser, const std::string& chatMessage) {
+void sendMessageToClient(UserId fromUser, UserId toUser, const std::string& chatMessage) {
     string timestamp = getCurrentTimestamp();
-    // Formato: "MSG|timestamp|fromUser|chatMessage"
-    string fullMessage = "MSG|" + timestamp + "|" + fromUser + "|" + chatMessage;
 
     // 1. Persistir el mensaje
     saveMessage(fromUser, toUser, timestamp, chatMessage);
+    traceMark(TRACE_PERSIST);
+
+    // 2. Replicar a los demás nodos: todos lo guardan en su historial y
+    // el nodo donde esté conectado el destinatario se lo entrega.
+    // Entre nodos van nombres: cada nodo tiene sus propios ids.
+    string toName = userName(toUser);
+    broadcastToPeers("MSG|" + timestamp + "|" + userName(fromUser) + "|" + toName + "|" + chatMessage);
+    traceMark(TRACE_CLUSTER);
+
+    // 3. Intentar enviar al destinatario si está en este nodo
+    if (!deliverLocal(fromUser, toUser, timestamp, chatMessage)) {
+        string remoteNode;
+        {
+            lock_guard<mutex> lock(g_remoteUsersMutex);
+            auto it = g_remoteUsers.find(toName);
+            if (it != g_remoteUsers.end()) remoteNode = it->second;
+        }
+        if (!remoteNode.empty()) {
+            cout << "[LoquiServer] Mensaje para " << toName << " reenviado al nodo " << remoteNode << "." << std::endl;
+        } else {
+            cout << "[LoquiServer] Usuario " << toName << " no conectado. Mensaje guardado." << std::endl;
+            // Opcional: enviar un "RESP|ERROR|Usuario no conectado" al remitente
+        }
+    }
+}
+
+// Envío a varios destinatarios con una sola marca de tiempo, un solo append al
+// log y una sola pasada por cada registro. Devuelve el estado de cada entrada:
+// ENTREGADO, REENVIADO (conectado en otro nodo), GUARDADO (sin conexión) o NOEXISTE.
+vector<std::string> sendMessageBatch(UserId fromUser, vector<OutgoingMessage>& batch) {
+    string timestamp = getCurrentTimestamp();
+    string fromName = userName(fromUser);
+    vector<string> status(batch.size());
+    vector<shared_ptr<Connection>> targets(batch.size());
+    {
+        shared_lock<shared_mutex> lock(g_symbolsMutex);
+        for (size_t i = 0; i < batch.size(); ++i) {
+            auto it = g_userIds.find(batch[i].toUser);
+            if (it == g_userIds.end()) status[i] = "NOEXISTE";
+            else batch[i].to = it->second;
+        }
+    }
+    {
+        lock_guard<mutex> lock(g_clientsMutex);
+        lock_guard<mutex> remoteLock(g_remoteUsersMutex);
+        for (size_t i = 0; i < batch.size(); ++i) {
+            if (!status[i].empty()) continue;
+            auto it = g_connectedClients.find(batch[i].to);
+            if (it != g_connectedClients.end()) {
+                targets[i] = it->second;
+                status[i] = "ENTREGADO";
+            } else {
+                status[i] = g_remoteUsers.count(batch[i].toUser) ? "REENVIADO" : "GUARDADO";
+            }
+        }
+    }
+    traceMark(TRACE_REGISTRY);
+
+    vector<StoredMessage> stored;
+    vector<string> peerLines;
+    for (size_t i = 0; i < batch.size(); ++i) {
+        if (status[i] == "NOEXISTE") continue;
+        stored.push_back({timestamp, fromUser, batch[i].to, batch[i].text});
+        peerLines.push_back("MSG|" + timestamp + "|" + fromName + "|" + batch[i].toUser + "|" + batch[i].text);
+    }
+    if (stored.empty()) return status;
+    saveMessages(stored);
+    traceMark(TRACE_PERSIST);
+    broadcastToPeers(peerLines);
+    traceMark(TRACE_CLUSTER);
+
+    for (size_t i = 0; i < batch.size(); ++i) {
+        if (targets[i]) sendEvent(*targets[i], "MSG|" + timestamp + "|" + fromName + "|" + batch[i].text);
+    }
+    traceMark(TRACE_SEND);
+    cout << "[LoquiServer] Envio multiple de " << fromName << ": " << stored.size() << " mensajes." << std::endl;
+    return status;
+}
 
-    // 2. Intentar enviar al destinatario
-    SOCKET targetSocket = INVALID_SOCKET;
+// Entrega un mensaje ya persistido si el destinatario está conectado a este nodo
+bool deliverLocal(UserId fromUser, UserId toUser, const std::string& timestamp, const std::string& chatMessage) {
+    shared_ptr<Connection> target;
     {
         lock_guard<std::mutex> lock(g_clientsMutex);
         auto it = g_connectedClients.find(toUser);
         if (it != g_connectedClients.end()) {
-            targetSocket = it->second;
+            target = it->second;
         }
     }
+    traceMark(TRACE_REGISTRY);
 
-    if (targetSocket != INVALID_SOCKET) {
-        sendResponse(targetSocket, fullMessage); // USAR NUEVO HELPER
-        cout << "[LoquiServer] Enviando " << fullMessage << " a " << toUser << std::endl;
-    } else {
-        cout << "[LoquiServer] Usuario " << toUser << " no conectado. Mensaje guardado." << std::endl;
-        // Opcional: enviar un "RESP|ERROR|Usuario no conectado" al remitente
-    }
+    if (!target) return false;
+
+    // Formato: "MSG|timestamp|fromUser|chatMessage"
+    string fullMessage = "MSG|" + timestamp + "|" + userName(fromUser) + "|" + chatMessage;
+    sendEvent(*target, fullMessage);
+    traceMark(TRACE_SEND);
+    cout << "[LoquiServer] Enviando " << fullMessage << " a " << userName(toUser) << std::endl;
+    return true;
 }
 
 // Función auxiliar para dividir strings
@@ -312,42 +1486,53 @@ string generateSalt(int length) {
     return salt;
 }
 
-// Guarda un nuevo usuario en el archivo CSV (modo append)
-void saveUser(const string& username, const UserData& data) {
-    // No necesitamos mutex aquí si solo la llamamos desde
-    // 'handleClient' DENTRO de un 'lock' existente.
-    ofstream file(USER_FILE, std::ios::app); // app = append
-    if (file.is_open()) {
-        file << username << "," << data.salt << "," << data.hash << "\n";
-        file.close();
-    } else {
-        cerr << "[LoquiServer] ERROR: No se pudo abrir " << USER_FILE << " para escritura." << std::endl;
+// Guarda un nuevo usuario en el log de usuarios
+void saveUser(const string& username, const UserData& data, UserId id) {
+    // No necesitamos g_userStoreMutex aquí si solo la llamamos desde
+    // 'handleClient' DENTRO de un 'lock' existente; el log tiene su propio mutex.
+    if (appendLog(g_userLog, encodeUser(username, data, id)) < 0) {
+        cerr << "[LoquiServer] ERROR: No se pudo escribir en " << g_userLog.path << "." << std::endl;
     }
 }
 
-// Carga todos los usuarios desde el archivo CSV al inicio
-void loadUsers() {
-    ifstream file(USER_FILE);
-    if (!file.is_open()) {
-        cout << "[LoquiServer] No se encontro " << USER_FILE << ". Se creara uno nuevo al primer registro." << std::endl;
-        return;
+// Da de alta (o actualiza) un usuario en memoria y devuelve su id. 'id' viene
+// del log; NO_USER asigna el siguiente, que es lo que recibieron los registros
+// antiguos sin id al leerse en orden. Se llama con g_userStoreMutex tomado.
+UserId storeUser(const string& username, const UserData& data, UserId id) {
+    unique_lock<shared_mutex> lock(g_symbolsMutex);
+    auto it = g_userIds.find(username);
+    if (it != g_userIds.end()) {
+        id = it->second;
+    } else {
+        if (id == NO_USER || (id < g_userNames.size() && !g_userNames[id].empty())) id = (UserId)g_userNames.size();
+        if (id >= g_userNames.size()) g_userNames.resize(id + 1);
+        g_userNames[id] = username;
+        g_userIds[username] = id;
     }
+    lock.unlock();
 
-    string line;
-    int count = 0;
-
-    lock_guard<::mutex> lock(g_userStoreMutex);
-    while (std::getline(file, line)) {
-        std::vector<std::string> parts = split(line, ',');
-        if (parts.size() == 3) {
-            // Formato: username,salt,hash
-            g_userStore[parts[0]] = {parts[1], parts[2]};
-            count++;
-        }
-    }
+    if (id >= g_userStore.size()) g_userStore.resize(id + 1);
+    g_userStore[id] = data;
+    return id;
+}
 
-    file.close();
-    cout << "[LoquiServer] Cargados " << count << " usuarios desde " << USER_FILE << "." << endl;
+// Vacía usuarios y tabla de símbolos (reconstrucción). Con g_userStoreMutex tomado.
+void clearUsers() {
+    unique_lock<shared_mutex> lock(g_symbolsMutex);
+    g_userNames.assign(1, "");
+    g_userIds.clear();
+    g_userStore.assign(1, UserData());
+}
+
+UserId findUserId(const string& username) {
+    shared_lock<shared_mutex> lock(g_symbolsMutex);
+    auto it = g_userIds.find(username);
+    return it == g_userIds.end() ? NO_USER : it->second;
+}
+
+string userName(UserId id) {
+    shared_lock<shared_mutex> lock(g_symbolsMutex);
+    return id < g_userNames.size() ? g_userNames[id] : string();
 }
 
 // NUEVA: Genera una marca de tiempo en formato YYYY-MM-DD HH:MM:SS
@@ -373,88 +1558,3010 @@ string getCurrentTimestamp() {
     return ss.str();
 }
 
-// NUEVA: Guarda un mensaje en el archivo de historial
-// Formato: timestamp,sender,receiver,"message"
-void saveMessage(const std::string& sender, const std::string& receiver, const std::string& timestamp, const std::string& message) {
-    // Nota: Aunque el servidor es multithread, ofstream/fstream manejan
-    // la exclusión mutua a nivel de sistema operativo para writes a archivos.
-    // Usaremos un mutex simple para ser más explícitos si fuera necesario,
-    // pero para este simple append es generalmente seguro.
-    ofstream file(HISTORY_FILE, std::ios::app);
-    if (file.is_open()) {
-        // Encerramos el mensaje en comillas dobles para que los delimitadores internos (',') no rompan el CSV
-        file << timestamp << "," << sender << "," << receiver << ",\"" << message << "\"\n";
-        file.close();
-    } else {
-        cerr << "[LoquiServer] ERROR: No se pudo abrir " << HISTORY_FILE << " para escritura." << std::endl;
+// NUEVA: Guarda un mensaje en el log de historial
+void saveMessage(UserId sender, UserId receiver, const std::string& timestamp, const std::string& message) {
+    saveMessages({{timestamp, sender, receiver, message}});
+}
+
+// Guarda varios mensajes con un único append al log. Los mensajes entran en la
+// caché de conversaciones dentro del append, en el orden del log.
+void saveMessages(const vector<StoredMessage>& messages) {
+    vector<string> payloads;
+    for (const StoredMessage& msg : messages) payloads.push_back(encodeMessage(msg));
+    // Contamos los escritores en cola sobre el mutex del log: esa profundidad
+    // es la señal de saturación de persistencia que usa admitRequest.
+    g_persistQueueDepth++;
+    long long offset = appendLog(g_historyLog, payloads, [&](long long first) {
+        lock_guard<mutex> indexLock(g_historyIndexMutex);
+        for (size_t i = 0; i < messages.size(); ++i) {
+            g_historyIndex[conversationKey(messages[i].sender, messages[i].receiver)].push_back(first);
+            hotCacheAppend(messages[i], first);
+            // Dentro del append: un checkpoint ve los permisos de lo que cubre
+            noteAttachmentMessage(messages[i]);
+            first += payloads[i].size() + 8; // Cabecera del registro: longitud + CRC
+        }
+    });
+    if (offset < 0) {
+        cerr << "[LoquiServer] ERROR: No se pudo escribir en " << g_historyLog.path << "." << std::endl;
     }
+    g_persistQueueDepth--;
 }
 
-// NUEVA: Envía el historial de mensajes entre dos usuarios al cliente
-void sendHistoryToClient(SOCKET clientSocket, const std::string& currentUser, const std::string& otherUser) {
-    ifstream file(HISTORY_FILE);
-    if (!file.is_open()) {
-        std::string resp = "RESP|OK|No hay historial de mensajes.";
-        sendResponse(clientSocket, resp); // USAR NUEVO HELPER
-        return;
+// Mensajes de una conversación leídos del log desde 'from' hasta 'end'
+// (solo los registros que apunta el índice)
+void scanConversation(uint64_t conversation, long long from, long long end, vector<CachedMessage>& out) {
+    vector<long long> offsets;
+    {
+        lock_guard<mutex> lock(g_historyIndexMutex);
+        auto it = g_historyIndex.find(conversation);
+        if (it == g_historyIndex.end()) return;
+        auto first = lower_bound(it->second.begin(), it->second.end(), from);
+        auto last = lower_bound(first, it->second.end(), end);
+        offsets.assign(first, last);
     }
 
-    string historyResponse = "HISTORY_RESP|" + otherUser; // HISTORY_RESP|otherUser|
-    string line;
-    int count = 0;
+    ifstream file(g_historyFile, std::ios::binary);
+    if (!file.is_open()) return;
+    string payload;
+    StoredMessage msg;
+    for (long long offset : offsets) {
+        file.seekg(offset);
+        if (!readRecord(file, payload)) break;
+        if (decodeMessage(payload, msg)) out.push_back({offset, msg.timestamp, msg.sender, msg.text});
+    }
+}
 
-    while (getline(file, line)) {
-        // El formato es: timestamp,sender,receiver,"message"
-        // Como el mensaje puede contener comas, usamos una lógica simple
-        // para extraer las primeras 3 partes y el resto como mensaje.
-
-        stringstream ss(line);
-        string part;
-        vector<string> parts;
-
-        // Extraer timestamp
-        if (getline(ss, part, ',')) parts.push_back(part);
-        // Extraer sender
-        if (getline(ss, part, ',')) parts.push_back(part);
-        // Extraer receiver
-        if (getline(ss, part, ',')) parts.push_back(part);
-
-        // El resto de la línea es el mensaje (que empieza con una comilla doble)
-        string messageContent;
-        if (getline(ss, messageContent)) {
-            // Eliminar las comillas dobles si existen
-            if (!messageContent.empty() && messageContent.front() == '"' && messageContent.back() == '"') {
-                 messageContent = messageContent.substr(1, messageContent.length() - 2);
-            }
-            parts.push_back(messageContent);
-        }
-
-        if (parts.size() == 4) {
-            string timestamp = parts[0];
-            string sender = parts[1];
-            string receiver = parts[2];
-            string message = parts[3];
-
-            // Revisar si la conversación es entre currentUser y otherUser (en ambos sentidos)
-            bool isRelevant = (sender == currentUser && receiver == otherUser) ||
-                              (sender == otherUser && receiver == currentUser);
-
-            if (isRelevant) {
-                // Formato de respuesta: HISTORY_RESP|otherUser|timestamp|sender|message
-                historyResponse += "|" + timestamp + "|" + sender + "|" + message;
-                count++;
-            }
+// NUEVA: Envía el historial de mensajes entre dos usuarios al cliente
+void sendHistoryToClient(Connection& conn, UserId currentUser, UserId otherUser) {
+    string currentName = userName(currentUser), otherName = userName(otherUser);
+    uint64_t conversation = conversationKey(currentUser, otherUser);
+
+    vector<CachedMessage> messages;
+    bool reset;
+    if (!hotCacheRead(conversation, -1, messages, reset)) {
+        // Solo leemos hasta el final confirmado del log (no una escritura a medias)
+        long long end;
+        {
+            lock_guard<mutex> lock(g_historyLog.mtx);
+            end = g_historyLog.size;
         }
+        scanConversation(conversation, 0, end, messages);
+        hotCacheFill(conversation, messages, end);
     }
 
-    file.close();
+    // Formato de respuesta: HISTORY_RESP|otherUser|timestamp|sender|message...
+    string historyResponse = "HISTORY_RESP|" + otherName;
+    for (const CachedMessage& msg : messages) {
+        historyResponse += "|" + msg.timestamp + "|" + (msg.sender == currentUser ? currentName : otherName) + "|" + msg.text;
+    }
 
-    if (count > 0) {
-        sendResponse(clientSocket, historyResponse); // USAR NUEVO HELPER
+    if (!messages.empty()) {
+        sendResponse(conn, historyResponse); // USAR NUEVO HELPER
     } else {
-        string resp = "RESP|OK|No hay historial de mensajes con " + otherUser + ".";
-        sendResponse(clientSocket, resp); // USAR NUEVO HELPER
+        string resp = "RESP|OK|No hay historial de mensajes con " + otherName + ".";
+        sendResponse(conn, resp); // USAR NUEVO HELPER
     }
 
-    cout << "[LoquiServer] Enviado historial con " << count << " mensajes para " << currentUser << " con " << otherUser << "." << std::endl;
+    cout << "[LoquiServer] Enviado historial con " << messages.size() << " mensajes para " << currentName << " con " << otherName << "." << std::endl;
+}
+
+// Envía solo los mensajes posteriores a 'sinceId' (el id de un mensaje es su
+// offset en el log, así que basta con saltar a él en vez de releer todo).
+// Formato: HISTORY_DELTA|otherUser|ultimoId|reset|timestamp|sender|message...
+// reset=1 indica que 'sinceId' no era válido y se envía la conversación completa.
+void sendHistoryDelta(Connection& conn, UserId currentUser, UserId otherUser, long long sinceId) {
+    string currentName = userName(currentUser), otherName = userName(otherUser);
+    uint64_t conversation = conversationKey(currentUser, otherUser);
+
+    vector<CachedMessage> messages;
+    bool reset = false;
+    if (!hotCacheRead(conversation, sinceId, messages, reset)) {
+        long long end;
+        {
+            lock_guard<mutex> lock(g_historyLog.mtx);
+            end = g_historyLog.size;
+        }
+
+        reset = true;
+        if (sinceId >= 0 && sinceId < end) {
+            // El registro en sinceId debe existir y pertenecer a esta conversación
+            ifstream file(g_historyFile, std::ios::binary);
+            string payload;
+            StoredMessage msg;
+            file.seekg(sinceId);
+            reset = !(readRecord(file, payload) && decodeMessage(payload, msg) &&
+                      conversationKey(msg.sender, msg.receiver) == conversation);
+            if (!reset) scanConversation(conversation, (long long)file.tellg(), end, messages);
+        }
+        if (reset) {
+            scanConversation(conversation, 0, end, messages);
+            hotCacheFill(conversation, messages, end);
+        }
+    }
+
+    string entries;
+    for (const CachedMessage& msg : messages) {
+        entries += "|" + msg.timestamp + "|" + (msg.sender == currentUser ? currentName : otherName) + "|" + msg.text;
+    }
+    long long lastId = !messages.empty() ? messages.back().id : (reset ? -1 : sinceId);
+    sendResponse(conn, "HISTORY_DELTA|" + otherName + "|" + to_string(lastId) + "|" + (reset ? "1" : "0") + entries);
+    cout << "[LoquiServer] Enviados " << messages.size() << " mensajes nuevos para " << currentName << " con " << otherName << "." << std::endl;
+}
+
+// Carga la configuración clave=valor (líneas vacías y '#' se ignoran)
+void loadConfig() {
+    ifstream file(g_configFile);
+    if (!file.is_open()) {
+        cout << "[LoquiServer] No se encontro " << g_configFile << ". Usando valores por defecto." << std::endl;
+        return;
+    }
+
+    string line;
+    while (getline(file, line)) {
+        if (!line.empty() && line.back() == '\r') line.pop_back();
+        if (line.empty() || line[0] == '#') continue;
+        size_t eq = line.find('=');
+        if (eq == string::npos) continue;
+        string key = line.substr(0, eq);
+        string value = line.substr(eq + 1);
+        // Quitar espacios alrededor de clave y valor
+        key.erase(0, key.find_first_not_of(" \t"));
+        key.erase(key.find_last_not_of(" \t") + 1);
+        value.erase(0, value.find_first_not_of(" \t"));
+        value.erase(value.find_last_not_of(" \t") + 1);
+        g_config[key] = value;
+    }
+    cout << "[LoquiServer] Cargadas " << g_config.size() << " opciones desde " << g_configFile << "." << endl;
+}
+
+string configString(const std::string& key, const std::string& def) {
+    auto it = g_config.find(key);
+    return it != g_config.end() ? it->second : def;
+}
+
+int configInt(const std::string& key, int def) {
+    auto it = g_config.find(key);
+    if (it == g_config.end()) return def;
+    try {
+        return stoi(it->second);
+    } catch (...) {
+        cerr << "[LoquiServer] Valor invalido para " << key << ": " << it->second << std::endl;
+        return def;
+    }
+}
+
+// Lee los límites por clase: rate.<clase>.conn = tasa/rafaga, rate.<clase>.user = tasa/rafaga
+void loadRateLimits() {
+    for (int c = 0; c < CLASS_COUNT; ++c) {
+        RateLimit* targets[2] = {&g_connLimits[c], &g_userLimits[c]};
+        const char* scopes[2] = {"conn", "user"};
+        for (int i = 0; i < 2; ++i) {
+            string value = configString(string("rate.") + CLASS_NAMES[c] + "." + scopes[i], "");
+            if (value.empty()) continue;
+            vector<string> parts = split(value, '/');
+            try {
+                targets[i]->ratePerSec = stod(parts.at(0));
+                targets[i]->burst = parts.size() > 1 ? stod(parts[1]) : targets[i]->ratePerSec;
+            } catch (...) {
+                cerr << "[LoquiServer] Limite invalido para rate." << CLASS_NAMES[c] << "." << scopes[i] << std::endl;
+            }
+        }
+    }
+    g_maxHeavyInFlight = configInt("admission.max_heavy_inflight", g_maxHeavyInFlight);
+    g_persistSoftLimit = configInt("admission.persist_soft", g_persistSoftLimit);
+    g_persistHardLimit = configInt("admission.persist_hard", g_persistHardLimit);
+    g_cpuHighPercent = configInt("admission.cpu_high", g_cpuHighPercent);
+}
+
+// Asigna cada comando a su clase de coste
+CommandClass classifyCommand(const std::string& cmd) {
+    if (cmd == "REGISTER" || cmd == "LOGIN" || cmd == "LOGIN_LOCAL") return CLASS_AUTH;
+    if (cmd == "MSG" || cmd == "FILE" || cmd == "MSGMULTI" || cmd == "MSGBATCH") return CLASS_MSG;
+    if (cmd == "HISTORY" || cmd == "DOWNLOAD" || cmd == "SNAPSHOT") return CLASS_HEAVY;
+    if (cmd == "UPLOAD_BEGIN" || cmd == "UPLOAD_CHUNK") return CLASS_BULK;
+    return CLASS_LIGHT;
+}
+
+long long TokenBucket::tryConsume(const RateLimit& limit, double cost) {
+    if (limit.ratePerSec <= 0) return 0; // Sin límite para esta clase
+
+    auto now = chrono::steady_clock::now();
+    if (tokens < 0) {
+        tokens = limit.burst;
+    } else {
+        double elapsed = chrono::duration<double>(now - last).count();
+        tokens = min(limit.burst, tokens + elapsed * limit.ratePerSec);
+    }
+    last = now;
+
+    cost = min(cost, limit.burst); // Un envío múltiple mayor que la ráfaga espera a tener el cubo lleno
+    if (tokens >= cost) {
+        tokens -= cost;
+        return 0;
+    }
+    return (long long)ceil((cost - tokens) / limit.ratePerSec * 1000.0);
+}
+
+// Consume un token del cubo de la conexión y, si hay sesión, del usuario.
+// Devuelve 0 si se permite, o los ms hasta el siguiente token.
+long long checkRateLimit(CommandClass cls, TokenBucket connBuckets[], UserId user, double cost) {
+    long long wait = connBuckets[cls].tryConsume(g_connLimits[cls], cost);
+    if (wait > 0 || user == NO_USER) return wait;
+
+    lock_guard<mutex> lock(g_userBucketsMutex);
+    return g_userBuckets[user].buckets[cls].tryConsume(g_userLimits[cls], cost);
+}
+
+// Tokens que consume un comando: los envíos múltiples cuentan un MSG por
+// destinatario, con la misma lista (sin vacíos ni repetidos) que luego se envía
+double commandCost(const std::string& cmd, const vector<std::string>& parts, const std::string& payload) {
+    if (cmd == "MSGMULTI" && parts.size() >= 2) {
+        return (double)max<size_t>(1, recipientList(parts[1]).size());
+    }
+    if (cmd == "MSGBATCH") {
+        double cost = 0;
+        for (const string& line : split(payload, '\n')) {
+            size_t bar = line.find('|');
+            if (bar != string::npos) cost += recipientList(line.substr(0, bar)).size();
+        }
+        return max(1.0, cost);
+    }
+    return 1;
+}
+
+// "dest1,dest2,..." -> destinatarios en orden, sin vacíos ni repetidos
+vector<string> recipientList(const std::string& field) {
+    vector<string> recipients;
+    set<string> seen;
+    for (const string& toUser : split(field, ',')) {
+        if (!toUser.empty() && seen.insert(toUser).second) recipients.push_back(toUser);
+    }
+    return recipients;
+}
+
+// Control de admisión global: bajo saturación se descartan primero las
+// peticiones caras (HISTORY) y solo en saturación severa los MSG.
+long long admitRequest(CommandClass cls) {
+    int persistDepth = g_persistQueueDepth.load();
+    if (cls == CLASS_HEAVY) {
+        if (g_heavyInFlight.load() >= g_maxHeavyInFlight ||
+            persistDepth >= g_persistSoftLimit ||
+            g_cpuLoadPercent.load() >= g_cpuHighPercent) {
+            return 1000;
+        }
+    } else if (cls == CLASS_MSG) {
+        if (persistDepth >= g_persistHardLimit) return 200;
+    }
+    return 0;
+}
+
+// Hilo que muestrea el uso de CPU del sistema cada segundo
+void cpuMonitor() {
+    auto toU64 = [](const FILETIME& ft) {
+        return ((unsigned long long)ft.dwHighDateTime << 32) | ft.dwLowDateTime;
+    };
+    FILETIME idle, kernel, user;
+    GetSystemTimes(&idle, &kernel, &user);
+    unsigned long long lastIdle = toU64(idle), lastTotal = toU64(kernel) + toU64(user);
+
+    while (true) {
+        this_thread::sleep_for(chrono::seconds(1));
+        if (!GetSystemTimes(&idle, &kernel, &user)) continue;
+        // El tiempo de kernel incluye el tiempo ocioso
+        unsigned long long nowIdle = toU64(idle), nowTotal = toU64(kernel) + toU64(user);
+        unsigned long long total = nowTotal - lastTotal;
+        if (total > 0) {
+            g_cpuLoadPercent = (int)(100 - (nowIdle - lastIdle) * 100 / total);
+        }
+        lastIdle = nowIdle;
+        lastTotal = nowTotal;
+    }
+}
+
+// Envía todo el buffer aunque send() escriba parcialmente
+bool sendAll(SOCKET sock, const std::string& data) {
+    size_t sent = 0;
+    while (sent < data.size()) {
+        int n = send(sock, data.c_str() + sent, (int)(data.size() - sent), 0);
+        if (n == SOCKET_ERROR || n == 0) return false;
+        sent += n;
+    }
+    return true;
+}
+
+// Lee una línea terminada en '\n'; 'pending' conserva lo recibido de más
+bool recvLine(SOCKET sock, std::string& pending, std::string& line) {
+    char buf[4096];
+    size_t pos;
+    while ((pos = pending.find('\n')) == string::npos) {
+        int n = recv(sock, buf, sizeof(buf), 0);
+        if (n <= 0) return false;
+        pending.append(buf, n);
+    }
+    line = pending.substr(0, pos);
+    pending.erase(0, pos + 1);
+    return true;
+}
+
+// cluster.node_id = nodo1
+// cluster.port = 13345
+// cluster.peers = nodo2@127.0.0.1:13346,nodo3@127.0.0.1:13347
+void loadClusterConfig() {
+    g_nodeId = configString("cluster.node_id", "");
+    if (g_nodeId.empty()) return;
+    g_clusterSecret = configString("cluster.secret", "");
+    if (g_clusterSecret.empty()) {
+        // Sin clave cualquiera podría hacerse pasar por un nodo: no hay clúster
+        cerr << "[LoquiServer] cluster.node_id necesita cluster.secret; el nodo funciona solo." << std::endl;
+        g_nodeId.clear();
+        return;
+    }
+    g_clusterPort = configInt("cluster.port", 0);
+
+    for (const string& entry : split(configString("cluster.peers", ""), ',')) {
+        size_t at = entry.find('@');
+        size_t colon = entry.rfind(':');
+        if (at == string::npos || colon == string::npos || colon < at) {
+            if (!entry.empty()) cerr << "[LoquiServer] Par de cluster invalido: " << entry << std::endl;
+            continue;
+        }
+        auto peer = make_unique<PeerLink>();
+        peer->nodeId = entry.substr(0, at);
+        peer->host = entry.substr(at + 1, colon - at - 1);
+        peer->port = atoi(entry.c_str() + colon + 1);
+        g_peers.push_back(move(peer));
+    }
+}
+
+void startCluster() {
+    if (g_nodeId.empty()) return;
+    thread(clusterListener).detach();
+    // Enlaces entrantes heredados en un relevo: siguen leyendo donde estaban
+    for (ParkedSession& parked : g_inheritedPeers) {
+        g_activeSessions++;
+        thread(resumePeer, parked.sock, move(parked.state)).detach();
+    }
+    g_inheritedPeers.clear();
+    for (auto& peer : g_peers) {
+        thread(peerSender, peer.get()).detach();
+    }
+    cout << "[LoquiServer] Nodo " << g_nodeId << " en cluster con " << g_peers.size() << " pares." << std::endl;
+}
+
+// Encola una línea para todos los pares; los hilos peerSender la envían por lotes
+void broadcastToPeers(const std::string& line) {
+    broadcastToPeers(vector<string>{line});
+}
+
+// Varias líneas tomando el mutex de cada par una sola vez
+void broadcastToPeers(const vector<std::string>& lines) {
+    for (auto& peer : g_peers) {
+        {
+            lock_guard<mutex> lock(peer->mtx);
+            for (const string& line : lines) {
+                if (peer->outbox.size() >= PEER_OUTBOX_LIMIT) peer->outbox.pop_front();
+                peer->outbox.push_back(line);
+            }
+        }
+        peer->cv.notify_one();
+    }
+}
+
+// Hilo por par: mantiene la conexión saliente y vacía la cola en un solo send por lote
+void peerSender(PeerLink* peer) {
+    while (true) {
+        SOCKET sock = INVALID_SOCKET;
+        addrinfo hints = {}, *result = nullptr;
+        hints.ai_family = AF_INET;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_protocol = IPPROTO_TCP;
+        if (getaddrinfo(peer->host.c_str(), to_string(peer->port).c_str(), &hints, &result) == 0) {
+            sock = socket(result->ai_family, result->ai_socktype, result->ai_protocol);
+            if (sock != INVALID_SOCKET && connect(sock, result->ai_addr, (int)result->ai_addrlen) == SOCKET_ERROR) {
+                closesocket(sock);
+                sock = INVALID_SOCKET;
+            }
+            freeaddrinfo(result);
+        }
+        if (sock == INVALID_SOCKET) {
+            this_thread::sleep_for(chrono::seconds(2));
+            continue;
+        }
+        if (!authenticatePeerLink(sock, *peer)) {
+            cerr << "[LoquiServer] El nodo " << peer->nodeId << " no se autentico. Reintentando..." << std::endl;
+            closesocket(sock);
+            this_thread::sleep_for(chrono::seconds(2));
+            continue;
+        }
+        cout << "[LoquiServer] Enlace con nodo " << peer->nodeId << " establecido." << std::endl;
+
+        // Instantánea de nuestras sesiones, por delante de lo ya encolado
+        {
+            lock_guard<mutex> clientsLock(g_clientsMutex);
+            lock_guard<mutex> lock(peer->mtx);
+            for (auto it = g_connectedClients.rbegin(); it != g_connectedClients.rend(); ++it) {
+                peer->outbox.push_front("DIR|ON|" + userName(it->first));
+            }
+        }
+
+        while (true) {
+            deque<string> batch;
+            {
+                unique_lock<mutex> lock(peer->mtx);
+                // Sin tráfico se manda PING cada 5 s para detectar enlaces caídos
+                if (!peer->cv.wait_for(lock, chrono::seconds(5), [&] { return !peer->outbox.empty(); })) {
+                    peer->outbox.push_back("PING");
+                }
+                // En un relevo la cola se queda entera para el proceso nuevo; la
+                // reserva va antes de mirar la bandera (como en acceptClient)
+                g_peerSends++;
+                if (g_handoffRequested) {
+                    g_peerSends--;
+                    lock.unlock();
+                    this_thread::sleep_for(chrono::milliseconds(HANDOFF_POLL_MS));
+                    continue;
+                }
+                batch.swap(peer->outbox);
+            }
+
+            string data;
+            for (const string& line : batch) data += line + "\n";
+            bool sent = sendAll(sock, data);
+            g_peerSends--;
+            if (!sent) {
+                // Devolver el lote a la cola; se reenviará tras reconectar (al menos una vez)
+                lock_guard<mutex> lock(peer->mtx);
+                while (!batch.empty()) {
+                    if (batch.back() != "PING" && batch.back().rfind("DIR|", 0) != 0 && batch.back().rfind("NODE|", 0) != 0) {
+                        peer->outbox.push_front(batch.back());
+                    }
+                    batch.pop_back();
+                }
+                break;
+            }
+        }
+
+        cout << "[LoquiServer] Enlace con nodo " << peer->nodeId << " perdido. Reintentando..." << std::endl;
+        closesocket(sock);
+    }
+}
+
+// Saludo del enlace saliente (el entrante lo lleva handlePeer):
+//   par:   CHALLENGE|<nonce par>
+//   nodo:  NODE|<id>|<nonce nodo>|HMAC("NODE|<id>|<nonce par>|<nonce nodo>")
+//   par:   NODE_OK|HMAC("NODE_OK|<nonce nodo>|<nonce par>")
+// Así cada extremo demuestra que conoce cluster.secret sin enviarla, y una
+// respuesta grabada no vale para otro saludo.
+bool authenticatePeerLink(SOCKET sock, const PeerLink& peer) {
+    DWORD timeoutMs = PEER_AUTH_TIMEOUT_MS;
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (const char*)&timeoutMs, sizeof(timeoutMs));
+    string pending, line;
+    if (!recvLine(sock, pending, line) || line.rfind("CHALLENGE|", 0) != 0) return false;
+    string peerNonce = line.substr(10);
+    string nonce = generateSalt(32);
+    string hello = "NODE|" + g_nodeId + "|" + nonce;
+    if (!sendAll(sock, hello + "|" + hmacSha256(g_clusterSecret, hello + "|" + peerNonce) + "\n")) return false;
+    if (!recvLine(sock, pending, line) || line.rfind("NODE_OK|", 0) != 0 ||
+        !sameDigest(line.substr(8), hmacSha256(g_clusterSecret, "NODE_OK|" + nonce + "|" + peerNonce))) {
+        return false;
+    }
+    timeoutMs = 0;
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (const char*)&timeoutMs, sizeof(timeoutMs));
+    return true;
+}
+
+// HMAC-SHA256 (RFC 2104) en hexadecimal
+string hmacSha256(const std::string& key, const std::string& message) {
+    const size_t BLOCK = 64;
+    string k = key;
+    if (k.size() > BLOCK) {
+        vector<unsigned char> digest(32);
+        picosha2::hash256(k.begin(), k.end(), digest);
+        k.assign(digest.begin(), digest.end());
+    }
+    k.resize(BLOCK, '\0');
+    string inner(BLOCK, '\0'), outer(BLOCK, '\0');
+    for (size_t i = 0; i < BLOCK; ++i) {
+        inner[i] = (char)(k[i] ^ 0x36);
+        outer[i] = (char)(k[i] ^ 0x5c);
+    }
+    inner += message;
+    vector<unsigned char> digest(32);
+    picosha2::hash256(inner.begin(), inner.end(), digest);
+    outer.append(digest.begin(), digest.end());
+    return picosha2::hash256_hex_string(outer);
+}
+
+// Comparación en tiempo constante (no dice cuántos caracteres coinciden)
+bool sameDigest(const std::string& a, const std::string& b) {
+    if (a.size() != b.size()) return false;
+    unsigned char diff = 0;
+    for (size_t i = 0; i < a.size(); ++i) diff |= (unsigned char)(a[i] ^ b[i]);
+    return diff == 0;
+}
+
+// Acepta los enlaces entrantes de los demás nodos
+void clusterListener() {
+    SOCKET listenSocket = takeListener("cluster");
+    if (listenSocket == INVALID_SOCKET) {
+        listenSocket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+        sockaddr_in addr;
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = INADDR_ANY;
+        addr.sin_port = htons(g_clusterPort);
+        if (listenSocket == INVALID_SOCKET ||
+            bind(listenSocket, (SOCKADDR*)&addr, sizeof(addr)) == SOCKET_ERROR ||
+            listen(listenSocket, SOMAXCONN) == SOCKET_ERROR) {
+            cerr << "[LoquiServer] No se pudo escuchar en el puerto de cluster " << g_clusterPort << ": " << WSAGetLastError() << std::endl;
+            return;
+        }
+    }
+    keepListener("cluster", listenSocket);
+
+    while (true) {
+        // Cuenta como una sesión: en un relevo deja de aceptar y el enlace se cede
+        SOCKET peerSocket = acceptClient(listenSocket);
+        if (peerSocket == INVALID_SOCKET) continue;
+        thread(handlePeer, peerSocket, string(), string()).detach();
+    }
+}
+
+// Procesa las líneas que llegan de otro nodo:
+//   NODE|id|nonce|hmac (saludo, ver authenticatePeerLink), DIR|ON|user,
+//   DIR|OFF|user, REG|user|salt|hash, MSG|ts|from|to|texto, PING
+// Un enlace heredado en un relevo llega con 'peerId' y 'pending' ya rellenos.
+// En un relevo se detiene entre dos líneas (nunca con un REG o MSG a medias).
+void handlePeer(SOCKET peerSocket, std::string peerId, std::string pending) {
+    string line, nonce;
+    char buf[4096];
+
+    if (peerId.empty()) {
+        // Enlace nuevo: nada se procesa hasta que el otro extremo se autentica
+        nonce = generateSalt(32);
+        DWORD timeoutMs = PEER_AUTH_TIMEOUT_MS;
+        setsockopt(peerSocket, SOL_SOCKET, SO_RCVTIMEO, (const char*)&timeoutMs, sizeof(timeoutMs));
+        if (!sendAll(peerSocket, "CHALLENGE|" + nonce + "\n")) {
+            closesocket(peerSocket);
+            g_activeSessions--;
+            return;
+        }
+    }
+
+    while (true) {
+        size_t end = pending.find('\n');
+        if (end == string::npos) {
+            if (!waitForInput(peerSocket)) {
+                if (peerId.empty()) break; // A medio saludo: el otro nodo reconecta con el proceso nuevo
+                parkPeer(peerSocket, peerId, pending); // El proceso nuevo sigue leyendo de este socket
+                return;
+            }
+            int n = recv(peerSocket, buf, sizeof(buf), 0);
+            if (n <= 0) break;
+            pending.append(buf, n);
+            continue;
+        }
+        line = pending.substr(0, end);
+        pending.erase(0, end + 1);
+        vector<string> parts = split(line, '|');
+        if (parts.empty()) continue;
+        const string& cmd = parts[0];
+
+        if (peerId.empty()) {
+            // El primer mensaje debe identificar al nodo con la clave del clúster
+            bool known = parts.size() == 4 && parts[0] == "NODE" &&
+                         any_of(g_peers.begin(), g_peers.end(), [&](const unique_ptr<PeerLink>& peer) { return peer->nodeId == parts[1]; });
+            string hello = known ? "NODE|" + parts[1] + "|" + parts[2] : "";
+            if (!known || !sameDigest(parts[3], hmacSha256(g_clusterSecret, hello + "|" + nonce))) {
+                cerr << "[LoquiServer] Enlace de cluster rechazado: nodo desconocido o clave incorrecta." << std::endl;
+                break;
+            }
+            if (!sendAll(peerSocket, "NODE_OK|" + hmacSha256(g_clusterSecret, "NODE_OK|" + parts[2] + "|" + nonce) + "\n")) break;
+            DWORD timeoutMs = 0;
+            setsockopt(peerSocket, SOL_SOCKET, SO_RCVTIMEO, (const char*)&timeoutMs, sizeof(timeoutMs));
+            peerId = parts[1];
+            cout << "[LoquiServer] Nodo " << peerId << " conectado al cluster." << std::endl;
+        } else if (cmd == "DIR" && parts.size() == 3) {
+            lock_guard<mutex> lock(g_remoteUsersMutex);
+            if (parts[1] == "ON") {
+                g_remoteUsers[parts[2]] = peerId;
+            } else if (g_remoteUsers.count(parts[2]) && g_remoteUsers[parts[2]] == peerId) {
+                g_remoteUsers.erase(parts[2]);
+            }
+        } else if (cmd == "REG" && parts.size() == 4) {
+            lock_guard<mutex> lock(g_userStoreMutex);
+            if (findUserId(parts[1]) == NO_USER) {
+                UserData data = {parts[2], parts[3]};
+                saveUser(parts[1], data, storeUser(parts[1], data));
+            } else {
+                cerr << "[LoquiServer] Registro duplicado de " << parts[1] << " desde " << peerId << " ignorado." << std::endl;
+            }
+        } else if (cmd == "MSG" && parts.size() >= 5) {
+            string chatMessage = parts[4];
+            for (size_t i = 5; i < parts.size(); ++i) chatMessage += "|" + parts[i];
+            UserId fromId = findUserId(parts[2]), toId = findUserId(parts[3]);
+            if (fromId == NO_USER || toId == NO_USER) {
+                cerr << "[LoquiServer] Mensaje de " << peerId << " con usuario desconocido (" << parts[2] << " -> " << parts[3] << ") ignorado." << std::endl;
+                continue;
+            }
+            saveMessage(fromId, toId, parts[1], chatMessage);
+            deliverLocal(fromId, toId, parts[1], chatMessage);
+        }
+    }
+
+    // El nodo se fue: sus sesiones dejan de estar en el directorio
+    if (!peerId.empty()) {
+        lock_guard<mutex> lock(g_remoteUsersMutex);
+        for (auto it = g_remoteUsers.begin(); it != g_remoteUsers.end();) {
+            if (it->second == peerId) it = g_remoteUsers.erase(it);
+            else ++it;
+        }
+        cout << "[LoquiServer] Nodo " << peerId << " desconectado del cluster." << std::endl;
+    }
+    closesocket(peerSocket);
+    g_activeSessions--;
+}
+
+// Lee exactamente 'count' bytes (usando primero lo que quede en 'pending')
+bool recvExact(SOCKET sock, std::string& pending, size_t count, std::string& out) {
+    char buf[4096];
+    while (pending.size() < count) {
+        int n = recv(sock, buf, sizeof(buf), 0);
+        if (n <= 0) return false;
+        pending.append(buf, n);
+    }
+    out = pending.substr(0, count);
+    pending.erase(0, count);
+    return true;
+}
+
+long long fileSize(const std::string& path) {
+    ifstream file(path, std::ios::binary | std::ios::ate);
+    return file.is_open() ? (long long)file.tellg() : 0;
+}
+
+long long nowMs() {
+    using namespace chrono;
+    return duration_cast<milliseconds>(system_clock::now().time_since_epoch()).count();
+}
+
+// Despierta a los hilos handleFollower tras un append
+void notifyReplication() {
+    if (g_replPort > 0) g_replCv.notify_all();
+}
+
+// Acepta seguidores en replication.port
+void replicationListener() {
+    SOCKET listenSocket = takeListener("replication");
+    if (listenSocket == INVALID_SOCKET) {
+        listenSocket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+        sockaddr_in addr = {};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(g_replPort);
+        if (inet_pton(AF_INET, g_replBind.c_str(), &addr.sin_addr) != 1) {
+            cerr << "[LoquiServer] replication.bind invalida: " << g_replBind << std::endl;
+            if (listenSocket != INVALID_SOCKET) closesocket(listenSocket);
+            return;
+        }
+        if (listenSocket == INVALID_SOCKET ||
+            bind(listenSocket, (SOCKADDR*)&addr, sizeof(addr)) == SOCKET_ERROR ||
+            listen(listenSocket, SOMAXCONN) == SOCKET_ERROR) {
+            cerr << "[LoquiServer] No se pudo escuchar en el puerto de replicacion " << g_replPort << ": " << WSAGetLastError() << std::endl;
+            return;
+        }
+    }
+    keepListener("replication", listenSocket);
+    cout << "[LoquiServer] Replicacion disponible en " << g_replBind << ":" << g_replPort << "." << std::endl;
+
+    while (true) {
+        SOCKET followerSocket = accept(listenSocket, NULL, NULL);
+        if (followerSocket == INVALID_SOCKET) continue;
+        thread(handleFollower, followerSocket).detach();
+    }
+}
+
+// Protocolo de replicación (primario -> seguidor):
+//   primario: CHALLENGE|<nonce primario>
+//   seguidor: REPL|<bytes users>|<bytes history>|<nonce seguidor>|HMAC(línea sin el HMAC + "|<nonce primario>")
+//   primario: REPL_OK|HMAC("REPL_OK|<nonce seguidor>|<nonce primario>")
+//   primario: DATA|<users|history>|<offset>|<len>\n<len bytes>   (bytes añadidos)
+//             POS|<tamaño users>|<tamaño history>                (latido, al menos 1/s)
+// El HMAC usa replication.secret: los dos extremos prueban que la conocen.
+void handleFollower(SOCKET followerSocket) {
+    string pending, line;
+    long long offsets[REPL_FILE_COUNT] = {0, 0};
+    const string* paths[REPL_FILE_COUNT] = {&g_userFile, &g_historyFile};
+
+    string nonce = generateSalt(32);
+    DWORD timeoutMs = PEER_AUTH_TIMEOUT_MS;
+    setsockopt(followerSocket, SOL_SOCKET, SO_RCVTIMEO, (const char*)&timeoutMs, sizeof(timeoutMs));
+    if (!sendAll(followerSocket, "CHALLENGE|" + nonce + "\n") || !recvLine(followerSocket, pending, line)) {
+        closesocket(followerSocket);
+        return;
+    }
+    vector<string> parts = split(line, '|');
+    string request = parts.size() == 5 ? parts[0] + "|" + parts[1] + "|" + parts[2] + "|" + parts[3] : "";
+    if (parts.size() != 5 || parts[0] != "REPL" || !sameDigest(parts[4], hmacSha256(g_replSecret, request + "|" + nonce))) {
+        cerr << "[LoquiServer] Seguidor rechazado: clave de replicacion incorrecta." << std::endl;
+        sendAll(followerSocket, "ERROR|autenticacion\n");
+        closesocket(followerSocket);
+        return;
+    }
+    if (!sendAll(followerSocket, "REPL_OK|" + hmacSha256(g_replSecret, "REPL_OK|" + parts[3] + "|" + nonce) + "\n")) {
+        closesocket(followerSocket);
+        return;
+    }
+    offsets[REPL_USERS] = atoll(parts[1].c_str());
+    offsets[REPL_HISTORY] = atoll(parts[2].c_str());
+    g_replFollowers++;
+    cout << "[LoquiServer] Seguidor conectado desde offsets " << offsets[0] << "/" << offsets[1] << "." << std::endl;
+
+    bool ok = true;
+    while (ok) {
+        if (g_handoffRequested) {
+            // Relevo en curso: los logs se están cerrando; solo el latido con lo ya
+            // enviado. Al terminar el relevo el seguidor reconecta con el proceso nuevo.
+            ok = sendAll(followerSocket, "POS|" + to_string(offsets[REPL_USERS]) + "|" + to_string(offsets[REPL_HISTORY]) + "\n");
+            this_thread::sleep_for(chrono::seconds(1));
+            continue;
+        }
+        long long sizes[REPL_FILE_COUNT];
+        for (int i = 0; i < REPL_FILE_COUNT && ok; ++i) {
+            sizes[i] = fileSize(*paths[i]);
+            if (offsets[i] > sizes[i]) {
+                // El seguidor tiene datos que el primario no: no es un prefijo
+                sendAll(followerSocket, "ERROR|" + string(REPL_FILE_NAMES[i]) + " divergente\n");
+                ok = false;
+                break;
+            }
+            ifstream file(*paths[i], std::ios::binary);
+            file.seekg(offsets[i]);
+            while (ok && offsets[i] < sizes[i]) {
+                size_t len = (size_t)min<long long>(REPL_CHUNK, sizes[i] - offsets[i]);
+                string chunk(len, '\0');
+                file.read(&chunk[0], len);
+                chunk.resize(file.gcount());
+                if (chunk.empty()) break;
+                ok = sendAll(followerSocket, "DATA|" + string(REPL_FILE_NAMES[i]) + "|" + to_string(offsets[i]) +
+                                                 "|" + to_string(chunk.size()) + "\n" + chunk);
+                offsets[i] += chunk.size();
+            }
+        }
+        if (!ok) break;
+        ok = sendAll(followerSocket, "POS|" + to_string(sizes[REPL_USERS]) + "|" + to_string(sizes[REPL_HISTORY]) + "\n");
+
+        // Esperar al siguiente append (o al latido)
+        unique_lock<mutex> lock(g_replMutex);
+        g_replCv.wait_for(lock, chrono::seconds(1));
+    }
+
+    g_replFollowers--;
+    cout << "[LoquiServer] Seguidor desconectado." << std::endl;
+    closesocket(followerSocket);
+}
+
+// Modo seguidor: se reconecta al primario hasta que pasen
+// g_failoverTimeoutSec sin contacto, y entonces vuelve para promocionar.
+void runFollower() {
+    size_t colon = g_replPrimary.rfind(':');
+    string host = g_replPrimary.substr(0, colon);
+    string port = colon == string::npos ? "" : g_replPrimary.substr(colon + 1);
+
+    // Mientras seguimos, los logs se escriben con los bytes del primario
+    g_isFollower = true;
+    closeLog(g_userLog);
+    closeLog(g_historyLog);
+    g_replApplied[REPL_USERS] = fileSize(g_userFile);
+    g_replApplied[REPL_HISTORY] = fileSize(g_historyFile);
+    cout << "[LoquiServer] Modo seguidor de " << g_replPrimary << "." << std::endl;
+
+    // Un registro puede quedar a medias entre dos sesiones
+    string partials[REPL_FILE_COUNT];
+    long long lastContact = nowMs();
+    while (true) {
+        if (followPrimary(host, port, partials)) lastContact = nowMs();
+        if (g_failoverTimeoutSec > 0 && nowMs() - lastContact >= g_failoverTimeoutSec * 1000LL) break;
+        this_thread::sleep_for(chrono::seconds(1));
+    }
+
+    // Promoción: descartar el registro incompleto y checkpoint inmediato,
+    // así el próximo arranque no tiene que releer lo replicado
+    openLog(g_userLog, g_userFile, g_replApplied[REPL_USERS] - partials[REPL_USERS].size());
+    openLog(g_historyLog, g_historyFile, g_replApplied[REPL_HISTORY] - partials[REPL_HISTORY].size());
+    writeCheckpoint();
+    g_isFollower = false;
+}
+
+// Una sesión de replicación; devuelve true si llegó a recibir datos del primario
+bool followPrimary(const std::string& host, const std::string& port, std::string partials[]) {
+    // Un registro a medias de la sesión anterior se descarta del archivo y se
+    // pide de nuevo desde su principio: el primario puede haber truncado esa
+    // cola al reiniciar, y pedir desde la mitad de un registro lo corrompería
+    const string* paths[REPL_FILE_COUNT] = {&g_userFile, &g_historyFile};
+    for (int i = 0; i < REPL_FILE_COUNT; ++i) {
+        if (partials[i].empty()) continue;
+        long long boundary = g_replApplied[i] - (long long)partials[i].size();
+        error_code ec;
+        filesystem::resize_file(*paths[i], boundary, ec);
+        if (ec) {
+            cerr << "[LoquiServer] No se pudo truncar " << *paths[i] << ": " << ec.message() << std::endl;
+            return false;
+        }
+        g_replApplied[i] = boundary;
+        partials[i].clear();
+    }
+
+    addrinfo hints = {}, *result = nullptr;
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_protocol = IPPROTO_TCP;
+    if (getaddrinfo(host.c_str(), port.c_str(), &hints, &result) != 0) return false;
+    SOCKET sock = socket(result->ai_family, result->ai_socktype, result->ai_protocol);
+    if (sock != INVALID_SOCKET && connect(sock, result->ai_addr, (int)result->ai_addrlen) == SOCKET_ERROR) {
+        closesocket(sock);
+        sock = INVALID_SOCKET;
+    }
+    freeaddrinfo(result);
+    if (sock == INVALID_SOCKET) return false;
+
+    // Si el primario no manda ni un latido en este tiempo lo damos por caído
+    DWORD timeoutMs = 5000;
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (const char*)&timeoutMs, sizeof(timeoutMs));
+
+    // Saludo (ver handleFollower). Un primario que contesta está vivo aunque nos
+    // rechace: eso no cuenta para la promoción.
+    bool contacted = false;
+    string pending, line, data;
+    if (!recvLine(sock, pending, line) || line.rfind("CHALLENGE|", 0) != 0) {
+        closesocket(sock);
+        return false;
+    }
+    contacted = true;
+    string primaryNonce = line.substr(10);
+    string nonce = generateSalt(32);
+    string request = "REPL|" + to_string(g_replApplied[REPL_USERS].load()) + "|" + to_string(g_replApplied[REPL_HISTORY].load()) + "|" + nonce;
+    if (!sendAll(sock, request + "|" + hmacSha256(g_replSecret, request + "|" + primaryNonce) + "\n") ||
+        !recvLine(sock, pending, line) || line.rfind("REPL_OK|", 0) != 0 ||
+        !sameDigest(line.substr(8), hmacSha256(g_replSecret, "REPL_OK|" + nonce + "|" + primaryNonce))) {
+        cerr << "[LoquiServer] El primario no se autentico (replication.secret distinta?)." << std::endl;
+        closesocket(sock);
+        return contacted;
+    }
+
+    while (recvLine(sock, pending, line)) {
+        vector<string> parts = split(line, '|');
+        if (parts.empty()) continue;
+        contacted = true;
+
+        if (parts[0] == "DATA" && parts.size() == 4) {
+            int fileIndex = parts[1] == "users" ? REPL_USERS : REPL_HISTORY;
+            long long offset = atoll(parts[2].c_str());
+            size_t len = (size_t)atoll(parts[3].c_str());
+            if (!recvExact(sock, pending, len, data)) break;
+            if (offset != g_replApplied[fileIndex]) {
+                cerr << "[LoquiServer] Offset de replicacion inesperado en " << parts[1] << "." << std::endl;
+                break;
+            }
+            applyReplicated(fileIndex, data, partials[fileIndex]);
+        } else if (parts[0] == "POS" && parts.size() == 3) {
+            g_replPrimarySize[REPL_USERS] = atoll(parts[1].c_str());
+            g_replPrimarySize[REPL_HISTORY] = atoll(parts[2].c_str());
+            if (g_replApplied[REPL_USERS] >= g_replPrimarySize[REPL_USERS] &&
+                g_replApplied[REPL_HISTORY] >= g_replPrimarySize[REPL_HISTORY]) {
+                g_replCaughtUpMs = nowMs();
+            }
+        } else if (parts[0] == "ERROR") {
+            cerr << "[LoquiServer] El primario rechazo la replicacion: " << line << std::endl;
+            break;
+        }
+    }
+
+    closesocket(sock);
+    return contacted;
+}
+
+// Escribe los bytes replicados y carga en memoria los usuarios completos
+void applyReplicated(int fileIndex, const std::string& data, std::string& partial) {
+    const string& path = fileIndex == REPL_USERS ? g_userFile : g_historyFile;
+    ofstream file(path, std::ios::binary | std::ios::app);
+    file.write(data.data(), data.size());
+    file.close();
+    g_replApplied[fileIndex] += data.size();
+
+    // Recorrer los registros completos; 'partial' guarda el incompleto
+    partial += data;
+    long long base = g_replApplied[fileIndex] - partial.size(); // Offset de partial[0] en el archivo
+    istringstream in(partial);
+    string payload, username;
+    UserData userData;
+    UserId id;
+    StoredMessage msg;
+    size_t consumed = 0;
+    lock_guard<mutex> lock(g_userStoreMutex);
+    while (readRecord(in, payload)) {
+        if (fileIndex == REPL_USERS && decodeUser(payload, username, userData, id)) {
+            storeUser(username, userData, id);
+        } else if (fileIndex == REPL_HISTORY && decodeMessage(payload, msg)) {
+            {
+                lock_guard<mutex> indexLock(g_historyIndexMutex);
+                g_historyIndex[conversationKey(msg.sender, msg.receiver)].push_back(base + consumed);
+            }
+            noteAttachmentMessage(msg);
+        }
+        consumed = (size_t)in.tellg();
+    }
+    partial.erase(0, consumed);
+}
+
+// Endpoint HTTP mínimo con métricas en formato texto (compatible con Prometheus)
+void metricsServer() {
+    SOCKET listenSocket = takeListener("metrics");
+    if (listenSocket == INVALID_SOCKET) {
+        listenSocket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+        sockaddr_in addr;
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = INADDR_ANY;
+        addr.sin_port = htons(g_metricsPort);
+        if (listenSocket == INVALID_SOCKET ||
+            bind(listenSocket, (SOCKADDR*)&addr, sizeof(addr)) == SOCKET_ERROR ||
+            listen(listenSocket, SOMAXCONN) == SOCKET_ERROR) {
+            cerr << "[LoquiServer] No se pudo escuchar en el puerto de metricas " << g_metricsPort << ": " << WSAGetLastError() << std::endl;
+            return;
+        }
+    }
+    keepListener("metrics", listenSocket);
+
+    while (true) {
+        SOCKET sock = accept(listenSocket, NULL, NULL);
+        if (sock == INVALID_SOCKET) continue;
+        char buf[1024];
+        int n = recv(sock, buf, sizeof(buf), 0);
+        string request(buf, max(n, 0));
+        // GET /trace[?min_ms=N]: trazas de mensajes; cualquier otra ruta, métricas
+        string body, contentType = "text/plain";
+        if (request.rfind("GET /trace", 0) == 0) {
+            size_t minPos = request.find("min_ms=");
+            long long minMs = minPos != string::npos && minPos < request.find('\n') ? atoll(request.c_str() + minPos + 7) : 0;
+            body = renderTrace(minMs * 1000);
+            contentType = "application/json";
+        } else {
+            body = renderMetrics();
+        }
+        sendAll(sock, "HTTP/1.0 200 OK\r\nContent-Type: " + contentType + "\r\nContent-Length: " +
+                      to_string(body.size()) + "\r\n\r\n" + body);
+        closesocket(sock);
+    }
+}
+
+string renderMetrics() {
+    stringstream out;
+    {
+        lock_guard<mutex> lock(g_clientsMutex);
+        out << "loqui_connected_users " << g_connectedClients.size() << "\n";
+    }
+    out << "loqui_reaped_total " << g_reapedTotal.load() << "\n";
+    out << "loqui_throttled_total " << g_throttledTotal.load() << "\n";
+    out << "loqui_shed_total " << g_shedTotal.load() << "\n";
+    out << "loqui_cpu_load_percent " << g_cpuLoadPercent.load() << "\n";
+    out << "loqui_persist_queue_depth " << g_persistQueueDepth.load() << "\n";
+    {
+        lock_guard<mutex> lock(g_hotCacheMutex);
+        out << "loqui_history_cache_bytes " << g_hotCacheBytes << "\n";
+        out << "loqui_history_cache_conversations " << g_hotCache.size() << "\n";
+    }
+    long long hits = g_hotCacheHits.load(), misses = g_hotCacheMisses.load();
+    out << "loqui_history_cache_hits_total " << hits << "\n";
+    out << "loqui_history_cache_misses_total " << misses << "\n";
+    out << "loqui_history_cache_hit_ratio " << (hits + misses > 0 ? (double)hits / (hits + misses) : 0) << "\n";
+    out << "loqui_attachment_bytes_in_total " << g_attachmentBytesIn.load() << "\n";
+    out << "loqui_attachment_bytes_out_total " << g_attachmentBytesOut.load() << "\n";
+    out << "loqui_attachment_downloads_inflight " << g_downloadsInFlight.load() << "\n";
+    out << "loqui_compress_bytes_in_total " << g_compressBytesIn.load() << "\n";
+    out << "loqui_compress_bytes_out_total " << g_compressBytesOut.load() << "\n";
+    out << "loqui_snapshot_in_progress " << (g_snapshotRunning ? 1 : 0) << "\n";
+    out << "loqui_snapshots_total " << g_snapshotsTotal.load() << "\n";
+    out << "loqui_repl_follower " << (g_isFollower ? 1 : 0) << "\n";
+    out << "loqui_repl_followers_connected " << g_replFollowers.load() << "\n";
+    if (g_isFollower) {
+        long long lagBytes = 0;
+        for (int i = 0; i < REPL_FILE_COUNT; ++i) {
+            lagBytes += max(0LL, g_replPrimarySize[i].load() - g_replApplied[i].load());
+            out << "loqui_repl_applied_bytes{file=\"" << REPL_FILE_NAMES[i] << "\"} " << g_replApplied[i].load() << "\n";
+        }
+        long long caughtUp = g_replCaughtUpMs.load();
+        out << "loqui_repl_lag_bytes " << lagBytes << "\n";
+        out << "loqui_repl_lag_ms " << (caughtUp == 0 ? -1 : (lagBytes == 0 ? 0 : nowMs() - caughtUp)) << "\n";
+    }
+    return out.str();
+}
+
+// CRC32C (Castagnoli, polinomio reflejado 0x82F63B78), por tabla
+uint32_t crc32c(const char* data, size_t len) {
+    static uint32_t table[256];
+    static once_flag tableOnce;
+    call_once(tableOnce, [] {
+        for (uint32_t i = 0; i < 256; ++i) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; ++k) c = (c & 1) ? (c >> 1) ^ 0x82F63B78u : c >> 1;
+            table[i] = c;
+        }
+    });
+
+    uint32_t crc = 0xFFFFFFFFu;
+    for (size_t i = 0; i < len; ++i) {
+        crc = table[(crc ^ (unsigned char)data[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return crc ^ 0xFFFFFFFFu;
+}
+
+static void putU32(std::string& out, uint32_t v) {
+    for (int i = 0; i < 4; ++i) out += (char)((v >> (8 * i)) & 0xFF);
+}
+
+static uint32_t getU32(const char* p) {
+    uint32_t v = 0;
+    for (int i = 0; i < 4; ++i) v |= (uint32_t)(unsigned char)p[i] << (8 * i);
+    return v;
+}
+
+static void putField(std::string& out, const std::string& field) {
+    putU32(out, (uint32_t)field.size());
+    out += field;
+}
+
+static bool getField(const std::string& in, size_t& pos, std::string& field) {
+    if (pos + 4 > in.size()) return false;
+    uint32_t len = getU32(in.data() + pos);
+    if (pos + 4 + len > in.size()) return false;
+    field = in.substr(pos + 4, len);
+    pos += 4 + len;
+    return true;
+}
+
+string frameRecord(const std::string& payload) {
+    string frame;
+    frame.reserve(payload.size() + 8);
+    putU32(frame, (uint32_t)payload.size());
+    putU32(frame, crc32c(payload.data(), payload.size()));
+    frame += payload;
+    return frame;
+}
+
+// Lee un registro completo y válido; false al final, si está truncado o si el CRC no cuadra
+bool readRecord(std::istream& in, std::string& payload) {
+    char header[8];
+    if (!in.read(header, 8)) return false;
+    uint32_t len = getU32(header);
+    uint32_t crc = getU32(header + 4);
+    if (len > WAL_MAX_RECORD) return false;
+    payload.resize(len);
+    if (len > 0 && !in.read(&payload[0], len)) return false;
+    return crc32c(payload.data(), payload.size()) == crc;
+}
+
+// 'U': nombre, salt, hash y el id del usuario (los registros antiguos no lo traen)
+string encodeUser(const std::string& username, const UserData& data, UserId id) {
+    string payload(1, WAL_USER);
+    putField(payload, username);
+    putField(payload, data.salt);
+    putField(payload, data.hash);
+    if (id != NO_USER) putU32(payload, id);
+    return payload;
+}
+
+bool decodeUser(const std::string& payload, std::string& username, UserData& data, UserId& id) {
+    size_t pos = 1;
+    if (payload.empty() || payload[0] != WAL_USER || !getField(payload, pos, username) ||
+        !getField(payload, pos, data.salt) || !getField(payload, pos, data.hash)) {
+        return false;
+    }
+    id = pos + 4 <= payload.size() ? getU32(payload.data() + pos) : NO_USER;
+    return true;
+}
+
+// 'N': marca de tiempo, ids de remitente y destinatario (u32) y texto
+string encodeMessage(const StoredMessage& msg) {
+    string payload(1, WAL_MESSAGE_IDS);
+    putField(payload, msg.timestamp);
+    putU32(payload, msg.sender);
+    putU32(payload, msg.receiver);
+    putField(payload, msg.text);
+    return payload;
+}
+
+// 'M': formato anterior, con nombres (solo lo genera la migración de history.csv)
+string encodeLegacyMessage(const std::string& timestamp, const std::string& sender, const std::string& receiver, const std::string& text) {
+    string payload(1, WAL_MESSAGE);
+    putField(payload, timestamp);
+    putField(payload, sender);
+    putField(payload, receiver);
+    putField(payload, text);
+    return payload;
+}
+
+// Acepta ambos formatos; en 'M' un nombre sin registrar queda como NO_USER
+bool decodeMessage(const std::string& payload, StoredMessage& msg) {
+    size_t pos = 1;
+    if (!payload.empty() && payload[0] == WAL_MESSAGE_IDS) {
+        if (!getField(payload, pos, msg.timestamp) || pos + 8 > payload.size()) return false;
+        msg.sender = getU32(payload.data() + pos);
+        msg.receiver = getU32(payload.data() + pos + 4);
+        pos += 8;
+        return getField(payload, pos, msg.text);
+    }
+    string sender, receiver;
+    if (payload.empty() || payload[0] != WAL_MESSAGE || !getField(payload, pos, msg.timestamp) ||
+        !getField(payload, pos, sender) || !getField(payload, pos, receiver) || !getField(payload, pos, msg.text)) {
+        return false;
+    }
+    msg.sender = findUserId(sender);
+    msg.receiver = findUserId(receiver);
+    return true;
+}
+
+// Abre el log para append, recortando todo lo que haya tras 'validSize'
+bool openLog(WalFile& log, const std::string& path, long long validSize) {
+    lock_guard<mutex> lock(log.mtx);
+    log.path = path;
+    error_code ec;
+    if (filesystem::exists(path, ec) && (long long)filesystem::file_size(path, ec) > validSize) {
+        cout << "[LoquiServer] Truncando cola incompleta de " << path << " en el byte " << validSize << "." << std::endl;
+        filesystem::resize_file(path, validSize, ec);
+    }
+    log.file = fopen(path.c_str(), "ab");
+    log.size = validSize;
+    if (!log.file) {
+        cerr << "[LoquiServer] ERROR: No se pudo abrir " << path << " para escritura." << std::endl;
+        return false;
+    }
+    return true;
+}
+
+void closeLog(WalFile& log) {
+    lock_guard<mutex> lock(log.mtx);
+    if (log.file) fclose(log.file);
+    log.file = nullptr;
+}
+
+static bool syncFile(FILE* file) {
+    if (fflush(file) != 0) return false;
+#ifdef _WIN32
+    return _commit(_fileno(file)) == 0;
+#else
+    return fsync(fileno(file)) == 0;
+#endif
+}
+
+// Tras una escritura fallida (con el mutex del log tomado): quita del archivo
+// lo que llegara a escribirse del lote, así el siguiente registro empieza en
+// log.size. Si no se puede, el log queda cerrado y rechaza los appends.
+static void rollbackLog(WalFile& log) {
+    fclose(log.file);
+    log.file = nullptr;
+    error_code ec;
+    filesystem::resize_file(log.path, log.size, ec);
+    if (!ec) log.file = fopen(log.path.c_str(), "ab");
+    if (!log.file) {
+        cerr << "[LoquiServer] ERROR: " << log.path << " quedo inservible tras un fallo de escritura; no se aceptan mas registros." << std::endl;
+    }
+}
+
+// Añade un registro; devuelve su offset o -1 si falla
+long long appendLog(WalFile& log, const std::string& payload) {
+    return appendLog(log, vector<string>{payload});
+}
+
+// Varios registros con una sola escritura (y un solo sync); devuelve el offset del primero.
+// onAppended recibe ese offset todavía con el mutex del log tomado.
+long long appendLog(WalFile& log, const vector<std::string>& payloads, const function<void(long long)>& onAppended) {
+    string frame;
+    for (const string& payload : payloads) frame += frameRecord(payload);
+    long long offset;
+    {
+        lock_guard<mutex> lock(log.mtx);
+        if (!log.file) return -1;
+        // fflush siempre: HISTORY y la replicación leen el archivo directamente
+        if (fwrite(frame.data(), 1, frame.size(), log.file) != frame.size() ||
+            !(g_walSync ? syncFile(log.file) : fflush(log.file) == 0)) {
+            rollbackLog(log);
+            return -1;
+        }
+        offset = log.size;
+        log.size += frame.size();
+        if (onAppended) onAppended(offset);
+    }
+    notifyReplication();
+    return offset;
+}
+
+// Recorre los registros desde 'from' y devuelve dónde termina el último válido.
+// Con applyUsers carga cada usuario en g_userStore (y su id en la tabla de
+// símbolos); si no, es el historial y se completa g_historyIndex.
+// Un log grande se reparte en trozos (uno por núcleo) que empiezan en un límite
+// de registro; cada hilo valida y decodifica el suyo y los resultados se
+// aplican después en el orden del archivo.
+long long replayLog(const std::string& path, long long from, bool applyUsers) {
+    long long size = fileSize(path);
+    if (size <= from) return from;
+
+    long long chunkCount = max(1LL, min((long long)thread::hardware_concurrency(), (size - from) / LOAD_CHUNK_MIN));
+    vector<LoadChunk> chunks;
+    {
+        ifstream file(path, std::ios::binary);
+        chunks.push_back(LoadChunk());
+        chunks.back().begin = from;
+        for (long long i = 1; i < chunkCount; ++i) {
+            long long boundary = findRecordBoundary(file, from + (size - from) * i / chunkCount, size);
+            if (boundary <= chunks.back().begin) continue; // Sin límite cerca: el trozo anterior crece
+            chunks.back().end = boundary;
+            chunks.push_back(LoadChunk());
+            chunks.back().begin = boundary;
+        }
+        chunks.back().end = size;
+    }
+
+    vector<thread> workers;
+    for (size_t i = 1; i < chunks.size(); ++i) workers.emplace_back(parseChunk, cref(path), ref(chunks[i]), applyUsers);
+    parseChunk(path, chunks[0], applyUsers);
+    for (thread& worker : workers) worker.join();
+
+    // El log termina en el primer registro inválido. Si un registro cruza el
+    // límite de un trozo, el límite era un falso positivo: se relee secuencialmente.
+    for (size_t i = 0; i < chunks.size(); ++i) {
+        if (chunks[i].stop == chunks[i].end) continue;
+        if (chunks[i].stop > chunks[i].end && i + 1 < chunks.size()) {
+            chunks.resize(i + 2);
+            chunks[i + 1] = LoadChunk();
+            chunks[i + 1].begin = chunks[i].stop;
+            chunks[i + 1].end = size;
+            parseChunk(path, chunks[i + 1], applyUsers);
+        } else {
+            chunks.resize(i + 1);
+        }
+    }
+
+    string username;
+    UserData data;
+    UserId id;
+    for (LoadChunk& chunk : chunks) {
+        for (const string& payload : chunk.users) {
+            if (decodeUser(payload, username, data, id)) storeUser(username, data, id);
+        }
+        // Los permisos de adjuntos, como el índice, solo de los trozos aceptados
+        for (const StoredMessage& msg : chunk.attachments) noteAttachmentMessage(msg);
+        lock_guard<mutex> lock(g_historyIndexMutex);
+        for (auto& [conversation, offsets] : chunk.index) {
+            vector<long long>& merged = g_historyIndex[conversation];
+            merged.insert(merged.end(), offsets.begin(), offsets.end());
+        }
+    }
+    return chunks.back().stop;
+}
+
+// Primer inicio de registro válido (longitud, tipo y CRC correctos) a partir de
+// 'from', buscando en una ventana de 1 MB; -1 si no hay ninguno
+long long findRecordBoundary(std::ifstream& file, long long from, long long limit) {
+    string window((size_t)min(1LL << 20, limit - from), '\0');
+    file.clear();
+    file.seekg(from);
+    file.read(&window[0], window.size());
+    window.resize((size_t)file.gcount());
+
+    string payload;
+    for (size_t i = 0; i + 9 <= window.size(); ++i) {
+        uint32_t len = getU32(window.data() + i);
+        char type = window[i + 8];
+        if (len == 0 || len > WAL_MAX_RECORD || from + (long long)i + 8 + len > limit) continue;
+        if (type != WAL_USER && type != WAL_MESSAGE && type != WAL_MESSAGE_IDS) continue;
+        if (i + 8 + len <= window.size()) {
+            if (crc32c(window.data() + i + 8, len) == getU32(window.data() + i + 4)) return from + i;
+        } else {
+            file.clear();
+            file.seekg(from + i);
+            if (readRecord(file, payload)) return from + i;
+        }
+    }
+    return -1;
+}
+
+// Lee los registros que empiezan en [begin, end); stop queda al final del último válido
+void parseChunk(const std::string& path, LoadChunk& chunk, bool users) {
+    ifstream file(path, std::ios::binary);
+    file.seekg(chunk.begin);
+    chunk.stop = chunk.begin;
+    string payload;
+    StoredMessage msg;
+    while (chunk.stop < chunk.end && readRecord(file, payload)) {
+        if (users) {
+            chunk.users.push_back(payload);
+        } else if (decodeMessage(payload, msg)) {
+            chunk.index[conversationKey(msg.sender, msg.receiver)].push_back(chunk.stop);
+            if (!attachmentSha(msg.text).empty()) chunk.attachments.push_back(msg);
+        }
+        chunk.stop = (long long)file.tellg();
+    }
+}
+
+// Arranque: checkpoint + solo los registros posteriores
+void recoverStores() {
+    migrateLegacyFiles();
+
+    lock_guard<mutex> lock(g_userStoreMutex);
+    if (!loadCheckpoint() ||
+        g_checkpointUsers > fileSize(g_userFile) || g_checkpointHistory > fileSize(g_historyFile)) {
+        // Sin checkpoint válido (o logs más cortos que él): reconstrucción completa
+        clearUsers();
+        {
+            lock_guard<mutex> indexLock(g_historyIndexMutex);
+            g_historyIndex.clear();
+        }
+        {
+            lock_guard<mutex> accessLock(g_attachmentsMutex);
+            g_attachmentAccess.clear();
+        }
+        g_checkpointUsers = 0;
+        g_checkpointHistory = 0;
+    }
+
+    size_t fromCheckpoint = g_userStore.size() - 1;
+    auto start = chrono::steady_clock::now();
+    long long usersEnd = replayLog(g_userFile, g_checkpointUsers, true);
+    // El índice de conversaciones viene en el checkpoint: solo se indexa la cola
+    // del historial (los usuarios van antes: los registros antiguos traen nombres, no ids)
+    long long historyEnd = replayLog(g_historyFile, g_checkpointHistory, false);
+    openLog(g_userLog, g_userFile, usersEnd);
+    openLog(g_historyLog, g_historyFile, historyEnd);
+    long long elapsedMs = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - start).count();
+
+    cout << "[LoquiServer] Cargados " << g_userStore.size() - 1 << " usuarios (" << fromCheckpoint
+         << " desde checkpoint, " << (usersEnd - g_checkpointUsers) << " bytes de log) e indexados "
+         << (historyEnd - g_checkpointHistory) << " bytes de historial en " << elapsedMs << " ms." << std::endl;
+}
+
+// Convierte users.csv/history.csv a logs si aún no existen
+void migrateLegacyFiles() {
+    error_code ec;
+    if (!filesystem::exists(g_userFile, ec) && filesystem::exists(LEGACY_USER_FILE, ec)) {
+        ifstream in(LEGACY_USER_FILE);
+        ofstream out(g_userFile, std::ios::binary);
+        string line;
+        int count = 0;
+        while (getline(in, line)) {
+            vector<string> parts = split(line, ',');
+            if (parts.size() == 3) {
+                out << frameRecord(encodeUser(parts[0], {parts[1], parts[2]}, NO_USER));
+                count++;
+            }
+        }
+        cout << "[LoquiServer] Migrados " << count << " usuarios de " << LEGACY_USER_FILE << "." << std::endl;
+    }
+
+    if (!filesystem::exists(g_historyFile, ec) && filesystem::exists(LEGACY_HISTORY_FILE, ec)) {
+        ifstream in(LEGACY_HISTORY_FILE);
+        ofstream out(g_historyFile, std::ios::binary);
+        string line;
+        int count = 0;
+        while (getline(in, line)) {
+            // timestamp,sender,receiver,"message" (el mensaje puede contener comas)
+            size_t c1 = line.find(','), c2 = line.find(',', c1 + 1), c3 = line.find(',', c2 + 1);
+            if (c1 == string::npos || c2 == string::npos || c3 == string::npos) continue;
+            string text = line.substr(c3 + 1);
+            if (text.size() >= 2 && text.front() == '"' && text.back() == '"') text = text.substr(1, text.size() - 2);
+            out << frameRecord(encodeLegacyMessage(line.substr(0, c1), line.substr(c1 + 1, c2 - c1 - 1),
+                                                   line.substr(c2 + 1, c3 - c2 - 1), text));
+            count++;
+        }
+        cout << "[LoquiServer] Migrados " << count << " mensajes de " << LEGACY_HISTORY_FILE << "." << std::endl;
+    }
+}
+
+// checkpoint.dat: registro 'C' (offsets de ambos logs, nº de usuarios y de
+// registros del índice) seguido de un registro 'U' (con id) por usuario, los
+// 'H' del índice de conversaciones y los 'A' de permisos de adjuntos hasta
+// historyOffset. Se llama con g_userStoreMutex tomado.
+bool loadCheckpoint() {
+    ifstream file(g_checkpointFile, std::ios::binary);
+    if (!file.is_open()) return false;
+
+    string payload;
+    if (!readRecord(file, payload) || (payload.size() != 21 && payload.size() != 29) || payload[0] != WAL_CHECKPOINT) return false;
+    long long usersOffset = getU32(payload.data() + 1) | ((long long)getU32(payload.data() + 5) << 32);
+    long long historyOffset = getU32(payload.data() + 9) | ((long long)getU32(payload.data() + 13) << 32);
+    uint32_t userCount = getU32(payload.data() + 17);
+    // Un checkpoint sin índice (formato anterior) vale para los usuarios; el
+    // historial se relee entero
+    bool hasIndex = payload.size() == 29;
+    uint32_t indexRecords = hasIndex ? getU32(payload.data() + 21) : 0;
+    uint32_t accessRecords = hasIndex ? getU32(payload.data() + 25) : 0;
+
+    string username;
+    UserData data;
+    UserId id;
+    vector<pair<string, UserData>> users(userCount + 1);
+    for (uint32_t i = 0; i < userCount; ++i) {
+        // Un checkpoint anterior a los ids no sirve: se reconstruye desde el log
+        if (!readRecord(file, payload) || !decodeUser(payload, username, data, id) || id == NO_USER || id > userCount) return false;
+        users[id] = {username, data};
+    }
+
+    unordered_map<uint64_t, vector<long long>> index;
+    for (uint32_t i = 0; i < indexRecords; ++i) {
+        if (!readRecord(file, payload) || payload.size() < 13 || payload[0] != WAL_CHECKPOINT_INDEX) return false;
+        uint64_t key = getU32(payload.data() + 1) | ((uint64_t)getU32(payload.data() + 5) << 32);
+        uint32_t count = getU32(payload.data() + 9);
+        if (payload.size() != 13 + (size_t)count * 8) return false;
+        vector<long long>& offsets = index[key];
+        for (uint32_t j = 0; j < count; ++j) {
+            const char* p = payload.data() + 13 + (size_t)j * 8;
+            offsets.push_back(getU32(p) | ((long long)getU32(p + 4) << 32));
+        }
+    }
+
+    map<string, set<UserId>> access;
+    string sha;
+    for (uint32_t i = 0; i < accessRecords; ++i) {
+        size_t pos = 1;
+        if (!readRecord(file, payload) || payload.empty() || payload[0] != WAL_CHECKPOINT_ACCESS ||
+            !getField(payload, pos, sha) || pos + 4 > payload.size()) return false;
+        uint32_t count = getU32(payload.data() + pos);
+        if (payload.size() != pos + 4 + (size_t)count * 4) return false;
+        set<UserId>& allowed = access[sha];
+        for (uint32_t j = 0; j < count; ++j) allowed.insert(getU32(payload.data() + pos + 4 + (size_t)j * 4));
+    }
+
+    clearUsers();
+    for (UserId i = 1; i <= userCount; ++i) storeUser(users[i].first, users[i].second, i);
+    {
+        lock_guard<mutex> indexLock(g_historyIndexMutex);
+        g_historyIndex = std::move(index);
+    }
+    {
+        lock_guard<mutex> accessLock(g_attachmentsMutex);
+        g_attachmentAccess = std::move(access);
+    }
+    g_checkpointUsers = usersOffset;
+    g_checkpointHistory = hasIndex ? historyOffset : 0;
+    return true;
+}
+
+// Contenido de un checkpoint del estado actual y las posiciones de los logs que
+// cubre. Con onlyIfChanged devuelve false si nada ha cambiado desde el último.
+bool checkpointContent(std::string& content, long long& usersOffset, long long& historyOffset, bool onlyIfChanged) {
+    // Con g_userStoreMutex, g_userStore y g_userLog.size son coherentes
+    lock_guard<mutex> lock(g_userStoreMutex);
+    {
+        lock_guard<mutex> logLock(g_userLog.mtx);
+        if (g_userLog.file) syncFile(g_userLog.file);
+        usersOffset = g_userLog.size;
+    }
+    // El índice y los permisos se copian con el log tomado: cubren
+    // exactamente hasta historyOffset (saveMessages los actualiza dentro del append)
+    unordered_map<uint64_t, vector<long long>> index;
+    map<string, set<UserId>> access;
+    {
+        lock_guard<mutex> logLock(g_historyLog.mtx);
+        if (g_historyLog.file) syncFile(g_historyLog.file);
+        historyOffset = g_historyLog.size;
+        if (onlyIfChanged && usersOffset == g_checkpointUsers && historyOffset == g_checkpointHistory) return false;
+        {
+            lock_guard<mutex> indexLock(g_historyIndexMutex);
+            index = g_historyIndex;
+        }
+        lock_guard<mutex> accessLock(g_attachmentsMutex);
+        access = g_attachmentAccess;
+    }
+
+    string records;
+    uint32_t indexRecords = 0;
+    for (const auto& entry : index) {
+        for (size_t first = 0; first < entry.second.size(); first += CHECKPOINT_INDEX_SLICE) {
+            size_t count = std::min(CHECKPOINT_INDEX_SLICE, entry.second.size() - first);
+            string record(1, WAL_CHECKPOINT_INDEX);
+            putU32(record, (uint32_t)entry.first);
+            putU32(record, (uint32_t)(entry.first >> 32));
+            putU32(record, (uint32_t)count);
+            for (size_t i = first; i < first + count; ++i) {
+                putU32(record, (uint32_t)entry.second[i]);
+                putU32(record, (uint32_t)(entry.second[i] >> 32));
+            }
+            records += frameRecord(record);
+            indexRecords++;
+        }
+    }
+    for (const auto& entry : access) {
+        string record(1, WAL_CHECKPOINT_ACCESS);
+        putField(record, entry.first);
+        putU32(record, (uint32_t)entry.second.size());
+        for (UserId user : entry.second) putU32(record, user);
+        records += frameRecord(record);
+    }
+
+    string header(1, WAL_CHECKPOINT);
+    putU32(header, (uint32_t)usersOffset);
+    putU32(header, (uint32_t)(usersOffset >> 32));
+    putU32(header, (uint32_t)historyOffset);
+    putU32(header, (uint32_t)(historyOffset >> 32));
+    putU32(header, (uint32_t)(g_userStore.size() - 1));
+    putU32(header, indexRecords);
+    putU32(header, (uint32_t)access.size());
+    content = frameRecord(header);
+    for (UserId id = 1; id < g_userStore.size(); ++id) {
+        content += frameRecord(encodeUser(g_userNames[id], g_userStore[id], id));
+    }
+    content += records;
+    return true;
+}
+
+// Escribe un checkpoint nuevo de forma atómica (temporal + rename)
+void writeCheckpoint() {
+    string content;
+    long long usersOffset, historyOffset;
+    if (!checkpointContent(content, usersOffset, historyOffset, true)) return;
+
+    string tmp = g_checkpointFile + ".tmp";
+    FILE* file = fopen(tmp.c_str(), "wb");
+    if (!file || fwrite(content.data(), 1, content.size(), file) != content.size()) {
+        if (file) fclose(file);
+        cerr << "[LoquiServer] ERROR: No se pudo escribir " << tmp << "." << std::endl;
+        return;
+    }
+    syncFile(file);
+    fclose(file);
+
+    error_code ec;
+    filesystem::rename(tmp, g_checkpointFile, ec);
+    if (ec) {
+        cerr << "[LoquiServer] ERROR: No se pudo reemplazar " << g_checkpointFile << ": " << ec.message() << std::endl;
+        return;
+    }
+    g_checkpointUsers = usersOffset;
+    g_checkpointHistory = historyOffset;
+}
+
+// Checkpoint periódico (solo si los logs han crecido)
+void checkpointLoop() {
+    while (g_checkpointIntervalSec > 0) {
+        this_thread::sleep_for(chrono::seconds(g_checkpointIntervalSec));
+        writeCheckpoint();
+    }
+}
+
+// Escribe todo 'data' en la conexión (en claro o por TLS). Con compressible
+// (líneas de texto completas) y deflate negociado, lo que supere
+// compress.threshold se envía como trama Z.
+bool connWrite(Connection& conn, const std::string& input, bool compressible) {
+    lock_guard<mutex> lock(conn.ioMutex);
+    return connWriteLocked(conn, input, compressible);
+}
+
+// connWrite con ioMutex ya tomado. Una escritura que no se completa deja
+// el flujo a medias (registro TLS sin terminar, línea cortada): la conexión
+// se marca rota y se cierra, nadie más puede escribir detrás.
+bool connWriteLocked(Connection& conn, const std::string& input, bool compressible) {
+    if (conn.closed || conn.broken) return false;
+    string frame;
+#ifdef LOQUI_ZLIB
+    // Dentro de ioMutex: las tramas tienen que salir en el orden en que se comprimieron
+    bool compress = compressible && conn.deflater && input.size() >= (size_t)g_compressThreshold;
+    if (compress && !compressFrame(conn, input, frame)) {
+        markBroken(conn); // deflate puede haber consumido parte de la entrada
+        return false;
+    }
+#else
+    (void)compressible;
+    bool compress = false;
+#endif
+    const string& data = compress ? frame : input;
+#ifdef LOQUI_TLS
+    if (conn.ssl) {
+        // El socket es no bloqueante: esperar a que admita más datos si hace falta
+        size_t written = 0;
+        while (written < data.size()) {
+            int n = SSL_write(conn.ssl, data.data() + written, (int)(data.size() - written));
+            if (n > 0) {
+                written += n;
+                continue;
+            }
+            int err = SSL_get_error(conn.ssl, n);
+            WSAPOLLFD pfd = {conn.sock, (short)(err == SSL_ERROR_WANT_WRITE ? POLLWRNORM : POLLRDNORM), 0};
+            if ((err != SSL_ERROR_WANT_WRITE && err != SSL_ERROR_WANT_READ) || WSAPoll(&pfd, 1, 5000) <= 0) {
+                // SSL_write espera que se repita con los mismos datos: sin eso el
+                // registro pendiente queda a medias
+                markBroken(conn);
+                return false;
+            }
+        }
+        return true;
+    }
+#endif
+    if (!sendAll(conn.sock, data)) {
+        markBroken(conn);
+        return false;
+    }
+    return true;
+}
+
+// Con ioMutex tomado. El shutdown despierta al lector, que cierra la sesión.
+void markBroken(Connection& conn) {
+    conn.broken = true;
+    lock_guard<mutex> lock(conn.lifeMutex);
+    if (!conn.closed) shutdown(conn.sock, SD_BOTH);
+}
+
+// Lee lo disponible (como recv): >0 bytes, 0 cierre, <0 error
+int connRead(Connection& conn, char* buf, int len) {
+#ifdef LOQUI_TLS
+    if (conn.ssl) {
+        while (true) {
+            int err;
+            {
+                // Sin bloquear dentro del mutex: así los demás hilos pueden escribir
+                lock_guard<mutex> lock(conn.ioMutex);
+                if (conn.closed) return -1;
+                int n = SSL_read(conn.ssl, buf, len);
+                if (n > 0) return n;
+                err = SSL_get_error(conn.ssl, n);
+                if (err == SSL_ERROR_ZERO_RETURN) return 0;
+                if (err != SSL_ERROR_WANT_READ && err != SSL_ERROR_WANT_WRITE) return -1;
+            }
+            WSAPOLLFD pfd = {conn.sock, (short)(err == SSL_ERROR_WANT_WRITE ? POLLWRNORM : POLLRDNORM), 0};
+            if (WSAPoll(&pfd, 1, -1) < 0) return -1;
+        }
+    }
+#endif
+    return recv(conn.sock, buf, len, 0);
+}
+
+void closeConnection(Connection& conn) {
+    lock_guard<mutex> lock(conn.ioMutex);
+    if (conn.closed) return;
+#ifdef LOQUI_TLS
+    if (conn.ssl) {
+        SSL_shutdown(conn.ssl);
+        SSL_free(conn.ssl);
+        conn.ssl = nullptr;
+    }
+#endif
+#ifdef LOQUI_ZLIB
+    if (conn.deflater) {
+        deflateEnd(conn.deflater);
+        delete conn.deflater;
+        conn.deflater = nullptr;
+    }
+#endif
+    lock_guard<mutex> lifeLock(conn.lifeMutex);
+    conn.closed = true;
+    closesocket(conn.sock);
+}
+
+#ifdef LOQUI_ZLIB
+// Compresor deflate raw de la conexión, hasta que se cierre
+bool startCompression(Connection& conn) {
+    z_stream* z = new z_stream();
+    if (deflateInit2(z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -COMPRESS_WINDOW_BITS, COMPRESS_MEM_LEVEL, Z_DEFAULT_STRATEGY) != Z_OK) {
+        delete z;
+        return false;
+    }
+    lock_guard<mutex> lock(conn.ioMutex);
+    conn.deflater = z;
+    return true;
+}
+
+// Trama Z con 'data' comprimido. Se llama con ioMutex tomado. Si falla, o si
+// la trama no llega a enviarse entera, el flujo deflate del cliente queda
+// desincronizado: connWriteLocked marca la conexión rota y la cierra.
+bool compressFrame(Connection& conn, const std::string& data, std::string& frame) {
+    z_stream* z = conn.deflater;
+    string out;
+    char buf[16 * 1024];
+    z->next_in = (Bytef*)data.data();
+    z->avail_in = (uInt)data.size();
+    do {
+        z->next_out = (Bytef*)buf;
+        z->avail_out = sizeof(buf);
+        if (deflate(z, Z_SYNC_FLUSH) == Z_STREAM_ERROR) return false;
+        out.append(buf, sizeof(buf) - z->avail_out);
+    } while (z->avail_out == 0);
+    frame = "Z|" + to_string(out.size()) + "|" + to_string(data.size()) + "\n" + out;
+    g_compressBytesIn += data.size();
+    g_compressBytesOut += frame.size();
+    return true;
+}
+#endif
+
+// tls.cert / tls.key (PEM): con ambos, todas las conexiones de clientes usan TLS
+void initTls() {
+    string certFile = configString("tls.cert", "");
+    string keyFile = configString("tls.key", "");
+    if (certFile.empty() || keyFile.empty()) return;
+
+#ifdef LOQUI_TLS
+    g_tlsCtx = SSL_CTX_new(TLS_server_method());
+    SSL_CTX_set_min_proto_version(g_tlsCtx, TLS1_2_VERSION);
+    if (SSL_CTX_use_certificate_chain_file(g_tlsCtx, certFile.c_str()) != 1 ||
+        SSL_CTX_use_PrivateKey_file(g_tlsCtx, keyFile.c_str(), SSL_FILETYPE_PEM) != 1) {
+        cerr << "[LoquiServer] ERROR: No se pudo cargar " << certFile << " / " << keyFile << "." << std::endl;
+        ERR_print_errors_fp(stderr);
+        exit(1);
+    }
+
+    // Reanudación: tickets de sesión (sin estado en el servidor) para que los
+    // clientes que reconectan se salten el handshake completo
+    const unsigned char sessionContext[] = "LoquiServer";
+    SSL_CTX_set_session_id_context(g_tlsCtx, sessionContext, sizeof(sessionContext) - 1);
+    SSL_CTX_set_session_cache_mode(g_tlsCtx, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_set_num_tickets(g_tlsCtx, 2);
+#ifdef SSL_OP_ENABLE_KTLS
+    // Cifrado de registros en el kernel donde OpenSSL lo soporte (kTLS en Linux)
+    SSL_CTX_set_options(g_tlsCtx, SSL_OP_ENABLE_KTLS);
+#endif
+    cout << "[LoquiServer] TLS activado con " << certFile << "." << std::endl;
+#else
+    cerr << "[LoquiServer] tls.cert configurado pero el servidor se compilo sin TLS (LOQUI_ENABLE_TLS)." << std::endl;
+    exit(1);
+#endif
+}
+
+// Handshake TLS (bloqueante, con límite de 10 s); sin TLS no hace nada
+bool startTls(Connection& conn) {
+#ifdef LOQUI_TLS
+    if (!g_tlsCtx) return true;
+
+    DWORD timeoutMs = 10000;
+    setsockopt(conn.sock, SOL_SOCKET, SO_RCVTIMEO, (const char*)&timeoutMs, sizeof(timeoutMs));
+    conn.ssl = SSL_new(g_tlsCtx);
+    SSL_set_fd(conn.ssl, (int)conn.sock);
+    if (SSL_accept(conn.ssl) != 1) {
+        cerr << "[LoquiServer] Handshake TLS fallido." << std::endl;
+        return false;
+    }
+
+    timeoutMs = 0;
+    setsockopt(conn.sock, SOL_SOCKET, SO_RCVTIMEO, (const char*)&timeoutMs, sizeof(timeoutMs));
+    u_long nonBlocking = 1;
+    ioctlsocket(conn.sock, FIONBIO, &nonBlocking);
+
+    bool ktls = false;
+#ifdef SSL_OP_ENABLE_KTLS
+    ktls = BIO_get_ktls_send(SSL_get_wbio(conn.ssl)) == 1;
+#endif
+    cout << "[LoquiServer] TLS " << SSL_get_version(conn.ssl)
+         << (SSL_session_reused(conn.ssl) ? " (sesion reanudada)" : " (handshake completo)")
+         << (ktls ? " con kTLS." : ".") << std::endl;
+#endif
+    return true;
+}
+
+// --- Adjuntos ---
+
+// Solo aceptamos SHA-256 en hexadecimal: el sha forma parte de rutas en disco
+bool isValidSha(const std::string& sha) {
+    if (sha.size() != 64) return false;
+    for (char c : sha) {
+        if (!isdigit((unsigned char)c) && (c < 'a' || c > 'f')) return false;
+    }
+    return true;
+}
+
+// Nombre de adjunto seguro para guardarlo con ese nombre: solo el último
+// componente de la ruta, sin caracteres que Windows no admite ni nombres de
+// dispositivo (CON, NUL, COM1...). Vacío si no queda un nombre válido.
+string safeFileName(const std::string& name) {
+    string clean = name;
+    replace(clean.begin(), clean.end(), '\\', '/');
+    clean = filesystem::path(clean).filename().string();
+    for (char& c : clean) {
+        if ((unsigned char)c < 32 || string("<>:\"|?*").find(c) != string::npos) c = '_';
+    }
+    // Windows descarta los puntos y espacios finales: "CON." es CON y ".." queda vacío
+    while (!clean.empty() && (clean.back() == '.' || clean.back() == ' ')) clean.pop_back();
+    string device = clean.substr(0, clean.find('.'));
+    while (!device.empty() && device.back() == ' ') device.pop_back();
+    transform(device.begin(), device.end(), device.begin(), [](unsigned char c) { return (char)toupper(c); });
+    static const set<string> RESERVED = {"CON", "PRN", "AUX", "NUL", "COM1", "COM2", "COM3", "COM4", "COM5",
+                                         "COM6", "COM7", "COM8", "COM9", "LPT1", "LPT2", "LPT3", "LPT4",
+                                         "LPT5", "LPT6", "LPT7", "LPT8", "LPT9"};
+    return RESERVED.count(device) ? "" : clean;
+}
+
+// sha de un texto "@adjunto:<sha>:<tamaño>:<nombre>" (vacío si no es un adjunto)
+string attachmentSha(const std::string& text) {
+    if (text.rfind("@adjunto:", 0) != 0 || text.size() < 9 + 65 || text[9 + 64] != ':') return "";
+    string sha = text.substr(9, 64);
+    return isValidSha(sha) ? sha : "";
+}
+
+// Mensaje guardado o releído del historial: sus dos partes ven el adjunto
+void noteAttachmentMessage(const StoredMessage& msg) {
+    string sha = attachmentSha(msg.text);
+    if (sha.empty()) return;
+    lock_guard<mutex> lock(g_attachmentsMutex);
+    set<UserId>& users = g_attachmentAccess[sha];
+    users.insert(msg.sender);
+    users.insert(msg.receiver);
+}
+
+void grantAttachment(const std::string& sha, UserId user) {
+    lock_guard<mutex> lock(g_attachmentsMutex);
+    g_attachmentAccess[sha].insert(user);
+}
+
+bool canAccessAttachment(const std::string& sha, UserId user) {
+    lock_guard<mutex> lock(g_attachmentsMutex);
+    auto it = g_attachmentAccess.find(sha);
+    return it != g_attachmentAccess.end() && it->second.count(user) > 0;
+}
+
+string attachmentPath(const std::string& sha) {
+    return g_attachmentsDir + "/" + sha.substr(0, 2) + "/" + sha;
+}
+
+string attachmentPartPath(const std::string& sha, UserId user) {
+    return g_attachmentsDir + "/tmp/" + to_string(user) + "-" + sha + ".part";
+}
+
+// SHA-256 en hexadecimal de un archivo, leído por bloques
+string hashFile(const std::string& path) {
+    ifstream file(path, std::ios::binary);
+    if (!file.is_open()) return "";
+    picosha2::sha256 hasher;
+    vector<char> buf(1024 * 1024);
+    while (file.read(buf.data(), buf.size()) || file.gcount() > 0) {
+        hasher.process(buf.begin(), buf.begin() + file.gcount());
+    }
+    hasher.finish();
+    vector<unsigned char> hash(32);
+    hasher.get_hash_bytes(hash.begin());
+    static const char* HEX = "0123456789abcdef";
+    string hex;
+    for (unsigned char b : hash) {
+        hex += HEX[b >> 4];
+        hex += HEX[b & 0xF];
+    }
+    return hex;
+}
+
+// UPLOAD_BEGIN: si el contenido ya está en el almacén no hace falta subir nada
+// (deduplicación); si no, se reanuda desde lo que haya en el .part.
+void handleUploadBegin(ClientSession& session, const std::string& sha, long long size) {
+    Connection& conn = *session.conn;
+    if (!isValidSha(sha) || size <= 0 || size > g_attachmentMaxSize) {
+        sendResponse(conn, "RESP|ERROR|Adjunto invalido o mayor de " + to_string(g_attachmentMaxSize >> 20) + " MB.");
+        return;
+    }
+    // Deduplicación solo para quien ya tiene acceso: a los demás no se les dice
+    // que el contenido existe, lo suben entero (así demuestran tenerlo)
+    if (canAccessAttachment(sha, session.userId) && filesystem::exists(attachmentPath(sha))) {
+        sendResponse(conn, "UPLOAD_OK|" + sha);
+        return;
+    }
+
+    {
+        // Dos conexiones del mismo usuario subiendo lo mismo escribirían el mismo .part
+        lock_guard<mutex> lock(g_attachmentsMutex);
+        auto it = g_activeUploads.find({session.userId, sha});
+        if (it != g_activeUploads.end() && it->second != &session) {
+            sendResponse(conn, "RESP|RETRY|El adjunto se esta subiendo desde otra conexion.|2000");
+            return;
+        }
+        g_activeUploads[{session.userId, sha}] = &session;
+    }
+
+    PendingUpload& upload = session.uploads[sha];
+    if (upload.file) fclose(upload.file);
+    string partPath = attachmentPartPath(sha, session.userId);
+    error_code ec;
+    filesystem::create_directories(g_attachmentsDir + "/tmp", ec);
+    upload.size = size;
+    upload.offset = fileSize(partPath);
+    if (upload.offset > size) {
+        // .part de otro intento incompatible: empezar de cero
+        filesystem::remove(partPath, ec);
+        upload.offset = 0;
+    }
+    upload.file = fopen(partPath.c_str(), "ab");
+    if (!upload.file) {
+        session.uploads.erase(sha);
+        lock_guard<mutex> lock(g_attachmentsMutex);
+        g_activeUploads.erase({session.userId, sha});
+        sendResponse(conn, "RESP|ERROR|No se pudo guardar el adjunto.");
+        return;
+    }
+
+    if (upload.offset == size) {
+        finishUpload(session, sha);
+    } else {
+        sendResponse(conn, "UPLOAD_OFFSET|" + sha + "|" + to_string(upload.offset));
+    }
+}
+
+// UPLOAD_CHUNK: los trozos llegan en orden, sin confirmación individual; si el
+// offset no cuadra se contesta UPLOAD_OFFSET con la posición real para que el
+// cliente retroceda. Los trozos no llevan id: los errores van como
+// UPLOAD_ERROR|sha|texto para que el cliente sepa qué subida falló.
+void handleUploadChunk(ClientSession& session, const std::string& sha, long long offset, const std::string& data) {
+    auto it = session.uploads.find(sha);
+    if (it == session.uploads.end()) {
+        sendResponse(*session.conn, "UPLOAD_ERROR|" + sha + "|Subida no iniciada (falta UPLOAD_BEGIN).");
+        return;
+    }
+    PendingUpload& upload = it->second;
+    if (offset != upload.offset || upload.offset + (long long)data.size() > upload.size) {
+        sendResponse(*session.conn, "UPLOAD_OFFSET|" + sha + "|" + to_string(upload.offset));
+        return;
+    }
+    if (fwrite(data.data(), 1, data.size(), upload.file) != data.size()) {
+        sendResponse(*session.conn, "UPLOAD_ERROR|" + sha + "|No se pudo guardar el adjunto.");
+        return;
+    }
+    upload.offset += data.size();
+    g_attachmentBytesIn += data.size();
+    if (upload.offset == upload.size) finishUpload(session, sha);
+}
+
+// Comprueba el SHA-256 del .part completo y lo mueve al almacén
+void finishUpload(ClientSession& session, const std::string& sha) {
+    PendingUpload& upload = session.uploads[sha];
+    fclose(upload.file);
+    upload.file = nullptr;
+
+    string partPath = attachmentPartPath(sha, session.userId);
+    string finalPath = attachmentPath(sha);
+    error_code ec;
+    bool ok = hashFile(partPath) == sha;
+    if (ok && filesystem::exists(finalPath)) {
+        filesystem::remove(partPath, ec); // Ya estaba en el almacén (otro usuario lo subió)
+    } else if (ok) {
+        filesystem::create_directories(g_attachmentsDir + "/" + sha.substr(0, 2), ec);
+        filesystem::rename(partPath, finalPath, ec);
+        ok = !ec;
+    } else {
+        filesystem::remove(partPath, ec);
+    }
+    if (ok) grantAttachment(sha, session.userId);
+
+    session.uploads.erase(sha);
+    {
+        lock_guard<mutex> lock(g_attachmentsMutex);
+        g_activeUploads.erase({session.userId, sha});
+    }
+    if (ok) {
+        sendResponse(*session.conn, "UPLOAD_OK|" + sha);
+        cout << "[LoquiServer] Adjunto " << sha << " guardado." << std::endl;
+    } else {
+        sendResponse(*session.conn, "UPLOAD_ERROR|" + sha + "|El adjunto recibido no coincide con su SHA-256.");
+    }
+}
+
+// Al desconectar, las subidas a medias quedan en su .part para reanudarlas
+void releaseUploads(ClientSession& session) {
+    lock_guard<mutex> lock(g_attachmentsMutex);
+    for (auto& [sha, upload] : session.uploads) {
+        if (upload.file) fclose(upload.file);
+        g_activeUploads.erase({session.userId, sha});
+    }
+    session.uploads.clear();
+}
+
+void handleDownload(ClientSession& session, const std::string& sha, long long offset) {
+    // Solo quien envió o recibió un mensaje con el adjunto (o lo subió)
+    if (!isValidSha(sha) || !canAccessAttachment(sha, session.userId) || !filesystem::exists(attachmentPath(sha))) {
+        sendResponse(*session.conn, "RESP|ERROR|Adjunto no encontrado en el servidor.");
+        return;
+    }
+    if (g_downloadsInFlight.load() >= g_maxDownloads) {
+        g_shedTotal++;
+        sendResponse(*session.conn, "RESP|RETRY|Servidor ocupado, reintenta en 1000 ms.|1000");
+        return;
+    }
+    // En su propio hilo: este sigue leyendo comandos mientras se envía el archivo
+    g_downloadsInFlight++;
+    thread(streamAttachment, session.conn, sha, max(0LL, offset)).detach();
+}
+
+// Envía el adjunto en porciones FILE_DATA|sha|offset|longitud + bytes.
+// Cada porción toma el ioMutex por separado, así los MSG y respuestas de la
+// misma conexión se cuelan entre porciones en vez de esperar al archivo entero.
+void streamAttachment(shared_ptr<Connection> conn, std::string sha, long long offset) {
+    string path = attachmentPath(sha);
+    long long size = fileSize(path);
+    sendResponse(*conn, "FILE_INFO|" + sha + "|" + to_string(size));
+
+    bool plain = true;
+#ifdef LOQUI_TLS
+    plain = conn->ssl == nullptr; // Con TLS los bytes tienen que pasar por SSL_write
+#endif
+    HANDLE file = INVALID_HANDLE_VALUE;
+    ifstream in;
+    if (plain) {
+        file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    } else {
+        in.open(path, std::ios::binary);
+    }
+    bool ok = plain ? file != INVALID_HANDLE_VALUE : in.is_open();
+
+    string data;
+    while (ok && offset < size) {
+        long long len = min(ATTACH_SLICE, size - offset);
+        string header = "FILE_DATA|" + sha + "|" + to_string(offset) + "|" + to_string(len) + "\n";
+        if (plain) {
+            ok = transmitSlice(*conn, file, header, offset, len);
+        } else {
+            data.resize(len);
+            in.seekg(offset);
+            ok = in.read(&data[0], len) && connWrite(*conn, header + data);
+        }
+        offset += len;
+        g_attachmentBytesOut += len;
+    }
+
+    if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+    if (ok) sendResponse(*conn, "FILE_END|" + sha);
+    g_downloadsInFlight--;
+}
+
+// Cabecera + [offset, offset+len) del archivo con TransmitFile: el kernel lleva
+// los bytes de la caché de archivos al socket sin copiarlos al proceso
+bool transmitSlice(Connection& conn, HANDLE file, const std::string& header, long long offset, long long len) {
+    lock_guard<mutex> lock(conn.ioMutex);
+    if (conn.closed || conn.broken) return false;
+    LARGE_INTEGER pos;
+    pos.QuadPart = offset;
+    if (!SetFilePointerEx(file, pos, NULL, FILE_BEGIN)) return false;
+
+    TRANSMIT_FILE_BUFFERS buffers = {};
+    buffers.Head = (LPVOID)header.data();
+    buffers.HeadLength = (DWORD)header.size();
+    if (TransmitFile(conn.sock, file, (DWORD)len, 0, NULL, &buffers, 0) == FALSE) {
+        markBroken(conn); // Puede haber salido parte de la porción
+        return false;
+    }
+    return true;
+}
+
+// --- Heartbeats e inactividad ---
+
+// Reloj monótono en ms: los cambios de hora del sistema no deben cerrar conexiones
+long long monotonicMs() {
+    using namespace chrono;
+    return duration_cast<milliseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+void TimerWheel::schedule(long long delayMs, std::function<void()> callback) {
+    lock_guard<mutex> lock(mtx);
+    // Al menos un tick: la ranura actual ya se procesó
+    uint64_t ticks = (uint64_t)max(1LL, (delayMs + TICK_MS - 1) / TICK_MS);
+    place({current + ticks, move(callback)});
+}
+
+// Nivel l: temporizadores que vencen dentro de [64^l, 64^(l+1)) ticks
+void TimerWheel::place(Timer&& timer) {
+    uint64_t delta = timer.expiry - current;
+    const uint64_t maxDelta = (1ULL << (SLOT_BITS * LEVELS)) - 1;
+    if (delta > maxDelta) {
+        timer.expiry = current + maxDelta;
+        delta = maxDelta;
+    }
+    int level = 0;
+    while (level < LEVELS - 1 && delta >= (1ULL << (SLOT_BITS * (level + 1)))) level++;
+    slots[level][(timer.expiry >> (SLOT_BITS * level)) & (SLOTS - 1)].push_back(move(timer));
+}
+
+void TimerWheel::run() {
+    auto next = chrono::steady_clock::now();
+    while (true) {
+        next += chrono::milliseconds(TICK_MS);
+        this_thread::sleep_until(next);
+
+        vector<Timer> due;
+        {
+            lock_guard<mutex> lock(mtx);
+            current++;
+            // Al completar una vuelta de un nivel, su siguiente ranura baja al nivel inferior
+            for (int level = 1; level < LEVELS; ++level) {
+                if ((current & ((1ULL << (SLOT_BITS * level)) - 1)) != 0) break;
+                vector<Timer> cascade;
+                cascade.swap(slots[level][(current >> (SLOT_BITS * level)) & (SLOTS - 1)]);
+                for (Timer& timer : cascade) place(move(timer));
+            }
+            due.swap(slots[0][current & (SLOTS - 1)]);
+        }
+        // Fuera del mutex: los callbacks vuelven a programarse
+        for (Timer& timer : due) timer.callback();
+    }
+}
+
+// Programa el plazo de login y la primera comprobación de actividad
+void watchConnection(const shared_ptr<Connection>& conn) {
+    weak_ptr<Connection> weak = conn;
+    if (g_loginTimeoutSec > 0) {
+        g_timers.schedule(g_loginTimeoutSec * 1000LL, [weak] {
+            auto conn = weak.lock();
+            if (conn && !conn->authenticated) reapConnection(*conn, "sin login");
+        });
+    }
+    if (g_heartbeatIntervalSec > 0) {
+        g_timers.schedule(g_heartbeatIntervalSec * 1000LL, [weak] { heartbeatCheck(weak); });
+    }
+}
+
+// Un único temporizador por conexión que se reprograma a sí mismo: recibir
+// datos solo actualiza lastActivityMs, sin tocar la rueda.
+void heartbeatCheck(weak_ptr<Connection> weak) {
+    auto conn = weak.lock();
+    if (!conn) return;
+    {
+        lock_guard<mutex> lock(conn->lifeMutex);
+        if (conn->closed) return;
+    }
+
+    long long intervalMs = g_heartbeatIntervalSec * 1000LL;
+    long long idleMs = monotonicMs() - conn->lastActivityMs;
+    long long nextMs = intervalMs - idleMs;
+    // Los clientes sin HELLO no contestan a PING: solo se vigila su login
+    if (conn->heartbeats && idleMs >= intervalMs) {
+        long long timeoutMs = g_idleTimeoutSec * 1000LL;
+        if (g_idleTimeoutSec > 0 && idleMs >= timeoutMs) {
+            reapConnection(*conn, "inactiva");
+            return;
+        }
+        sendPing(*conn);
+        nextMs = g_idleTimeoutSec > 0 ? min(intervalMs, timeoutMs - idleMs) : intervalMs;
+    } else if (nextMs <= 0) {
+        nextMs = intervalMs;
+    }
+    g_timers.schedule(nextMs, [weak] { heartbeatCheck(weak); });
+}
+
+// PING sin bloquear el hilo de la rueda: si otro hilo está escribiendo o el
+// socket no admite datos ahora, la conexión ya tiene tráfico o está muerta.
+// Sale por connWriteLocked, como todo lo demás: un PING a medias también
+// deja la conexión rota y cerrada.
+void sendPing(Connection& conn) {
+    unique_lock<mutex> lock(conn.ioMutex, try_to_lock);
+    if (!lock.owns_lock() || conn.closed || conn.broken) return;
+    WSAPOLLFD pfd = {conn.sock, POLLWRNORM, 0};
+    if (WSAPoll(&pfd, 1, 0) <= 0 || !(pfd.revents & POLLWRNORM)) return;
+    connWriteLocked(conn, "PING\n", false);
+}
+
+// Los clientes sin HELLO no contestan a PING: para ellos el que detecta la
+// conexión medio abierta es el keepalive de TCP, con plazos parecidos a
+// heartbeat.interval / heartbeat.idle_timeout (Windows manda 10 sondas).
+// Con HELLO el PING llega antes y el keepalive no molesta.
+void enableKeepalive(SOCKET sock) {
+    if (g_idleTimeoutSec <= 0) return;
+    tcp_keepalive values = {};
+    values.onoff = 1;
+    long long idleSec = g_heartbeatIntervalSec > 0 ? min(g_heartbeatIntervalSec, g_idleTimeoutSec) : g_idleTimeoutSec;
+    values.keepalivetime = (unsigned long)(idleSec * 1000);
+    values.keepaliveinterval = (unsigned long)max(1000LL, (g_idleTimeoutSec - idleSec) * 1000LL / 10);
+    DWORD bytes = 0;
+    if (WSAIoctl(sock, SIO_KEEPALIVE_VALS, &values, sizeof(values), NULL, 0, &bytes, NULL, NULL) == SOCKET_ERROR) {
+        BOOL on = TRUE; // Al menos los plazos por defecto del sistema
+        setsockopt(sock, SOL_SOCKET, SO_KEEPALIVE, (const char*)&on, sizeof(on));
+    }
+}
+
+// shutdown despierta al recv bloqueado de handleClient, que hace la limpieza
+// habitual (sale de g_connectedClients, DIR|OFF) y cierra el socket.
+void reapConnection(Connection& conn, const char* reason) {
+    lock_guard<mutex> lock(conn.lifeMutex);
+    if (conn.closed) return;
+    shutdown(conn.sock, SD_BOTH);
+    g_reapedTotal++;
+    cout << "[LoquiServer] Conexion " << reason << " cerrada." << std::endl;
+}
+
+// --- Trazas ---
+
+long long traceNowUs() {
+    using namespace chrono;
+    return duration_cast<microseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+// Fin de una etapa del mensaje que se está trazando en este hilo (si lo hay)
+void traceMark(TraceStage stage) {
+    if (t_trace) t_trace->stampUs[stage] = traceNowUs();
+}
+
+void traceCommit(const MessageTrace& trace) {
+    uint64_t index = g_traceNext.fetch_add(1);
+    TraceSlot& slot = g_traceRing[index % TRACE_RING_SIZE];
+    // Seqlock: la marca impar tiene que verse antes que cualquier byte nuevo de
+    // la traza (un store release no impide que las escrituras siguientes se
+    // adelanten; la barrera sí), y la par después de todos
+    slot.seq.store(index * 2 + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    slot.trace = trace;
+    slot.trace.id = index;
+    slot.seq.store(index * 2 + 2, memory_order_release);
+}
+
+static string jsonEscape(const char* text) {
+    string out;
+    for (const char* p = text; *p; ++p) {
+        if (*p == '"' || *p == '\\') out += '\\';
+        if ((unsigned char)*p >= 0x20) out += *p;
+    }
+    return out;
+}
+
+// Trazas del anillo con latencia total >= minUs, como eventos "X" (uno por
+// etapa) en una fila por mensaje
+string renderTrace(long long minUs) {
+    stringstream out;
+    out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+    bool first = true;
+    for (TraceSlot& slot : g_traceRing) {
+        uint64_t before = slot.seq.load(memory_order_acquire);
+        if (before == 0 || (before & 1)) continue;
+        MessageTrace trace = slot.trace;
+        atomic_thread_fence(memory_order_acquire);
+        if (slot.seq.load(memory_order_relaxed) != before) continue; // Sobrescrita mientras la copiábamos
+
+        // Las etapas no siempre van en el mismo orden (MSGMULTI consulta el registro antes de persistir)
+        vector<pair<long long, int>> marks;
+        for (int i = 0; i < TRACE_STAGE_COUNT; ++i) {
+            if (trace.stampUs[i] > 0) marks.push_back({trace.stampUs[i], i});
+        }
+        sort(marks.begin(), marks.end());
+        if (marks.size() < 2 || marks.back().first - marks.front().first < minUs) continue;
+
+        string args = "{\"de\":\"" + jsonEscape(trace.from) + "\",\"para\":\"" + jsonEscape(trace.to) + "\"}";
+        out << (first ? "" : ",") << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << trace.id
+            << ",\"args\":{\"name\":\"" << jsonEscape(trace.command) << " #" << trace.id << " "
+            << (marks.back().first - marks.front().first) << " us\"}}";
+        first = false;
+        for (size_t i = 1; i < marks.size(); ++i) {
+            out << ",{\"name\":\"" << TRACE_STAGE_NAMES[marks[i].second] << "\",\"cat\":\"" << jsonEscape(trace.command)
+                << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << trace.id << ",\"ts\":" << marks[i - 1].first
+                << ",\"dur\":" << (marks[i].first - marks[i - 1].first) << ",\"args\":" << args << "}";
+        }
+    }
+    out << "]}";
+    return out.str();
+}
+
+// --- Caché de conversaciones recientes ---
+
+static size_t cachedSize(const CachedMessage& msg) {
+    return sizeof(CachedMessage) + msg.timestamp.size() + msg.text.size();
+}
+
+// Marca la conversación como la más reciente y desaloja las menos usadas
+// hasta volver al presupuesto. Con g_hotCacheMutex tomado.
+static void hotCacheTouch(uint64_t conversation, HotConversation& entry) {
+    g_hotLru.splice(g_hotLru.begin(), g_hotLru, entry.lru);
+    while (g_hotCacheBytes > g_hotCacheBudget && g_hotLru.size() > 1) {
+        auto victim = g_hotCache.find(g_hotLru.back());
+        g_hotCacheBytes -= victim->second.bytes;
+        g_hotCache.erase(victim);
+        g_hotLru.pop_back();
+    }
+}
+
+static HotConversation& hotCacheEntry(uint64_t conversation) {
+    auto [it, inserted] = g_hotCache.try_emplace(conversation);
+    if (inserted) {
+        g_hotLru.push_front(conversation);
+        it->second.lru = g_hotLru.begin();
+    }
+    return it->second;
+}
+
+// Quita los mensajes más antiguos por encima del límite por conversación
+static void hotCacheTrim(HotConversation& entry) {
+    while (entry.messages.size() > g_hotCacheMessages) {
+        entry.bytes -= cachedSize(entry.messages.front());
+        g_hotCacheBytes -= cachedSize(entry.messages.front());
+        entry.messages.pop_front();
+        entry.validFrom = entry.messages.front().id;
+        entry.complete = false;
+    }
+}
+
+// Mensaje recién persistido en 'id'. Se llama con g_historyLog.mtx tomado: los
+// ids llegan en orden y una conversación nueva empieza a ser válida desde aquí.
+void hotCacheAppend(const StoredMessage& msg, long long id) {
+    if (g_hotCacheBudget == 0) return;
+    uint64_t conversation = conversationKey(msg.sender, msg.receiver);
+    lock_guard<mutex> lock(g_hotCacheMutex);
+    bool known = g_hotCache.count(conversation) > 0;
+    HotConversation& entry = hotCacheEntry(conversation);
+    if (!known) entry.validFrom = id;
+    entry.messages.push_back({id, msg.timestamp, msg.sender, msg.text});
+    entry.bytes += cachedSize(entry.messages.back());
+    g_hotCacheBytes += cachedSize(entry.messages.back());
+    hotCacheTrim(entry);
+    hotCacheTouch(conversation, entry);
+}
+
+// Mensajes posteriores a 'sinceId' (-1 = toda la conversación), solo si la
+// caché los tiene todos. Si 'sinceId' no es de la conversación, reset=true y
+// hace falta tenerla completa.
+bool hotCacheRead(uint64_t conversation, long long sinceId, vector<CachedMessage>& out, bool& reset) {
+    lock_guard<mutex> lock(g_hotCacheMutex);
+    auto it = g_hotCache.find(conversation);
+    if (it != g_hotCache.end()) {
+        HotConversation& entry = it->second;
+        auto pos = find_if(entry.messages.begin(), entry.messages.end(),
+                           [&](const CachedMessage& m) { return m.id == sinceId; });
+        // Sin sinceId en la caché solo podemos responder si la tenemos completa
+        reset = sinceId < 0 || pos == entry.messages.end();
+        if (!reset || entry.complete) {
+            out.assign(reset ? entry.messages.begin() : pos + 1, entry.messages.end());
+            hotCacheTouch(conversation, entry);
+            g_hotCacheHits++;
+            return true;
+        }
+    }
+    g_hotCacheMisses++;
+    return false;
+}
+
+// Conversación completa leída del log hasta 'end'. Solo se instala si nada de
+// lo escrito después se ha perdido: o no se ha escrito nada, o la caché ya
+// tenía la conversación desde antes de 'end' (y con ella lo posterior).
+void hotCacheFill(uint64_t conversation, const vector<CachedMessage>& messages, long long end) {
+    if (g_hotCacheBudget == 0) return;
+    lock_guard<mutex> logLock(g_historyLog.mtx);
+    lock_guard<mutex> lock(g_hotCacheMutex);
+    auto it = g_hotCache.find(conversation);
+    bool cached = it != g_hotCache.end();
+    if (cached ? it->second.validFrom > end : g_historyLog.size != end) return;
+
+    HotConversation& entry = hotCacheEntry(conversation);
+    deque<CachedMessage> merged;
+    for (const CachedMessage& msg : messages) {
+        if (!cached || msg.id < entry.validFrom) merged.push_back(msg);
+    }
+    merged.insert(merged.end(), entry.messages.begin(), entry.messages.end());
+
+    g_hotCacheBytes -= entry.bytes;
+    entry.messages.swap(merged);
+    entry.bytes = 0;
+    for (const CachedMessage& msg : entry.messages) entry.bytes += cachedSize(msg);
+    g_hotCacheBytes += entry.bytes;
+    entry.complete = true;
+    entry.validFrom = 0;
+    hotCacheTrim(entry);
+    hotCacheTouch(conversation, entry);
+}
+
+// --- Snapshots ---
+
+// Hilo de SNAPSHOT: fija las posiciones de los logs, copia hasta ellas en
+// <snapshot_dir>/u<usuarios>-h<historial>.tmp y lo renombra al terminar
+void runSnapshot(shared_ptr<Connection> conn, std::string requestedBy) {
+    auto start = chrono::steady_clock::now();
+    string checkpoint;
+    long long usersOffset, historyOffset;
+    checkpointContent(checkpoint, usersOffset, historyOffset, false);
+
+    string name = "u" + to_string(usersOffset) + "-h" + to_string(historyOffset);
+    string dir = g_snapshotDir + "/" + name;
+    string tmp = dir + ".tmp";
+    string result;
+    error_code ec;
+    int linked = 0, copied = 0;
+
+    if (filesystem::exists(dir, ec)) {
+        result = "SNAPSHOT_RESP|OK|" + dir + "|" + to_string(usersOffset) + "|" + to_string(historyOffset);
+    } else {
+        filesystem::remove_all(tmp, ec);
+        filesystem::create_directories(tmp, ec);
+        bool ok = !ec && copyLogPrefix(g_userFile, tmp + "/users.log", usersOffset) &&
+                  copyLogPrefix(g_historyFile, tmp + "/history.log", historyOffset);
+
+        if (ok) {
+            FILE* file = fopen((tmp + "/checkpoint.dat").c_str(), "wb");
+            ok = file && fwrite(checkpoint.data(), 1, checkpoint.size(), file) == checkpoint.size();
+            if (file) {
+                ok = syncFile(file) && ok;
+                ok = fclose(file) == 0 && ok;
+            }
+        }
+
+        // Adjuntos terminados: hardlink si el sistema de archivos lo permite, copia si no
+        if (ok && filesystem::exists(g_attachmentsDir, ec)) {
+            for (auto it = filesystem::recursive_directory_iterator(g_attachmentsDir, ec);
+                 !ec && it != filesystem::recursive_directory_iterator(); it.increment(ec)) {
+                filesystem::path rel = filesystem::relative(it->path(), g_attachmentsDir, ec);
+                if (rel.begin()->string() == "tmp") continue; // Subidas a medias
+                filesystem::path target = filesystem::path(tmp) / "attachments" / rel;
+                error_code linkEc;
+                if (it->is_directory(linkEc)) {
+                    filesystem::create_directories(target, linkEc);
+                    continue;
+                }
+                filesystem::create_hard_link(it->path(), target, linkEc);
+                if (!linkEc) {
+                    linked++;
+                } else if (copyLogPrefix(it->path().string(), target.string(), fileSize(it->path().string()))) {
+                    copied++;
+                } else {
+                    ok = false;
+                    break;
+                }
+            }
+        }
+
+        if (ok) {
+            ofstream conf(tmp + "/snapshot.conf");
+            conf << "# Snapshot de LoquiServer pedido por " << requestedBy << " el " << getCurrentTimestamp() << "\n"
+                 << "# Posiciones: users " << usersOffset << ", history " << historyOffset << "\n"
+                 << "users_file=users.log\nhistory_file=history.log\ncheckpoint_file=checkpoint.dat\n"
+                 << "attachments_dir=attachments\n";
+            conf.close();
+            // Sin snapshot.conf completo no hay snapshot: el directorio temporal se borra abajo
+            ok = !conf.fail();
+        }
+        if (ok) {
+            filesystem::rename(tmp, dir, ec);
+            ok = !ec;
+        }
+
+        if (ok) {
+            g_snapshotsTotal++;
+            result = "SNAPSHOT_RESP|OK|" + dir + "|" + to_string(usersOffset) + "|" + to_string(historyOffset);
+        } else {
+            filesystem::remove_all(tmp, ec);
+            result = "SNAPSHOT_RESP|ERROR|No se pudo escribir en " + g_snapshotDir + ".";
+        }
+    }
+
+    long long elapsedMs = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - start).count();
+    cout << "[LoquiServer] Snapshot " << name << " (" << linked << " adjuntos enlazados, " << copied
+         << " copiados) en " << elapsedMs << " ms: " << result << std::endl;
+    sendResponse(*conn, result);
+    g_snapshotRunning = false;
+}
+
+// Copia los primeros 'length' bytes a ritmo limitado (snapshot.mb_per_sec).
+// Cede además mientras haya escrituras del historial en cola, para no
+// competir por el disco con los mensajes.
+bool copyLogPrefix(const std::string& from, const std::string& to, long long length) {
+    FILE* in = fopen(from.c_str(), "rb");
+    FILE* out = fopen(to.c_str(), "wb");
+    bool ok = in && out;
+    vector<char> buf(1024 * 1024);
+    auto start = chrono::steady_clock::now();
+    long long done = 0;
+    while (ok && done < length) {
+        size_t want = (size_t)min<long long>(buf.size(), length - done);
+        ok = fread(buf.data(), 1, want, in) == want && fwrite(buf.data(), 1, want, out) == want;
+        done += want;
+
+        if (g_snapshotMbPerSec > 0) {
+            auto due = start + chrono::microseconds(done * 1000000 / ((long long)g_snapshotMbPerSec << 20));
+            this_thread::sleep_until(due);
+        }
+        for (int i = 0; i < 100 && g_persistQueueDepth.load() > 0; ++i) {
+            this_thread::sleep_for(chrono::milliseconds(1)); // Como mucho 100 ms por bloque
+        }
+    }
+    if (out) {
+        if (ok) syncFile(out);
+        fclose(out);
+    }
+    if (in) fclose(in);
+    return ok;
+}
+
+// --- Relevo (reinicio sin cortes) ---
+
+// Acepta un cliente y lo cuenta en g_activeSessions (el hilo de la sesión lo
+// descuenta al terminar). Con upgrade.path espera con poll para dejar de
+// aceptar durante un relevo; la reserva va antes de mirar la bandera, así el
+// relevo nunca empieza con un accept a medias.
+SOCKET acceptClient(SOCKET listenSocket) {
+    if (g_upgradePath.empty()) {
+        SOCKET sock = accept(listenSocket, NULL, NULL);
+        if (sock != INVALID_SOCKET) g_activeSessions++;
+        return sock;
+    }
+    while (true) {
+        g_activeSessions++;
+        if (!g_handoffRequested) {
+            WSAPOLLFD pfd = {listenSocket, POLLRDNORM, 0};
+            int ready = WSAPoll(&pfd, 1, HANDOFF_POLL_MS);
+            if (ready != 0) {
+                SOCKET sock = ready > 0 ? accept(listenSocket, NULL, NULL) : INVALID_SOCKET;
+                if (sock == INVALID_SOCKET) g_activeSessions--;
+                return sock;
+            }
+        }
+        g_activeSessions--;
+        if (g_handoffRequested) this_thread::sleep_for(chrono::milliseconds(HANDOFF_POLL_MS));
+    }
+}
+
+// Espera datos del cliente. Con upgrade.path no bloquea más de HANDOFF_POLL_MS
+// seguidos; devuelve false si hay un relevo en curso y la sesión debe cederse.
+bool waitForInput(Connection& conn) {
+    return waitForInput(conn.sock);
+}
+
+bool waitForInput(SOCKET sock) {
+    if (g_upgradePath.empty()) return true;
+    while (!g_handoffRequested) {
+        WSAPOLLFD pfd = {sock, POLLRDNORM, 0};
+        if (WSAPoll(&pfd, 1, HANDOFF_POLL_MS) != 0) return true; // Datos, cierre o error: lo ve la lectura
+    }
+    return false;
+}
+
+// Detiene la sesión entre dos lecturas y guarda su estado para el proceso
+// nuevo. El socket queda abierto; 'closed' impide que este proceso vuelva a
+// escribir en él (entregas, PING) o a cerrarlo (reaper).
+void parkSession(ClientSession& session) {
+    {
+        lock_guard<mutex> lock(session.conn->ioMutex);
+        lock_guard<mutex> lifeLock(session.conn->lifeMutex);
+        session.conn->closed = true;
+    }
+    // Los .part quedan en disco; el proceso nuevo los reabre y sigue desde su tamaño
+    string state = encodeSessionState(session);
+    releaseUploads(session);
+    {
+        lock_guard<mutex> lock(g_handoffMutex);
+        g_parkedSessions.push_back({session.conn->sock, state});
+    }
+    g_activeSessions--;
+}
+
+// Enlace entrante de un par detenido en un relevo: [nodo][pendiente]
+// [u32 usuarios] y los usuarios que ese nodo tiene en el directorio, que el
+// proceso nuevo no puede saber (el par solo los manda al conectar)
+void parkPeer(SOCKET peerSocket, const std::string& peerId, const std::string& pending) {
+    string state;
+    putField(state, peerId);
+    putField(state, pending);
+    vector<string> users;
+    {
+        lock_guard<mutex> lock(g_remoteUsersMutex);
+        for (const auto& [user, node] : g_remoteUsers) {
+            if (node == peerId) users.push_back(user);
+        }
+    }
+    putU32(state, (uint32_t)users.size());
+    for (const string& user : users) putField(state, user);
+    {
+        lock_guard<mutex> lock(g_handoffMutex);
+        g_parkedPeers.push_back({peerSocket, state});
+    }
+    g_activeSessions--;
+}
+
+// Enlace de un par recibido en un relevo (o devuelto al cancelarlo)
+void resumePeer(SOCKET peerSocket, std::string state) {
+    size_t pos = 0;
+    string peerId, pending, user;
+    bool ok = getField(state, pos, peerId) && getField(state, pos, pending) && pos + 4 <= state.size();
+    uint32_t users = ok ? getU32(state.data() + pos) : 0;
+    pos += 4;
+    {
+        lock_guard<mutex> lock(g_remoteUsersMutex);
+        for (uint32_t i = 0; ok && i < users; ++i) {
+            ok = getField(state, pos, user);
+            if (ok) g_remoteUsers[user] = peerId;
+        }
+    }
+    if (!ok) {
+        cerr << "[LoquiServer] Estado de enlace de cluster heredado invalido. Cerrando enlace." << std::endl;
+        closesocket(peerSocket);
+        g_activeSessions--;
+        return;
+    }
+    handlePeer(peerSocket, peerId, pending);
+}
+
+// Estado de la sesión: [usuario][pendiente][cuenta local][u32 flags]
+// [u32 subidas] y por cada subida [sha][tamaño]
+string encodeSessionState(const ClientSession& session) {
+    const Connection& conn = *session.conn;
+    string out;
+    putField(out, session.username);
+    putField(out, session.pending);
+    putField(out, conn.peerAccount);
+    uint32_t flags = (session.framed ? 1 : 0) | (conn.heartbeats ? 2 : 0) | (conn.authenticated ? 4 : 0) | (conn.local ? 8 : 0);
+#ifdef LOQUI_ZLIB
+    if (conn.deflater) flags |= 16;
+#endif
+    putU32(out, flags);
+    putU32(out, (uint32_t)session.uploads.size());
+    for (const auto& [sha, upload] : session.uploads) {
+        putField(out, sha);
+        putField(out, to_string(upload.size));
+    }
+    return out;
+}
+
+bool decodeSessionState(const std::string& state, ClientSession& session) {
+    Connection& conn = *session.conn;
+    size_t pos = 0;
+    string username, uploadSize, sha;
+    if (!getField(state, pos, username) || !getField(state, pos, session.pending) ||
+        !getField(state, pos, conn.peerAccount) || pos + 8 > state.size()) {
+        return false;
+    }
+    uint32_t flags = getU32(state.data() + pos);
+    uint32_t uploads = getU32(state.data() + pos + 4);
+    pos += 8;
+    session.framed = (flags & 1) != 0;
+    conn.heartbeats = (flags & 2) != 0;
+    conn.authenticated = (flags & 4) != 0;
+    conn.local = (flags & 8) != 0;
+#ifdef LOQUI_ZLIB
+    // Compresor nuevo: tras un Z_SYNC_FLUSH el descompresor del cliente admite
+    // un flujo raw que empieza de cero (no hace referencia a nada anterior)
+    if ((flags & 16) != 0 && !startCompression(conn)) return false;
+#endif
+
+    if (!username.empty()) {
+        // Los ids vienen de users.log, que el proceso nuevo ya ha cargado
+        session.userId = findUserId(username);
+        if (session.userId == NO_USER) return false;
+        session.username = username;
+    }
+    for (uint32_t i = 0; i < uploads; ++i) {
+        if (!getField(state, pos, sha) || !getField(state, pos, uploadSize) || !isValidSha(sha)) return false;
+        PendingUpload& upload = session.uploads[sha];
+        upload.size = atoll(uploadSize.c_str());
+        upload.offset = fileSize(attachmentPartPath(sha, session.userId));
+        upload.file = fopen(attachmentPartPath(sha, session.userId).c_str(), "ab");
+        if (!upload.file) {
+            session.uploads.erase(sha);
+            continue; // El cliente recibirá UPLOAD_OFFSET o un error al mandar el siguiente trozo
+        }
+        lock_guard<mutex> lock(g_attachmentsMutex);
+        g_activeUploads[{session.userId, sha}] = &session;
+    }
+    return true;
+}
+
+// Socket de escucha heredado en un relevo (INVALID_SOCKET si no hay)
+SOCKET takeListener(const std::string& name) {
+    lock_guard<mutex> lock(g_handoffMutex);
+    auto it = g_inheritedListeners.find(name);
+    if (it == g_inheritedListeners.end()) return INVALID_SOCKET;
+    SOCKET sock = it->second;
+    g_inheritedListeners.erase(it);
+    return sock;
+}
+
+// Apunta un socket de escucha para pasarlo en un futuro relevo
+void keepListener(const std::string& name, SOCKET sock) {
+    lock_guard<mutex> lock(g_handoffMutex);
+    g_listeners[name] = sock;
+}
+
+// Atiende en upgrade.path las peticiones de relevo (TAKEOVER|<pid>) de un
+// LoquiServer nuevo. Quien obtiene el relevo se queda con todas las conexiones:
+// solo se acepta si el proceso al otro lado es el del pid pedido, corre con la
+// misma cuenta que este servidor y es el mismo ejecutable (misma ruta).
+void upgradeListener() {
+    sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    if (g_upgradePath.size() >= sizeof(addr.sun_path)) {
+        cerr << "[LoquiServer] upgrade.path demasiado larga: " << g_upgradePath << std::endl;
+        return;
+    }
+    memcpy(addr.sun_path, g_upgradePath.c_str(), g_upgradePath.size());
+
+    SOCKET listenSocket = socket(AF_UNIX, SOCK_STREAM, 0);
+    error_code ec;
+    filesystem::remove(g_upgradePath, ec);
+    if (listenSocket == INVALID_SOCKET ||
+        bind(listenSocket, (SOCKADDR*)&addr, sizeof(addr)) == SOCKET_ERROR ||
+        listen(listenSocket, 1) == SOCKET_ERROR) {
+        cerr << "[LoquiServer] No se pudo escuchar en " << g_upgradePath << ": " << WSAGetLastError() << std::endl;
+        if (listenSocket != INVALID_SOCKET) closesocket(listenSocket);
+        return;
+    }
+
+    while (true) {
+        SOCKET channel = accept(listenSocket, NULL, NULL);
+        if (channel == INVALID_SOCKET) continue;
+        string pending, line, reason;
+        if (recvLine(channel, pending, line) && line.rfind("TAKEOVER|", 0) == 0) {
+            unsigned long pid = strtoul(line.c_str() + 9, nullptr, 10);
+            if (!trustedUpgradePeer(channel, pid, reason)) {
+                cerr << "[LoquiServer] Relevo rechazado (proceso " << pid << "): " << reason << std::endl;
+                string error(1, 'X');
+                putField(error, "No autorizado: " + reason);
+                sendHandoffRecord(channel, error, INVALID_SOCKET, pid);
+            } else if (handOff(channel, pid)) {
+                cout << "[LoquiServer] Relevo completado; el proceso " << pid << " sigue con las conexiones." << std::endl;
+                cout.flush();
+                _Exit(0); // Sin cerrar nada: los sockets ya son también del proceso nuevo
+            }
+        }
+        closesocket(channel);
+    }
+}
+
+// Comprueba quién pide el relevo: el pid lo da el sistema (no el mensaje), y
+// su cuenta (SID) y su ejecutable tienen que ser los de este proceso
+bool trustedUpgradePeer(SOCKET channel, unsigned long pid, std::string& reason) {
+    ULONG peerPid = 0;
+    DWORD bytes = 0;
+    if (WSAIoctl(channel, SIO_AF_UNIX_GETPEERPID, NULL, 0, &peerPid, sizeof(peerPid), &bytes, NULL, NULL) == SOCKET_ERROR) {
+        reason = "no se pudo obtener el proceso del canal";
+        return false;
+    }
+    if (peerPid != pid) {
+        reason = "el pid no es el del proceso conectado (" + to_string(peerPid) + ")";
+        return false;
+    }
+    HANDLE peer = OpenProcess(PROCESS_QUERY_LIMITED_INFORMATION, FALSE, peerPid);
+    if (peer == NULL) {
+        reason = "no se pudo abrir el proceso";
+        return false;
+    }
+    string peerSid, ownSid;
+    wstring peerImage, ownImage;
+    bool known = processIdentity(peer, peerSid, peerImage) && processIdentity(GetCurrentProcess(), ownSid, ownImage);
+    CloseHandle(peer);
+    if (!known) {
+        reason = "no se pudo leer la cuenta o el ejecutable";
+    } else if (peerSid != ownSid) {
+        reason = "otra cuenta";
+    } else if (_wcsicmp(peerImage.c_str(), ownImage.c_str()) != 0) {
+        reason = "otro ejecutable";
+    }
+    return reason.empty();
+}
+
+// SID de la cuenta (bytes) y ruta completa del ejecutable de un proceso
+bool processIdentity(HANDLE process, std::string& sid, std::wstring& image) {
+    HANDLE token = NULL;
+    if (!OpenProcessToken(process, TOKEN_QUERY, &token)) return false;
+    char info[256];
+    DWORD infoLen = 0;
+    bool ok = GetTokenInformation(token, TokenUser, info, sizeof(info), &infoLen) != FALSE;
+    CloseHandle(token);
+    if (!ok) return false;
+    PSID user = ((TOKEN_USER*)info)->User.Sid;
+    sid.assign((const char*)user, GetLengthSid(user));
+
+    wchar_t path[MAX_PATH * 2];
+    DWORD pathLen = MAX_PATH * 2;
+    if (!QueryFullProcessImageNameW(process, 0, path, &pathLen)) return false;
+    image.assign(path, pathLen);
+    return true;
+}
+
+// Registros del relevo (formato frameRecord, el primer byte es el tipo):
+//   L[nombre]  socket de escucha        S<estado>  sesión (encodeSessionState)
+//   P<estado>  enlace entrante de un par (parkPeer)
+//   O[nodo][u32 n][línea]...  cola de salida hacia un par, aún sin enviar
+//   X[texto]   relevo rechazado         E          fin; el nuevo contesta "OK\n"
+// Devuelve true si el proceso nuevo confirmó: entonces este debe terminar.
+bool handOff(SOCKET channel, unsigned long pid) {
+    cout << "[LoquiServer] Relevo solicitado por el proceso " << pid << ". Deteniendo sesiones..." << std::endl;
+    g_handoffRequested = true;
+    // Cada sesión y cada enlace de un par se detienen entre dos líneas, los
+    // peerSender acaban el lote en curso; las descargas y los snapshots terminan
+    auto busy = [] {
+        return g_activeSessions.load() > 0 || g_peerSends.load() > 0 || g_downloadsInFlight.load() > 0 || g_snapshotRunning.load();
+    };
+    auto deadline = chrono::steady_clock::now() + chrono::seconds(g_upgradeDrainTimeoutSec);
+    while (busy() && chrono::steady_clock::now() < deadline) {
+        this_thread::sleep_for(chrono::milliseconds(10));
+    }
+    if (busy()) {
+        string error(1, 'X');
+        putField(error, "Sesiones, descargas o snapshots sin terminar tras " + to_string(g_upgradeDrainTimeoutSec) + " s.");
+        sendHandoffRecord(channel, error, INVALID_SOCKET, pid);
+        cerr << "[LoquiServer] Relevo cancelado: el servidor no quedo en reposo a tiempo." << std::endl;
+        abortHandoff(false);
+        return false;
+    }
+
+    // Logs en disco y cerrados: el proceso nuevo los abre cuando este termine
+    writeCheckpoint();
+    closeLog(g_userLog);
+    closeLog(g_historyLog);
+
+    bool ok = true;
+    size_t sessions;
+    {
+        lock_guard<mutex> lock(g_handoffMutex);
+        for (const auto& [name, sock] : g_listeners) {
+            string record(1, 'L');
+            putField(record, name);
+            ok = ok && sendHandoffRecord(channel, record, sock, pid);
+        }
+        for (const ParkedSession& parked : g_parkedSessions) {
+            ok = ok && sendHandoffRecord(channel, "S" + parked.state, parked.sock, pid);
+        }
+        for (const ParkedSession& parked : g_parkedPeers) {
+            ok = ok && sendHandoffRecord(channel, "P" + parked.state, parked.sock, pid);
+        }
+        sessions = g_parkedSessions.size();
+    }
+    // Lo que no salió hacia los pares lo envía el proceso nuevo. Se copia (si el
+    // relevo se cancela, la cola sigue aquí); el saludo y los PING no hacen falta.
+    for (auto& peer : g_peers) {
+        string record(1, 'O');
+        putField(record, peer->nodeId);
+        vector<string> lines;
+        {
+            lock_guard<mutex> lock(peer->mtx);
+            for (const string& line : peer->outbox) {
+                if (line != "PING" && line.rfind("DIR|", 0) != 0 && line.rfind("NODE|", 0) != 0) lines.push_back(line);
+            }
+        }
+        putU32(record, (uint32_t)lines.size());
+        for (const string& line : lines) putField(record, line);
+        ok = ok && sendHandoffRecord(channel, record, INVALID_SOCKET, pid);
+    }
+    ok = ok && sendHandoffRecord(channel, "E", INVALID_SOCKET, pid);
+
+    string pending, line;
+    if (ok && recvLine(channel, pending, line) && line == "OK") {
+        cout << "[LoquiServer] " << sessions << " sesiones entregadas al proceso " << pid << "." << std::endl;
+        return true;
+    }
+    cerr << "[LoquiServer] El proceso nuevo no confirmo el relevo; se reanuda el servicio." << std::endl;
+    abortHandoff(true);
+    return false;
+}
+
+// Relevo fallido: reabrir los logs y retomar aquí las sesiones detenidas
+void abortHandoff(bool reopenLogs) {
+    if (reopenLogs) {
+        openLog(g_userLog, g_userFile, g_userLog.size);
+        openLog(g_historyLog, g_historyFile, g_historyLog.size);
+    }
+    vector<ParkedSession> parked, peers;
+    {
+        lock_guard<mutex> lock(g_handoffMutex);
+        parked.swap(g_parkedSessions);
+        peers.swap(g_parkedPeers);
+    }
+    g_handoffRequested = false; // Antes de reanudar: si no, volverían a detenerse
+    for (ParkedSession& session : parked) {
+        g_activeSessions++;
+        thread(resumeClient, session.sock, move(session.state)).detach();
+    }
+    for (ParkedSession& link : peers) {
+        g_activeSessions++;
+        thread(resumePeer, link.sock, move(link.state)).detach();
+    }
+}
+
+// --takeover: pide el relevo al proceso que escucha en upgrade.path y recibe
+// sus sockets y sesiones. Vuelve cuando ese proceso ha terminado, así los logs
+// ya no tienen otro escritor.
+bool receiveHandoff() {
+    if (g_upgradePath.empty()) {
+        cerr << "[LoquiServer] --takeover necesita upgrade.path en la configuracion." << std::endl;
+        return false;
+    }
+    sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    if (g_upgradePath.size() >= sizeof(addr.sun_path)) {
+        cerr << "[LoquiServer] upgrade.path demasiado larga: " << g_upgradePath << std::endl;
+        return false;
+    }
+    memcpy(addr.sun_path, g_upgradePath.c_str(), g_upgradePath.size());
+    SOCKET channel = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (channel == INVALID_SOCKET || connect(channel, (SOCKADDR*)&addr, sizeof(addr)) == SOCKET_ERROR) {
+        cerr << "[LoquiServer] No se pudo contactar con el servidor en " << g_upgradePath << ": " << WSAGetLastError() << std::endl;
+        if (channel != INVALID_SOCKET) closesocket(channel);
+        return false;
+    }
+    unsigned long pid = GetCurrentProcessId();
+    cout << "[LoquiServer] Pidiendo el relevo al servidor en " << g_upgradePath << "..." << std::endl;
+
+    bool done = sendAll(channel, "TAKEOVER|" + to_string(pid) + "\n");
+    string error;
+    while (done) {
+        string payload;
+        SOCKET sock;
+        if (!recvHandoffRecord(channel, payload, sock) || payload.empty()) {
+            error = "canal cerrado o registro invalido";
+            break;
+        }
+        size_t pos = 1;
+        string name;
+        if (payload[0] == 'L' && getField(payload, pos, name) && sock != INVALID_SOCKET) {
+            g_inheritedListeners[name] = sock;
+        } else if (payload[0] == 'S' && sock != INVALID_SOCKET) {
+            g_inheritedSessions.push_back({sock, payload.substr(1)});
+        } else if (payload[0] == 'P' && sock != INVALID_SOCKET) {
+            g_inheritedPeers.push_back({sock, payload.substr(1)});
+        } else if (payload[0] == 'O' && getField(payload, pos, name) && pos + 4 <= payload.size()) {
+            // Cola hacia un par: delante de lo que se encole aquí (loadClusterConfig ya creó g_peers)
+            uint32_t count = getU32(payload.data() + pos);
+            pos += 4;
+            string line;
+            for (auto& peer : g_peers) {
+                if (peer->nodeId != name) continue;
+                for (uint32_t i = 0; i < count && getField(payload, pos, line); ++i) peer->outbox.push_back(line);
+            }
+        } else if (payload[0] == 'E') {
+            break;
+        } else {
+            if (sock != INVALID_SOCKET) closesocket(sock);
+            error = payload[0] == 'X' && getField(payload, pos, name) ? name : "registro inesperado";
+            break;
+        }
+    }
+    if (!done || !error.empty() || !sendAll(channel, "OK\n")) {
+        cerr << "[LoquiServer] Relevo fallido: " << (error.empty() ? "canal cerrado" : error) << std::endl;
+        for (auto& [name, sock] : g_inheritedListeners) closesocket(sock);
+        for (ParkedSession& parked : g_inheritedSessions) closesocket(parked.sock);
+        for (ParkedSession& parked : g_inheritedPeers) closesocket(parked.sock);
+        for (auto& peer : g_peers) peer->outbox.clear();
+        g_inheritedListeners.clear();
+        g_inheritedSessions.clear();
+        g_inheritedPeers.clear();
+        closesocket(channel);
+        return false;
+    }
+
+    // El proceso anterior termina al recibir OK; el cierre del canal lo confirma
+    char c;
+    while (recv(channel, &c, 1, 0) > 0) {
+    }
+    closesocket(channel);
+    cout << "[LoquiServer] Relevo recibido: " << g_inheritedListeners.size() << " sockets de escucha, "
+         << g_inheritedSessions.size() << " sesiones y " << g_inheritedPeers.size() << " enlaces de cluster." << std::endl;
+    return true;
+}
+
+// Envía un registro del relevo con un socket adjunto (INVALID_SOCKET = ninguno):
+// WSADuplicateSocket para el proceso 'pid'; su WSAPROTOCOL_INFO va como primer
+// campo del contenido.
+bool sendHandoffRecord(SOCKET channel, const std::string& payload, SOCKET sock, unsigned long pid) {
+    string info;
+    if (sock != INVALID_SOCKET) {
+        WSAPROTOCOL_INFOW protocolInfo;
+        if (WSADuplicateSocketW(sock, pid, &protocolInfo) != 0) return false;
+        info.assign((const char*)&protocolInfo, sizeof(protocolInfo));
+    }
+    string body;
+    putField(body, info);
+    return sendAll(channel, frameRecord(body + payload));
+}
+
+// Lee un registro del relevo sin pasar de su final. 'sock' recibe el socket
+// adjunto, si lo hay.
+bool recvHandoffRecord(SOCKET channel, std::string& payload, SOCKET& sock) {
+    sock = INVALID_SOCKET;
+    auto fail = [&sock] {
+        if (sock != INVALID_SOCKET) closesocket(sock);
+        sock = INVALID_SOCKET;
+        return false;
+    };
+    char header[8];
+    size_t got = 0;
+    while (got < sizeof(header)) {
+        int n = recv(channel, header + got, (int)(sizeof(header) - got), 0);
+        if (n <= 0) return fail();
+        got += n;
+    }
+    uint32_t len = getU32(header);
+    if (len > WAL_MAX_RECORD) return fail();
+    payload.resize(len);
+    for (got = 0; got < len;) {
+        int n = recv(channel, &payload[got], (int)(len - got), 0);
+        if (n <= 0) return fail();
+        got += n;
+    }
+    if (crc32c(payload.data(), len) != getU32(header + 4)) return fail();
+    size_t pos = 0;
+    string info;
+    if (!getField(payload, pos, info)) return false;
+    payload.erase(0, pos);
+    if (info.size() == sizeof(WSAPROTOCOL_INFOW)) {
+        WSAPROTOCOL_INFOW protocolInfo;
+        memcpy(&protocolInfo, info.data(), sizeof(protocolInfo));
+        sock = WSASocketW(FROM_PROTOCOL_INFO, FROM_PROTOCOL_INFO, FROM_PROTOCOL_INFO, &protocolInfo, 0, WSA_FLAG_OVERLAPPED);
+        if (sock == INVALID_SOCKET) return false;
+    }
+    return true;
 }
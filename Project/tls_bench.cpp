@@ -0,0 +1,204 @@
+/*
+ * LOQUI TLS BENCH
+ * Compara el rendimiento del transporte en claro frente a TLS sobre loopback.
+ *
+ * Uso: LoquiTlsBench <cert.pem> <key.pem> [MB=256] [handshakes=50]
+ * - Throughput: un emisor manda MB megas en bloques de 16 KB a un receptor.
+ * - Handshakes: media de handshakes completos frente a reanudados con ticket.
+ * Se compila solo con -DLOQUI_ENABLE_TLS=ON.
+ */
+
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <thread>
+#include <chrono>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+
+using namespace std;
+
+const size_t CHUNK = 16 * 1024;
+
+// Prototipos
+SOCKET listenLoopback(int& port);
+SOCKET connectLoopback(int port);
+double runThroughput(SSL_CTX* serverCtx, SSL_CTX* clientCtx, size_t totalBytes);
+double runHandshakes(SSL_CTX* serverCtx, SSL_CTX* clientCtx, int count, bool resume);
+
+int main(int argc, char* argv[]) {
+    if (argc < 3) {
+        cerr << "Uso: LoquiTlsBench <cert.pem> <key.pem> [MB=256] [handshakes=50]" << std::endl;
+        return 1;
+    }
+    size_t megabytes = argc > 3 ? atoi(argv[3]) : 256;
+    int handshakes = argc > 4 ? atoi(argv[4]) : 50;
+
+    WSADATA wsaData;
+    if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0) {
+        cerr << "WSAStartup failed" << std::endl;
+        return 1;
+    }
+
+    // Misma configuración que LoquiServer / LoquiClient
+    SSL_CTX* serverCtx = SSL_CTX_new(TLS_server_method());
+    SSL_CTX_set_min_proto_version(serverCtx, TLS1_2_VERSION);
+    if (SSL_CTX_use_certificate_chain_file(serverCtx, argv[1]) != 1 ||
+        SSL_CTX_use_PrivateKey_file(serverCtx, argv[2], SSL_FILETYPE_PEM) != 1) {
+        ERR_print_errors_fp(stderr);
+        return 1;
+    }
+    const unsigned char sessionContext[] = "LoquiServer";
+    SSL_CTX_set_session_id_context(serverCtx, sessionContext, sizeof(sessionContext) - 1);
+    SSL_CTX* clientCtx = SSL_CTX_new(TLS_client_method());
+    SSL_CTX_set_min_proto_version(clientCtx, TLS1_2_VERSION);
+#ifdef SSL_OP_ENABLE_KTLS
+    SSL_CTX_set_options(serverCtx, SSL_OP_ENABLE_KTLS);
+    SSL_CTX_set_options(clientCtx, SSL_OP_ENABLE_KTLS);
+#endif
+
+    size_t totalBytes = megabytes * 1024 * 1024;
+    double plain = runThroughput(nullptr, nullptr, totalBytes);
+    double tls = runThroughput(serverCtx, clientCtx, totalBytes);
+    cout << "Throughput en claro: " << plain << " MB/s" << std::endl;
+    cout << "Throughput TLS:      " << tls << " MB/s (" << (plain > 0 ? tls * 100 / plain : 0) << "% del claro)" << std::endl;
+
+    double full = runHandshakes(serverCtx, clientCtx, handshakes, false);
+    double resumed = runHandshakes(serverCtx, clientCtx, handshakes, true);
+    cout << "Handshake completo:  " << full << " ms" << std::endl;
+    cout << "Handshake reanudado: " << resumed << " ms" << std::endl;
+
+    SSL_CTX_free(serverCtx);
+    SSL_CTX_free(clientCtx);
+    WSACleanup();
+    return 0;
+}
+
+// Socket de escucha en 127.0.0.1 con puerto elegido por el sistema
+SOCKET listenLoopback(int& port) {
+    SOCKET listenSocket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = 0;
+    inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+    bind(listenSocket, (SOCKADDR*)&addr, sizeof(addr));
+    listen(listenSocket, SOMAXCONN);
+
+    socklen_t len = sizeof(addr);
+    getsockname(listenSocket, (SOCKADDR*)&addr, &len);
+    port = ntohs(addr.sin_port);
+    return listenSocket;
+}
+
+SOCKET connectLoopback(int port) {
+    SOCKET sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+    connect(sock, (SOCKADDR*)&addr, sizeof(addr));
+    return sock;
+}
+
+// MB/s de un emisor a un receptor; sin contextos es en claro
+double runThroughput(SSL_CTX* serverCtx, SSL_CTX* clientCtx, size_t totalBytes) {
+    int port;
+    SOCKET listenSocket = listenLoopback(port);
+
+    thread receiver([&] {
+        SOCKET sock = accept(listenSocket, NULL, NULL);
+        SSL* ssl = nullptr;
+        if (serverCtx) {
+            ssl = SSL_new(serverCtx);
+            SSL_set_fd(ssl, (int)sock);
+            SSL_accept(ssl);
+        }
+        vector<char> buf(CHUNK);
+        size_t received = 0;
+        while (received < totalBytes) {
+            int n = ssl ? SSL_read(ssl, buf.data(), (int)buf.size()) : recv(sock, buf.data(), (int)buf.size(), 0);
+            if (n <= 0) break;
+            received += n;
+        }
+        if (ssl) SSL_free(ssl);
+        closesocket(sock);
+    });
+
+    SOCKET sock = connectLoopback(port);
+    SSL* ssl = nullptr;
+    if (clientCtx) {
+        ssl = SSL_new(clientCtx);
+        SSL_set_fd(ssl, (int)sock);
+        SSL_connect(ssl);
+    }
+
+    vector<char> buf(CHUNK, 'x');
+    auto start = chrono::steady_clock::now();
+    for (size_t sent = 0; sent < totalBytes;) {
+        int n = ssl ? SSL_write(ssl, buf.data(), (int)buf.size()) : send(sock, buf.data(), (int)buf.size(), 0);
+        if (n <= 0) break;
+        sent += n;
+    }
+    receiver.join();
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    if (ssl) SSL_free(ssl);
+    closesocket(sock);
+    closesocket(listenSocket);
+    return seconds > 0 ? totalBytes / (1024.0 * 1024.0) / seconds : 0;
+}
+
+// Media en ms de 'count' handshakes; con resume se reutiliza el ticket anterior
+double runHandshakes(SSL_CTX* serverCtx, SSL_CTX* clientCtx, int count, bool resume) {
+    int port;
+    SOCKET listenSocket = listenLoopback(port);
+    SSL_SESSION* session = nullptr;
+    double totalMs = 0;
+    int reused = 0;
+
+    for (int i = 0; i < count; ++i) {
+        thread acceptor([&] {
+            SOCKET sock = accept(listenSocket, NULL, NULL);
+            SSL* ssl = SSL_new(serverCtx);
+            SSL_set_fd(ssl, (int)sock);
+            if (SSL_accept(ssl) == 1) {
+                // En TLS 1.3 los tickets viajan tras el handshake: un intercambio
+                // de un byte garantiza que el cliente los procese
+                char byte;
+                if (SSL_read(ssl, &byte, 1) == 1) SSL_write(ssl, &byte, 1);
+                SSL_shutdown(ssl);
+            }
+            SSL_free(ssl);
+            closesocket(sock);
+        });
+
+        SOCKET sock = connectLoopback(port);
+        SSL* ssl = SSL_new(clientCtx);
+        SSL_set_fd(ssl, (int)sock);
+        if (resume && session) SSL_set_session(ssl, session);
+
+        auto start = chrono::steady_clock::now();
+        SSL_connect(ssl);
+        totalMs += chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+        if (SSL_session_reused(ssl)) reused++;
+
+        char byte = 'x';
+        SSL_write(ssl, &byte, 1);
+        SSL_read(ssl, &byte, 1); // Procesa también los tickets pendientes
+        if (resume) {
+            if (session) SSL_SESSION_free(session);
+            session = SSL_get1_session(ssl);
+        }
+        SSL_shutdown(ssl); // Sin cierre ordenado OpenSSL invalida la sesión
+        SSL_free(ssl);
+        closesocket(sock);
+        acceptor.join();
+    }
+
+    if (session) SSL_SESSION_free(session);
+    closesocket(listenSocket);
+    if (resume) cout << "(" << reused << "/" << count << " sesiones reanudadas)" << std::endl;
+    return count > 0 ? totalMs / count : 0;
+}